@@ -0,0 +1,115 @@
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/. */
+
+/* Copyright (c) 2017, Yuxuan Shui <yshuiv7@gmail.com> */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "byte_buf.h"
+#include "common.h"
+
+char *byte_buf_reserve(struct byte_buf *b, size_t n) {
+	size_t cap = byte_buf_capacity(b);
+	if (b->start + b->len + n <= cap) {
+		return byte_buf_data(b) + b->len;
+	}
+
+	char *storage = b->heap ? b->heap : b->inline_;
+	if (b->len + n <= cap && b->start >= b->len) {
+		// There is enough space if we move the content to the front. Only do
+		// this if the content is not bigger than what has been consumed, so the
+		// cost of moving is amortized.
+		memmove(storage, storage + b->start, b->len);
+		b->start = 0;
+		return storage + b->len;
+	}
+
+	size_t new_cap = cap * 2;
+	if (new_cap < b->len + n) {
+		new_cap = b->len + n;
+	}
+	char *new_storage = malloc(new_cap);
+	memcpy(new_storage, storage + b->start, b->len);
+	free(b->heap);
+	b->heap = new_storage;
+	b->cap = new_cap;
+	b->start = 0;
+	return new_storage + b->len;
+}
+
+void byte_buf_commit(struct byte_buf *b, size_t n) {
+	DI_CHECK(b->start + b->len + n <= byte_buf_capacity(b));
+	b->len += n;
+}
+
+void byte_buf_append(struct byte_buf *b, const void *data, size_t n) {
+	if (n == 0) {
+		return;
+	}
+	memcpy(byte_buf_reserve(b, n), data, n);
+	b->len += n;
+}
+
+void byte_buf_vprintf(struct byte_buf *b, const char *fmt, va_list ap) {
+	size_t avail = byte_buf_capacity(b) - b->start - b->len;
+	va_list ap2;
+	va_copy(ap2, ap);
+	int n = vsnprintf(byte_buf_data(b) + b->len, avail, fmt, ap2);
+	va_end(ap2);
+	if (n < 0) {
+		return;
+	}
+	if ((size_t)n >= avail) {
+		// Didn't fit, vsnprintf needs space for the null byte as well
+		vsnprintf(byte_buf_reserve(b, n + 1), n + 1, fmt, ap);
+	}
+	b->len += n;
+}
+
+void byte_buf_printf(struct byte_buf *b, const char *fmt, ...) {
+	va_list ap;
+	va_start(ap, fmt);
+	byte_buf_vprintf(b, fmt, ap);
+	va_end(ap);
+}
+
+void byte_buf_consume(struct byte_buf *b, size_t n) {
+	if (n >= b->len) {
+		b->start = b->len = 0;
+		return;
+	}
+	b->start += n;
+	b->len -= n;
+}
+
+struct byte_buf_slice byte_buf_slice(struct byte_buf *b, size_t offset, size_t len) {
+	if (offset > b->len) {
+		offset = b->len;
+	}
+	if (len > b->len - offset) {
+		len = b->len - offset;
+	}
+	return (struct byte_buf_slice){.data = byte_buf_data(b) + offset, .len = len};
+}
+
+char *byte_buf_dump(struct byte_buf *b) {
+	char *ret = malloc(b->len + 1);
+	memcpy(ret, byte_buf_data(b), b->len);
+	ret[b->len] = '\0';
+	byte_buf_clear(b);
+	return ret;
+}
+
+void byte_buf_clear(struct byte_buf *b) {
+	b->start = b->len = 0;
+}
+
+void byte_buf_free(struct byte_buf *b) {
+	free(b->heap);
+	b->heap = NULL;
+	b->cap = 0;
+	b->start = b->len = 0;
+}
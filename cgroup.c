@@ -0,0 +1,462 @@
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/. */
+
+/* Copyright (c) 2017, Yuxuan Shui <yshuiv7@gmail.com> */
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <poll.h>
+#include <signal.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+#ifndef __FreeBSD__
+#include <linux/magic.h>
+#include <linux/sched.h>
+#include <sys/syscall.h>
+#include <sys/vfs.h>
+#endif
+
+#include "cgroup.h"
+#include "common.h"
+#include "list.h"
+
+#ifdef __FreeBSD__
+int di_cgroup_setup(void) {
+	return -ENOTSUP;
+}
+bool di_cgroup_is_ready(void) {
+	return false;
+}
+int di_cgroup_new_leaf(void) {
+	return -ENOTSUP;
+}
+int di_cgroup_attach(int cgfd, pid_t pid) {
+	return -ENOTSUP;
+}
+pid_t di_cgroup_fork_into(int cgfd, bool *contained) {
+	*contained = false;
+	return fork();
+}
+void di_cgroup_read_stats(int cgfd, struct di_cgroup_stats *stats) {
+	*stats = (struct di_cgroup_stats){-1, -1, -1, -1, -1};
+}
+void di_cgroup_release_leaf(int cgfd) {
+	close(cgfd);
+}
+void di_cgroup_collect(void) {
+}
+int di_cgroup_kill_all(int sig) {
+	return -ENOTSUP;
+}
+bool di_cgroup_wait_empty(double timeout) {
+	return true;
+}
+#else
+
+struct cgroup_leaf {
+	char name[32];
+	/// Directory fd of this cgroup, -1 if it has been released
+	int fd;
+	struct list_head siblings;
+};
+
+/// The cgroup our leaves are created in, -1 if not set up
+static int cgroup_root = -1;
+static unsigned int next_leaf_id = 0;
+static LIST_HEAD(leaves);
+
+static int cgroup_read_file(int dirfd, const char *name, char *buf, size_t len) {
+	int fd = openat(dirfd, name, O_RDONLY | O_CLOEXEC);
+	if (fd < 0) {
+		return -errno;
+	}
+	ssize_t ret = read(fd, buf, len - 1);
+	close(fd);
+	if (ret < 0) {
+		return -errno;
+	}
+	buf[ret] = '\0';
+	return 0;
+}
+
+static int cgroup_write_file(int dirfd, const char *name, const char *content) {
+	int fd = openat(dirfd, name, O_WRONLY | O_CLOEXEC);
+	if (fd < 0) {
+		return -errno;
+	}
+	int ret = 0;
+	if (write(fd, content, strlen(content)) < 0) {
+		ret = -errno;
+	}
+	close(fd);
+	return ret;
+}
+
+/// Call `fn` with every pid in the cgroup `cgfd`
+static int cgroup_for_each_pid(int cgfd, void (*fn)(pid_t, void *), void *ud) {
+	int fd = openat(cgfd, "cgroup.procs", O_RDONLY | O_CLOEXEC);
+	if (fd < 0) {
+		return -errno;
+	}
+	FILE *f = fdopen(fd, "r");
+	if (!f) {
+		close(fd);
+		return -ENOMEM;
+	}
+	int pid, count = 0;
+	while (fscanf(f, "%d", &pid) == 1) {
+		fn(pid, ud);
+		count++;
+	}
+	fclose(f);
+	return count;
+}
+
+/// Find the path of our own cgroup in the unified hierarchy
+static char *cgroup_self_path(void) {
+	FILE *f = fopen("/proc/self/cgroup", "re");
+	if (!f) {
+		return NULL;
+	}
+	char *line = NULL, *ret = NULL;
+	size_t cap = 0;
+	ssize_t len;
+	while ((len = getline(&line, &cap, f)) > 0) {
+		if (strncmp(line, "0::", 3) != 0) {
+			continue;
+		}
+		if (line[len - 1] == '\n') {
+			line[len - 1] = '\0';
+		}
+		asprintf(&ret, "/sys/fs/cgroup%s", line + 3);
+		break;
+	}
+	free(line);
+	fclose(f);
+	return ret;
+}
+
+static void cgroup_move_own_process(pid_t pid, void *ud) {
+	int *self_cg = ud;
+	if (getpgid(pid) == getpgrp()) {
+		di_cgroup_attach(*self_cg, pid);
+	}
+}
+
+static void cgroup_remove_stale_leaves(int root) {
+	int fd = dup(root);
+	DIR *dir = fd >= 0 ? fdopendir(fd) : NULL;
+	if (!dir) {
+		close(fd);
+		return;
+	}
+	struct dirent *dent;
+	while ((dent = readdir(dir))) {
+		if (strncmp(dent->d_name, "spawn-", 6) == 0) {
+			// Fails if the cgroup is still in use, which is fine
+			unlinkat(root, dent->d_name, AT_REMOVEDIR);
+		}
+	}
+	closedir(dir);
+}
+
+int di_cgroup_setup(void) {
+	if (cgroup_root >= 0) {
+		return 0;
+	}
+
+	struct statfs fs;
+	if (statfs("/sys/fs/cgroup", &fs) != 0 || fs.f_type != CGROUP2_SUPER_MAGIC) {
+		return -ENOTSUP;
+	}
+
+	char *path = cgroup_self_path();
+	if (!path) {
+		return -ENOENT;
+	}
+	int root = open(path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	free(path);
+	if (root < 0) {
+		return -errno;
+	}
+
+	// Only leaf cgroups can have controllers enabled and processes in them at the
+	// same time, so move ourselves (and the launcher, if any) out of the way.
+	if (mkdirat(root, "deai", 0755) < 0 && errno != EEXIST) {
+		int ret = -errno;
+		close(root);
+		return ret;
+	}
+	int self_cg = openat(root, "deai", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	if (self_cg < 0 || di_cgroup_attach(self_cg, 0) != 0) {
+		// The cgroup is not delegated to us
+		int ret = self_cg < 0 ? -errno : -EACCES;
+		if (self_cg >= 0) {
+			close(self_cg);
+		}
+		unlinkat(root, "deai", AT_REMOVEDIR);
+		close(root);
+		return ret;
+	}
+	cgroup_for_each_pid(root, cgroup_move_own_process, &self_cg);
+	close(self_cg);
+
+	// Best effort, this fails if there are other processes in our cgroup, or if
+	// the controllers are not available to us. Enabled separately so one failing
+	// doesn't prevent the other.
+	cgroup_write_file(root, "cgroup.subtree_control", "+memory");
+	cgroup_write_file(root, "cgroup.subtree_control", "+cpu");
+
+	cgroup_remove_stale_leaves(root);
+	cgroup_root = root;
+	return 0;
+}
+
+bool di_cgroup_is_ready(void) {
+	return cgroup_root >= 0;
+}
+
+int di_cgroup_new_leaf(void) {
+	if (cgroup_root < 0) {
+		return -ENOTSUP;
+	}
+
+	auto leaf = tmalloc(struct cgroup_leaf, 1);
+	while (true) {
+		snprintf(leaf->name, sizeof(leaf->name), "spawn-%u", next_leaf_id++);
+		if (mkdirat(cgroup_root, leaf->name, 0755) == 0) {
+			break;
+		}
+		if (errno != EEXIST) {
+			int ret = -errno;
+			free(leaf);
+			return ret;
+		}
+		// Left over from a previous run and still in use, try the next one
+	}
+
+	leaf->fd = openat(cgroup_root, leaf->name, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	if (leaf->fd < 0) {
+		int ret = -errno;
+		unlinkat(cgroup_root, leaf->name, AT_REMOVEDIR);
+		free(leaf);
+		return ret;
+	}
+	list_add(&leaf->siblings, &leaves);
+	return leaf->fd;
+}
+
+int di_cgroup_attach(int cgfd, pid_t pid) {
+	char buf[32];
+	snprintf(buf, sizeof(buf), "%d", pid);
+	return cgroup_write_file(cgfd, "cgroup.procs", buf);
+}
+
+pid_t di_cgroup_fork_into(int cgfd, bool *contained) {
+#if defined(CLONE_INTO_CGROUP) && defined(SYS_clone3)
+	struct clone_args args = {
+	    .flags = CLONE_INTO_CGROUP,
+	    .exit_signal = SIGCHLD,
+	    .cgroup = (uint64_t)cgfd,
+	};
+	long ret = syscall(SYS_clone3, &args, sizeof(args));
+	if (ret >= 0) {
+		*contained = true;
+		return ret;
+	}
+	// Kernel older than 5.7, or we can't use this cgroup. Try the old way.
+#endif
+
+	*contained = false;
+	int sync[2];
+	if (pipe2(sync, O_CLOEXEC) < 0) {
+		return fork();
+	}
+	pid_t pid = fork();
+	if (pid == 0) {
+		close(sync[0]);
+		char ok = di_cgroup_attach(cgfd, 0) == 0;
+		while (write(sync[1], &ok, 1) < 0 && errno == EINTR) {
+		}
+		close(sync[1]);
+		return 0;
+	}
+
+	int err = errno;
+	close(sync[1]);
+	if (pid > 0) {
+		char ok = 0;
+		while (read(sync[0], &ok, 1) < 0 && errno == EINTR) {
+		}
+		*contained = ok;
+	}
+	close(sync[0]);
+	errno = err;
+	return pid;
+}
+
+static int64_t cgroup_read_int(int cgfd, const char *name) {
+	char buf[32];
+	if (cgroup_read_file(cgfd, name, buf, sizeof(buf)) != 0) {
+		return -1;
+	}
+	return strtoll(buf, NULL, 10);
+}
+
+void di_cgroup_read_stats(int cgfd, struct di_cgroup_stats *stats) {
+	stats->memory_current = cgroup_read_int(cgfd, "memory.current");
+	stats->memory_peak = cgroup_read_int(cgfd, "memory.peak");
+	stats->cpu_usage_usec = stats->cpu_user_usec = stats->cpu_system_usec = -1;
+
+	// cpu.stat is always available, even without the cpu controller
+	char buf[1024];
+	if (cgroup_read_file(cgfd, "cpu.stat", buf, sizeof(buf)) != 0) {
+		return;
+	}
+	char *saveptr, *line = strtok_r(buf, "\n", &saveptr);
+	while (line) {
+		char key[32];
+		int64_t value;
+		if (sscanf(line, "%31s %" SCNd64, key, &value) == 2) {
+			if (strcmp(key, "usage_usec") == 0) {
+				stats->cpu_usage_usec = value;
+			} else if (strcmp(key, "user_usec") == 0) {
+				stats->cpu_user_usec = value;
+			} else if (strcmp(key, "system_usec") == 0) {
+				stats->cpu_system_usec = value;
+			}
+		}
+		line = strtok_r(NULL, "\n", &saveptr);
+	}
+}
+
+static bool cgroup_try_remove(struct cgroup_leaf *leaf) {
+	if (unlinkat(cgroup_root, leaf->name, AT_REMOVEDIR) != 0 && errno != ENOENT) {
+		return false;
+	}
+	list_del(&leaf->siblings);
+	free(leaf);
+	return true;
+}
+
+void di_cgroup_release_leaf(int cgfd) {
+	struct cgroup_leaf *leaf;
+	list_for_each_entry (leaf, &leaves, siblings) {
+		if (leaf->fd == cgfd) {
+			close(leaf->fd);
+			leaf->fd = -1;
+			cgroup_try_remove(leaf);
+			return;
+		}
+	}
+}
+
+void di_cgroup_collect(void) {
+	struct cgroup_leaf *leaf, *tmp;
+	list_for_each_entry_safe (leaf, tmp, &leaves, siblings) {
+		if (leaf->fd < 0) {
+			cgroup_try_remove(leaf);
+		}
+	}
+}
+
+static void cgroup_kill_one(pid_t pid, void *ud) {
+	kill(pid, *(int *)ud);
+}
+
+int di_cgroup_kill_all(int sig) {
+	if (cgroup_root < 0) {
+		return -ENOTSUP;
+	}
+
+	struct cgroup_leaf *leaf;
+	list_for_each_entry (leaf, &leaves, siblings) {
+		int fd = openat(cgroup_root, leaf->name, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+		if (fd < 0) {
+			continue;
+		}
+		// cgroup.kill (since Linux 5.14) is atomic, processes forked while we are
+		// killing won't escape.
+		if (sig != SIGKILL || cgroup_write_file(fd, "cgroup.kill", "1") != 0) {
+			cgroup_for_each_pid(fd, cgroup_kill_one, &sig);
+		}
+		close(fd);
+	}
+	return 0;
+}
+
+/// Open cgroup.events of every leaf cgroup that still has processes in it, for polling.
+/// The fds are stored in `*pfds`, which is reallocated as needed.
+///
+/// @return the number of populated leaf cgroups
+static int cgroup_poll_populated(struct pollfd **pfds) {
+	int n = 0, cap = 0;
+	struct cgroup_leaf *leaf;
+	list_for_each_entry (leaf, &leaves, siblings) {
+		char path[64];
+		snprintf(path, sizeof(path), "%s/cgroup.events", leaf->name);
+		int fd = openat(cgroup_root, path, O_RDONLY | O_CLOEXEC);
+		if (fd < 0) {
+			continue;
+		}
+		// Changes after this read wake up poll, so nothing can be missed in
+		// between.
+		char buf[256];
+		ssize_t len = read(fd, buf, sizeof(buf) - 1);
+		if (len > 0) {
+			buf[len] = '\0';
+		}
+		if (len <= 0 || strstr(buf, "populated 1") == NULL) {
+			close(fd);
+			continue;
+		}
+		if (n == cap) {
+			cap = cap ? cap * 2 : 8;
+			*pfds = realloc(*pfds, sizeof(struct pollfd) * cap);
+		}
+		(*pfds)[n++] = (struct pollfd){.fd = fd, .events = POLLPRI};
+	}
+	return n;
+}
+
+bool di_cgroup_wait_empty(double timeout) {
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	double deadline = (double)now.tv_sec + (double)now.tv_nsec / 1e9 + timeout;
+
+	// cgroup.events signals POLLPRI when it changes, e.g. when a cgroup becomes
+	// empty. Check again whenever that happens.
+	struct pollfd *pfds = NULL;
+	bool empty = false;
+	while (true) {
+		int n = cgroup_poll_populated(&pfds);
+		if (n == 0) {
+			empty = true;
+			break;
+		}
+
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		double remaining = deadline - (double)now.tv_sec - (double)now.tv_nsec / 1e9;
+		if (remaining > 0) {
+			// Round up, so we don't wake up just before the deadline
+			poll(pfds, n, (int)(remaining * 1000) + 1);
+		}
+		for (int i = 0; i < n; i++) {
+			close(pfds[i].fd);
+		}
+		if (remaining <= 0) {
+			break;
+		}
+	}
+	free(pfds);
+	return empty;
+}
+#endif
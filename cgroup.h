@@ -0,0 +1,68 @@
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/. */
+
+/* Copyright (c) 2017, Yuxuan Shui <yshuiv7@gmail.com> */
+
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+/// Statistics of a cgroup, fields that are not available are set to -1
+struct di_cgroup_stats {
+	int64_t memory_current, memory_peak;
+	int64_t cpu_usage_usec, cpu_user_usec, cpu_system_usec;
+};
+
+/// Prepare the cgroup v2 hierarchy for placing child processes. Leaf cgroups are created
+/// as siblings of the cgroup deai is in, after deai itself (and anything else in its
+/// process group) is moved into a leaf named "deai". The memory and cpu controllers are
+/// enabled for the leaves if possible.
+///
+/// Calling this more than once is harmless.
+///
+/// @return 0 on success, or a negative error code.
+int di_cgroup_setup(void);
+
+/// Whether di_cgroup_setup has succeeded
+bool di_cgroup_is_ready(void);
+
+/// Create a new leaf cgroup for a child process
+///
+/// @return A directory fd of the new cgroup, or a negative error code.
+int di_cgroup_new_leaf(void);
+
+/// Move process `pid` into the cgroup `cgfd`. `pid` can be 0, which means the calling
+/// process.
+int di_cgroup_attach(int cgfd, pid_t pid);
+
+/// Like fork(), but the child process starts in the cgroup `cgfd`, before it can run
+/// anything. Uses clone3(CLONE_INTO_CGROUP) if available, otherwise the child moves
+/// itself before fork returns.
+///
+/// @param[out] contained whether the child is in `cgfd`. The child is still created if
+///                       it can't be moved into the cgroup.
+pid_t di_cgroup_fork_into(int cgfd, bool *contained);
+
+/// Read the statistics of cgroup `cgfd`
+void di_cgroup_read_stats(int cgfd, struct di_cgroup_stats *stats);
+
+/// Give up a leaf cgroup. The cgroup is removed once all processes in it are gone, which
+/// is checked in di_cgroup_collect. `cgfd` is closed.
+void di_cgroup_release_leaf(int cgfd);
+
+/// Try to remove released leaf cgroups that are now empty
+void di_cgroup_collect(void);
+
+/// Send `sig` to every process in our leaf cgroups. SIGKILL is sent with cgroup.kill
+/// where available.
+///
+/// @return 0, or a negative error code if the leaf cgroups are not set up.
+int di_cgroup_kill_all(int sig);
+
+/// Wait for all processes in our leaf cgroups to exit, for up to `timeout` seconds.
+///
+/// @return whether the leaf cgroups are empty
+bool di_cgroup_wait_empty(double timeout);
@@ -31,19 +31,20 @@ struct di_object_internal {
 
 	di_dtor_fn_t nullable dtor;
 	di_call_fn_t nullable call;
+	di_traverse_fn_t nullable traverse;
 
 	uint64_t ref_count;
 	uint64_t weak_ref_count;
 	uint8_t destroyed;
 
 #ifdef TRACK_OBJECTS
-	char padding[54];
+	char padding[46];
 	uint8_t mark;
 	uint64_t excess_ref_count;
 	struct list_head siblings;
 #else
 	// Reserved for future use
-	char padding[79];
+	char padding[71];
 #endif
 };
 
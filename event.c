@@ -61,9 +61,11 @@ static void di_timer_callback(EV_P_ ev_timer *t, int revents) {
 	ev_timer_stop(di->loop, t);
 	di_emit(d, "elapsed", now);
 
-	// This object won't generate further event until the user calls `again`
-	// So drop the strong __deai reference
-	di_object_downgrade_deai((struct di_object *)d);
+	// This object won't generate further event until the user calls `again`, unless
+	// a listener already did. So drop the strong __deai reference
+	if (!ev_is_active(t)) {
+		di_object_downgrade_deai((struct di_object *)d);
+	}
 }
 
 static void di_periodic_callback(EV_P_ ev_periodic *w, int revents) {
@@ -81,7 +83,7 @@ static void di_start_ioev(struct di_object *obj) {
 		return;
 	}
 
-	auto di_obj = di_object_get_deai_weak(obj);
+	di_object_with_cleanup di_obj = di_object_get_deai_weak(obj);
 	if (di_obj == NULL) {
 		// deai is shutting down
 		return;
@@ -198,7 +200,11 @@ static void di_timer_stop(struct di_object *obj) {
 }
 
 static void di_timer_again(struct di_timer *obj) {
-	auto di_obj = di_object_get_deai_weak((struct di_object *)obj);
+	// The timer is still running, or is being emitted, when __deai is strong
+	di_object_with_cleanup di_obj = di_object_get_deai_strong((struct di_object *)obj);
+	if (di_obj == NULL) {
+		di_obj = di_object_get_deai_weak((struct di_object *)obj);
+	}
 	if (di_obj == NULL) {
 		// deai is shutting down
 		return;
@@ -34,17 +34,17 @@ struct di_object *di_new_error(const char *fmt, ...) {
 
 static int emit_proxied_signal(struct di_object *o, di_type_t *rt, union di_value *ret,
                                 struct di_tuple t) {
-	const char *signal = NULL;
+	struct di_string signal = DI_STRING_INIT;
 	struct di_weak_object *weak = NULL;
 	di_get(o, "___new_signal_name", signal);
 	di_get(o, "__proxy_object", weak);
 
 	di_object_with_cleanup proxy = di_upgrade_weak_ref(weak);
 	if (proxy) {
-		di_emitn(proxy, di_string_borrow(signal), t);
+		di_emitn(proxy, signal, t);
 	}
 
-	free((char *)signal);
+	di_free_string(signal);
 	return 0;
 }
 
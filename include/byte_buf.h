@@ -0,0 +1,79 @@
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/. */
+
+/* Copyright (c) 2017, Yuxuan Shui <yshuiv7@gmail.com> */
+
+#pragma once
+
+#include <deai/compiler.h>
+
+#include <stdarg.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+#define BYTE_BUF_INLINE_SIZE 64
+
+/// A contiguous, growable byte buffer. Bytes are appended at the end, and consumed from
+/// the front. Small contents are stored inline, without allocating.
+///
+/// A zero initialized byte_buf is an empty buffer, ready to use. byte_buf_free has to be
+/// called to release the memory it holds.
+struct byte_buf {
+	/// Heap storage, NULL if the inline storage is used
+	char *heap;
+	/// Offset of the first byte in the storage
+	size_t start;
+	/// Number of bytes in the buffer
+	size_t len;
+	/// Size of the heap storage
+	size_t cap;
+	char inline_[BYTE_BUF_INLINE_SIZE];
+};
+
+/// A range of bytes in a byte_buf. Invalidated when the buffer is modified.
+struct byte_buf_slice {
+	const char *data;
+	size_t len;
+};
+
+static inline size_t byte_buf_capacity(const struct byte_buf *b) {
+	return b->heap ? b->cap : BYTE_BUF_INLINE_SIZE;
+}
+
+/// Pointer to the first byte in the buffer
+static inline char *byte_buf_data(struct byte_buf *b) {
+	return (b->heap ? b->heap : b->inline_) + b->start;
+}
+
+static inline size_t byte_buf_len(const struct byte_buf *b) {
+	return b->len;
+}
+
+static inline bool byte_buf_is_empty(const struct byte_buf *b) {
+	return b->len == 0;
+}
+
+/// Make room for at least `n` more bytes at the end of the buffer, growing it if needed.
+/// The bytes written to the returned pointer become part of the buffer after a call to
+/// byte_buf_commit.
+char *byte_buf_reserve(struct byte_buf *b, size_t n);
+/// Add `n` bytes, written after a call to byte_buf_reserve, to the buffer
+void byte_buf_commit(struct byte_buf *b, size_t n);
+/// Append `n` bytes from `data` to the buffer
+void byte_buf_append(struct byte_buf *b, const void *data, size_t n);
+/// Append formatted text to the buffer, without the terminating null byte
+__attribute__((format(printf, 2, 3))) void
+byte_buf_printf(struct byte_buf *b, const char *fmt, ...);
+void byte_buf_vprintf(struct byte_buf *b, const char *fmt, va_list ap);
+/// Remove `n` bytes from the front of the buffer
+void byte_buf_consume(struct byte_buf *b, size_t n);
+/// Get `len` bytes starting at `offset`. The range is clamped to the content of the
+/// buffer.
+struct byte_buf_slice byte_buf_slice(struct byte_buf *b, size_t offset, size_t len);
+/// Copy the content of the buffer into a null terminated string, and clear the buffer
+char *allocates(malloc) byte_buf_dump(struct byte_buf *b);
+/// Remove all content from the buffer, the memory is kept for reuse
+void byte_buf_clear(struct byte_buf *b);
+/// Release the memory held by the buffer, it becomes empty afterwards
+void byte_buf_free(struct byte_buf *b);
@@ -7,8 +7,9 @@
 #pragma once
 #include <deai/common.h>
 #include <deai/compiler.h>
+#include <deai/object.h>
 
-struct di_object;
+#include <stdbool.h>
 
 enum di_log_level {
 	DI_LOG_ERROR,
@@ -20,3 +21,38 @@ enum di_log_level {
 PUBLIC_DEAI_API __attribute__((format(printf, 3, 4))) int
 di_log_va(struct di_object *nonnull o, int log_level, const char *nonnull fmt, ...);
 PUBLIC_DEAI_API int di_set_log_level(struct di_object *nonnull o, int log_level);
+
+/// A logger with a name, which has its own log level. Messages logged with a logger go to
+/// the log target of the log module. Trace targets record the logger's name as well.
+struct di_logger {
+	struct di_object base;
+	/// Messages with a log level higher than this are discarded. Kept up to date by the
+	/// log module, don't modify.
+	int max_level;
+};
+
+/// Get a logger named `name` from the log module `log_module`. Loggers with the same name
+/// share the same log level.
+PUBLIC_DEAI_API struct di_object *nullable di_new_logger(struct di_object *nonnull log_module,
+                                                         const char *nonnull name);
+/// Log a message with `logger`. Prefer the di_log macro, which doesn't evaluate the
+/// arguments if the message would be discarded.
+PUBLIC_DEAI_API __attribute__((format(printf, 3, 4))) int
+di_logger_log(struct di_object *nonnull logger, int log_level, const char *nonnull fmt, ...);
+
+/// Whether messages with `log_level` logged with `logger` will be kept. `logger` can be
+/// NULL, in which case nothing is logged.
+static inline bool di_log_enabled(struct di_object *nullable logger, int log_level) {
+	return logger != NULL && log_level <= ((struct di_logger *)logger)->max_level;
+}
+
+/// Log a message with `logger`. The format arguments are only evaluated if `log_level`
+/// is enabled.
+#define di_log(logger, log_level, ...)                                                   \
+	do {                                                                             \
+		struct di_object *__di_logger = (logger);                                \
+		int __di_log_level = (log_level);                                        \
+		if (di_log_enabled(__di_logger, __di_log_level)) {                       \
+			di_logger_log(__di_logger, __di_log_level, __VA_ARGS__);         \
+		}                                                                        \
+	} while (0)
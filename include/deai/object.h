@@ -156,6 +156,10 @@ union di_value;
 typedef int (*di_call_fn_t)(struct di_object *nonnull, di_type_t *nonnull rt,
                             union di_value *nonnull ret, struct di_tuple);
 typedef void (*di_dtor_fn_t)(struct di_object *nonnull);
+typedef void (*di_visit_fn_t)(struct di_object *nonnull);
+/// Call `visit` on every object strongly referenced by this object, which is not stored
+/// as one of its members.
+typedef void (*di_traverse_fn_t)(struct di_object *nonnull, di_visit_fn_t nonnull visit);
 struct di_signal;
 struct di_listener;
 struct di_callable;
@@ -395,6 +399,10 @@ PUBLIC_DEAI_API void frees(malloc, 1) di_unref_object(struct di_object *nonnull)
 
 PUBLIC_DEAI_API void di_set_object_dtor(struct di_object *nonnull, di_dtor_fn_t nullable);
 PUBLIC_DEAI_API void di_set_object_call(struct di_object *nonnull, di_call_fn_t nullable);
+/// Let mark-and-sweep see the objects referenced by `obj` from outside of its members.
+/// Without this, those objects will be reported as leaked.
+PUBLIC_DEAI_API void
+di_set_object_traverse(struct di_object *nonnull obj, di_traverse_fn_t nullable);
 PUBLIC_DEAI_API bool di_is_object_callable(struct di_object *nonnull);
 
 PUBLIC_DEAI_API void di_free_tuple(struct di_tuple);
@@ -11,7 +11,7 @@
 #include <stdbool.h>
 #include <stddef.h>
 
-/// An append only string buffer
+/// An append only string buffer, see byte_buf.h if you need to store arbitrary bytes
 struct string_buf;
 
 /// Create a new string buffer
@@ -28,3 +28,5 @@ char *string_buf_dump(struct string_buf *);
 void string_buf_clear(struct string_buf *);
 /// Returns whether the string buffer is empty
 bool string_buf_is_empty(struct string_buf *);
+/// Free the string buffer and its content
+void string_buf_free(struct string_buf *);
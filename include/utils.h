@@ -206,6 +206,8 @@ static inline void unused va_arg_with_di_type(va_list ap, di_type_t t, void *buf
 
 	switch (t) {
 	case DI_TYPE_STRING:
+		v.string = va_arg(ap, struct di_string);
+		break;
 	case DI_TYPE_STRING_LITERAL:
 	case DI_TYPE_POINTER:
 	case DI_TYPE_OBJECT:
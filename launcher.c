@@ -0,0 +1,310 @@
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/. */
+
+/* Copyright (c) 2017, Yuxuan Shui <yshuiv7@gmail.com> */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#ifdef __linux__
+#include <sys/prctl.h>
+#endif
+
+#include "cgroup.h"
+#include "common.h"
+#include "launcher.h"
+
+// A spawn request is a single packet, containing a `struct launcher_request`, followed
+// by `argc` null terminated arguments and `envc` null terminated environment variables.
+// LAUNCHER_NFDS file descriptors are attached to the request: stdin, stdout, stderr,
+// and the working directory, optionally followed by the cgroup to start the new process
+// in.
+//
+// The reply is a `struct launcher_reply`.
+struct launcher_request {
+	uint32_t argc;
+	uint32_t envc;
+};
+
+struct launcher_reply {
+	/// The pid of the new process, or a negative error code
+	int32_t pid;
+	/// Whether the new process was started in the requested cgroup
+	uint32_t contained;
+};
+
+#define LAUNCHER_NFDS 4
+#define LAUNCHER_MAX_NFDS (LAUNCHER_NFDS + 1)
+#define LAUNCHER_MAX_REQUEST (128 * 1024)
+
+// deai's end of the socket to the launcher, -1 if the launcher is not running
+static int launcher_socket = -1;
+
+/// Receive a request, `*nfds` is set to the number of file descriptors received into
+/// `fds`, which has room for LAUNCHER_MAX_NFDS.
+static int launcher_recv(int sock, char *buf, size_t len, int *fds, int *nfds) {
+	union {
+		char buf[CMSG_SPACE(sizeof(int) * LAUNCHER_MAX_NFDS)];
+		struct cmsghdr align;
+	} control;
+	struct iovec iov = {.iov_base = buf, .iov_len = len};
+	struct msghdr msg = {
+	    .msg_iov = &iov,
+	    .msg_iovlen = 1,
+	    .msg_control = control.buf,
+	    .msg_controllen = sizeof(control.buf),
+	};
+
+	ssize_t ret;
+	do {
+		ret = recvmsg(sock, &msg, MSG_CMSG_CLOEXEC);
+	} while (ret < 0 && errno == EINTR);
+	if (ret <= 0) {
+		return ret;
+	}
+
+	*nfds = 0;
+	for (auto cmsg = CMSG_FIRSTHDR(&msg); cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+		if (cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS) {
+			continue;
+		}
+		*nfds = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+		memcpy(fds, CMSG_DATA(cmsg), sizeof(int) * *nfds);
+	}
+
+	if (*nfds < LAUNCHER_NFDS || (msg.msg_flags & (MSG_TRUNC | MSG_CTRUNC))) {
+		for (int i = 0; i < *nfds; i++) {
+			close(fds[i]);
+		}
+		*nfds = 0;
+		return -EINVAL;
+	}
+	return ret;
+}
+
+static void launcher_reply(int sock, int32_t pid, bool contained) {
+	struct launcher_reply reply = {.pid = pid, .contained = contained};
+	while (send(sock, &reply, sizeof(reply), MSG_NOSIGNAL) < 0 && errno == EINTR) {
+	}
+}
+
+static noret void launcher_exec(char **argv, char **envp, const int *fds) {
+	// Give the new process a clean signal state
+	sigset_t all;
+	sigemptyset(&all);
+	sigprocmask(SIG_SETMASK, &all, NULL);
+	signal(SIGINT, SIG_DFL);
+
+	if (dup2(fds[0], STDIN_FILENO) < 0 || dup2(fds[1], STDOUT_FILENO) < 0 ||
+	    dup2(fds[2], STDERR_FILENO) < 0 || fchdir(fds[3]) < 0) {
+		_exit(1);
+	}
+
+	environ = envp;
+	execvp(argv[0], argv);
+	_exit(1);
+}
+
+static void launcher_handle(int sock, char *buf, size_t len, const int *fds, int nfds) {
+	struct launcher_request req;
+	if (len < sizeof(req)) {
+		launcher_reply(sock, -EINVAL, false);
+		return;
+	}
+	memcpy(&req, buf, sizeof(req));
+
+	char **strings = tmalloc(char *, req.argc + req.envc + 2);
+	char *pos = buf + sizeof(req), *end = buf + len;
+	for (uint32_t i = 0; i < req.argc + req.envc; i++) {
+		char *next = memchr(pos, '\0', end - pos);
+		if (!next) {
+			free(strings);
+			launcher_reply(sock, -EINVAL, false);
+			return;
+		}
+		// Leave a NULL between argv and envp
+		strings[i < req.argc ? i : i + 1] = pos;
+		pos = next + 1;
+	}
+
+	// Fork twice, so the new process is re-parented to deai when the intermediate
+	// process exits.
+	pid_t pid = fork();
+	if (pid == 0) {
+		bool contained = false;
+		pid_t child = nfds > LAUNCHER_NFDS
+		                  ? di_cgroup_fork_into(fds[LAUNCHER_NFDS], &contained)
+		                  : fork();
+		if (child == 0) {
+			launcher_exec(strings, strings + req.argc + 1, fds);
+		}
+		launcher_reply(sock, child < 0 ? -errno : child, contained);
+		_exit(0);
+	}
+	free(strings);
+
+	if (pid < 0) {
+		launcher_reply(sock, -errno, false);
+		return;
+	}
+	while (waitpid(pid, NULL, 0) < 0 && errno == EINTR) {
+	}
+}
+
+static noret void launcher_main(int sock) {
+#ifdef __linux__
+	prctl(PR_SET_NAME, "deai-launcher");
+	// Don't outlive deai
+	prctl(PR_SET_PDEATHSIG, SIGKILL);
+#endif
+	// Drop whatever signal handling deai has set up so far, we only leave SIGINT
+	// ignored, so a ^C meant for deai won't kill the launcher.
+	signal(SIGCHLD, SIG_DFL);
+	signal(SIGINT, SIG_IGN);
+	sigset_t all;
+	sigemptyset(&all);
+	sigprocmask(SIG_SETMASK, &all, NULL);
+
+	char *buf = malloc(LAUNCHER_MAX_REQUEST);
+	while (true) {
+		int fds[LAUNCHER_MAX_NFDS], nfds;
+		int len = launcher_recv(sock, buf, LAUNCHER_MAX_REQUEST, fds, &nfds);
+		if (len == 0 || (len < 0 && len != -EINVAL)) {
+			// deai is gone
+			break;
+		}
+		if (len == -EINVAL) {
+			launcher_reply(sock, -EINVAL, false);
+			continue;
+		}
+
+		launcher_handle(sock, buf, len, fds, nfds);
+		for (int i = 0; i < nfds; i++) {
+			close(fds[i]);
+		}
+	}
+	_exit(0);
+}
+
+void di_launcher_start(void) {
+	if (!getenv("DEAI_SPAWN_LAUNCHER")) {
+		return;
+	}
+
+	int socks[2];
+	if (socketpair(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0, socks) < 0) {
+		return;
+	}
+
+	pid_t pid = fork();
+	if (pid == 0) {
+		close(socks[0]);
+		launcher_main(socks[1]);
+	}
+
+	close(socks[1]);
+	if (pid < 0) {
+		close(socks[0]);
+		return;
+	}
+	launcher_socket = socks[0];
+}
+
+/// Stop using the launcher after talking to it failed. The launcher exits once it sees
+/// the socket closed.
+static void launcher_disconnect(void) {
+	close(launcher_socket);
+	launcher_socket = -1;
+}
+
+bool di_launcher_is_running(void) {
+	return launcher_socket >= 0;
+}
+
+pid_t di_launcher_spawn(char *const *argv, const int fds[3], int cgfd, bool *contained) {
+	*contained = false;
+	if (launcher_socket < 0) {
+		return -ENOTCONN;
+	}
+
+	struct launcher_request req = {0};
+	size_t len = sizeof(req);
+	for (int i = 0; argv[i]; i++, req.argc++) {
+		len += strlen(argv[i]) + 1;
+	}
+	for (int i = 0; environ[i]; i++, req.envc++) {
+		len += strlen(environ[i]) + 1;
+	}
+	if (len > LAUNCHER_MAX_REQUEST) {
+		return -E2BIG;
+	}
+
+	char *buf = malloc(len), *pos = buf + sizeof(req);
+	memcpy(buf, &req, sizeof(req));
+	for (int i = 0; argv[i]; i++) {
+		pos = stpcpy(pos, argv[i]) + 1;
+	}
+	for (int i = 0; environ[i]; i++) {
+		pos = stpcpy(pos, environ[i]) + 1;
+	}
+
+	int cwd = open(".", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	if (cwd < 0) {
+		free(buf);
+		return -errno;
+	}
+
+	int nfds = cgfd >= 0 ? LAUNCHER_MAX_NFDS : LAUNCHER_NFDS;
+	union {
+		char buf[CMSG_SPACE(sizeof(int) * LAUNCHER_MAX_NFDS)];
+		struct cmsghdr align;
+	} control;
+	struct iovec iov = {.iov_base = buf, .iov_len = len};
+	struct msghdr msg = {
+	    .msg_iov = &iov,
+	    .msg_iovlen = 1,
+	    .msg_control = control.buf,
+	    .msg_controllen = CMSG_SPACE(sizeof(int) * nfds),
+	};
+	auto cmsg = CMSG_FIRSTHDR(&msg);
+	cmsg->cmsg_level = SOL_SOCKET;
+	cmsg->cmsg_type = SCM_RIGHTS;
+	cmsg->cmsg_len = CMSG_LEN(sizeof(int) * nfds);
+	memcpy(CMSG_DATA(cmsg), (int[]){fds[0], fds[1], fds[2], cwd, cgfd},
+	       sizeof(int) * nfds);
+
+	ssize_t ret;
+	do {
+		ret = sendmsg(launcher_socket, &msg, MSG_NOSIGNAL);
+	} while (ret < 0 && errno == EINTR);
+	int err = errno;
+	free(buf);
+	close(cwd);
+	if (ret < 0) {
+		// Most likely the launcher has died (EPIPE, ECONNRESET)
+		launcher_disconnect();
+		return -err;
+	}
+
+	struct launcher_reply reply;
+	do {
+		ret = recv(launcher_socket, &reply, sizeof(reply), 0);
+	} while (ret < 0 && errno == EINTR);
+	if (ret != sizeof(reply)) {
+		// The launcher died before replying, or the reply is garbled
+		err = ret < 0 ? errno : EPROTO;
+		launcher_disconnect();
+		return -err;
+	}
+	*contained = reply.contained;
+	return reply.pid;
+}
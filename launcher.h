@@ -0,0 +1,33 @@
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/. */
+
+/* Copyright (c) 2017, Yuxuan Shui <yshuiv7@gmail.com> */
+
+#pragma once
+
+#include <stdbool.h>
+#include <sys/types.h>
+
+/// Fork the launcher process, if it is enabled by setting the environment variable
+/// `DEAI_SPAWN_LAUNCHER`. The launcher is a tiny process that executes commands on
+/// behalf of deai, so launching a program won't need to duplicate deai's address space.
+///
+/// This has to be called early, before plugins are loaded, for it to be useful.
+void di_launcher_start(void);
+
+/// Ask the launcher to execute `argv`, with `fds` as the stdin, stdout and stderr of the
+/// new process. The new process is re-parented to deai (deai is a subreaper), so it can
+/// be waited on as if it is forked by deai.
+///
+/// The launcher is only an optimization, the caller should fork by itself if this fails.
+/// If the launcher can't be talked to, it won't be used again.
+///
+/// @param cgfd the cgroup to start the new process in, or -1
+/// @param[out] contained whether the new process was started in `cgfd`
+/// @return The pid of the new process, or a negative error code. -ENOTCONN means the
+///         launcher is not running.
+pid_t di_launcher_spawn(char *const *argv, const int fds[3], int cgfd, bool *contained);
+
+/// Whether the launcher is running, and new processes are started by it
+bool di_launcher_is_running(void);
@@ -4,24 +4,60 @@
 
 /* Copyright (c) 2017, Yuxuan Shui <yshuiv7@gmail.com> */
 
+#include <errno.h>
+#include <ev.h>
 #include <fcntl.h>
+#include <signal.h>
 #include <stdarg.h>
 #include <stdio.h>
 #include <strings.h>
+#include <sys/uio.h>
 #include <unistd.h>
 
 #include <deai/builtins/log.h>
 #include <deai/deai.h>
 #include <deai/helper.h>
 
+#include "byte_buf.h"
 #include "di_internal.h"
+#include "list.h"
 #include "log.h"
+#include "log_trace.h"
 #include "utils.h"
+#include "uthash.h"
+
+typedef int (*log_write_fn)(struct di_object *, struct di_string);
 
 struct di_log {
 	struct di_module;
 
 	int log_level;
+	struct di_object *log_target;
+	/// If `log_target` is one of the builtin targets, its write function, so we can
+	/// call it directly.
+	log_write_fn target_write;
+	/// Whether `log_target` is a trace target, which we give the log level to, and
+	/// which doesn't need the log messages to be formatted.
+	bool target_is_trace;
+};
+
+/// A logger name, and the log level set for it. These are never freed, so log records
+/// can refer to the names without copying them.
+struct log_name {
+	char *name;
+	/// Log level set for this name, or -1 if it follows the log module's level
+	int log_level;
+	struct list_head loggers;
+	UT_hash_handle hh;
+};
+
+static struct log_name *log_names;
+
+struct logger {
+	struct di_logger;
+	struct di_log *log;
+	struct log_name *name;
+	struct list_head siblings;
 };
 
 static int level_lookup(struct di_string l) {
@@ -41,7 +77,7 @@ static int level_lookup(struct di_string l) {
 	return DI_LOG_DEBUG + 1;
 }
 
-static const char *level_tostring(int log_level) {
+const char *di_log_level_to_string(int log_level) {
 	switch (log_level) {
 	case DI_LOG_DEBUG:
 		return "debug";
@@ -56,8 +92,333 @@ static const char *level_tostring(int log_level) {
 	}
 }
 
+struct log_file {
+	struct di_object_internal;
+	int fd;
+	/// Used to assemble a log line, so it can be written in one go
+	struct byte_buf buf;
+};
+
+/// Write out, and consume, the content of `b`
+static int log_write_all(int fd, struct byte_buf *b) {
+	while (!byte_buf_is_empty(b)) {
+		ssize_t ret = write(fd, byte_buf_data(b), byte_buf_len(b));
+		if (ret < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			byte_buf_clear(b);
+			return -errno;
+		}
+		byte_buf_consume(b, ret);
+	}
+	return 0;
+}
+
+static int file_target_write(struct log_file *lf, struct di_string log) {
+	byte_buf_append(&lf->buf, log.data, log.length);
+	if (log.length == 0 || log.data[log.length - 1] != '\n') {
+		byte_buf_append(&lf->buf, "\n", 1);
+	}
+	int ret = log_write_all(lf->fd, &lf->buf);
+	return ret < 0 ? ret : (int)log.length;
+}
+
+static void file_target_dtor(struct log_file *lf) {
+	if (lf->fd != STDERR_FILENO) {
+		close(lf->fd);
+	}
+	byte_buf_free(&lf->buf);
+}
+
+static struct di_object *file_target(struct di_log *l, struct di_string filename, bool overwrite) {
+	char filename_str[PATH_MAX];
+	if (!di_string_to_chars(filename, filename_str, sizeof(filename_str))) {
+		return di_new_error("Filename too long for file target");
+	}
+
+	int flags = O_WRONLY | O_CREAT | O_CLOEXEC | (overwrite ? O_TRUNC : O_APPEND);
+	int fd = open(filename_str, flags, 0644);
+	if (fd < 0) {
+		return di_new_error("Can't open %s for writing", filename_str);
+	}
+	auto lf = di_new_object_with_type(struct log_file);
+	di_set_type((struct di_object *)lf, "deai.builtin.log:FileTarget");
+	lf->fd = fd;
+	lf->dtor = (void *)file_target_dtor;
+	di_method(lf, "write", file_target_write, struct di_string);
+	return (void *)lf;
+}
+
+static struct di_object *stderr_target(struct di_log *unused l) {
+	auto ls = di_new_object_with_type(struct log_file);
+	di_set_type((struct di_object *)ls, "deai.builtin.log:StderrTarget");
+	ls->fd = STDERR_FILENO;
+	ls->dtor = (void *)file_target_dtor;
+	di_method(ls, "write", file_target_write, struct di_string);
+	return (void *)ls;
+}
+
+#define ASYNC_LOG_RING_SIZE (64 * 1024)
+
+/// Object type: AsyncFileTarget
+///
+/// A log target that keeps messages in memory, and writes them out in batches. Messages
+/// are written out at most `flush_interval` seconds after they are logged, or earlier
+/// when the buffer fills up, `flush` is called, or deai exits or crashes.
+struct async_log_file {
+	struct di_object_internal;
+	int fd;
+	struct ev_loop *loop;
+	ev_timer flush_timer;
+	double flush_interval;
+
+	/// Ring buffer of messages waiting to be written. `head` is the offset of the
+	/// oldest byte, `len` is the number of bytes in the ring.
+	char *ring;
+	size_t head, len;
+	struct list_head siblings;
+};
+
+/// All alive async targets, so they can be flushed on exit
+static LIST_HEAD(async_log_files);
+
+/// Write out what's in the ring, followed by `extra`. Only uses async-signal-safe
+/// functions, so it can be called when we crash.
+static int async_log_flush(struct async_log_file *lf, struct iovec *extra, int nextra) {
+	struct iovec iov[4];
+	int n = 0;
+	if (lf->len > 0) {
+		size_t first = ASYNC_LOG_RING_SIZE - lf->head;
+		if (first > lf->len) {
+			first = lf->len;
+		}
+		iov[n++] = (struct iovec){lf->ring + lf->head, first};
+		if (first < lf->len) {
+			iov[n++] = (struct iovec){lf->ring, lf->len - first};
+		}
+	}
+	for (int i = 0; i < nextra; i++) {
+		iov[n++] = extra[i];
+	}
+
+	int ret = 0;
+	struct iovec *curr = iov;
+	while (n > 0) {
+		ssize_t written = writev(lf->fd, curr, n);
+		if (written < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			ret = -errno;
+			break;
+		}
+		// Skip what's been written
+		while (n > 0 && (size_t)written >= curr->iov_len) {
+			written -= curr->iov_len;
+			curr++;
+			n--;
+		}
+		if (n > 0) {
+			curr->iov_base = (char *)curr->iov_base + written;
+			curr->iov_len -= written;
+		}
+	}
+	lf->head = lf->len = 0;
+	return ret;
+}
+
+static void async_log_push(struct async_log_file *lf, const char *data, size_t len) {
+	size_t tail = (lf->head + lf->len) % ASYNC_LOG_RING_SIZE;
+	size_t first = ASYNC_LOG_RING_SIZE - tail;
+	if (first > len) {
+		first = len;
+	}
+	memcpy(lf->ring + tail, data, first);
+	memcpy(lf->ring, data + first, len - first);
+	lf->len += len;
+}
+
+static int async_file_target_write(struct async_log_file *lf, struct di_string log) {
+	bool newline = log.length == 0 || log.data[log.length - 1] != '\n';
+	size_t len = log.length + newline;
+	if (lf->len + len > ASYNC_LOG_RING_SIZE) {
+		if (len > ASYNC_LOG_RING_SIZE) {
+			// Won't fit even in an empty ring, write it out right away
+			struct iovec extra[] = {{(void *)log.data, log.length},
+			                        {(void *)"\n", newline}};
+			int ret = async_log_flush(lf, extra, 2);
+			return ret < 0 ? ret : (int)log.length;
+		}
+		async_log_flush(lf, NULL, 0);
+	}
+
+	async_log_push(lf, log.data, log.length);
+	if (newline) {
+		async_log_push(lf, "\n", 1);
+	}
+	if (!ev_is_active(&lf->flush_timer)) {
+		ev_timer_set(&lf->flush_timer, lf->flush_interval, 0);
+		ev_timer_start(lf->loop, &lf->flush_timer);
+	}
+	return log.length;
+}
+
+/// Write out all buffered messages now
+static int async_file_target_flush(struct async_log_file *lf) {
+	return async_log_flush(lf, NULL, 0);
+}
+
+static void async_log_timer_cb(EV_P_ ev_timer *t, int revents) {
+	auto lf = container_of(t, struct async_log_file, flush_timer);
+	async_log_flush(lf, NULL, 0);
+}
+
+static void async_log_flush_all(void) {
+	struct async_log_file *lf;
+	list_for_each_entry (lf, &async_log_files, siblings) {
+		async_log_flush(lf, NULL, 0);
+	}
+}
+
+static struct sigaction log_old_actions[NSIG];
+
+/// Write out the logs we are holding on to: flush the async file targets, and dump the
+/// trace targets to stderr.
+static void log_crash_handler(int sig, siginfo_t *info, void *ucontext) {
+	async_log_flush_all();
+	di_trace_dump_all(STDERR_FILENO);
+
+	// Let whoever was handling this signal before us handle it. If this is a fault,
+	// it will happen again once we return.
+	sigaction(sig, &log_old_actions[sig], NULL);
+	if (info->si_code <= 0) {
+		// Sent by someone
+		raise(sig);
+	}
+}
+
+static void log_install_crash_handlers(void) {
+	static bool installed = false;
+	if (installed) {
+		return;
+	}
+	installed = true;
+
+	atexit(async_log_flush_all);
+	struct sigaction sa = {
+	    .sa_sigaction = log_crash_handler,
+	    .sa_flags = SA_SIGINFO | SA_NODEFER,
+	};
+	sigemptyset(&sa.sa_mask);
+	const int signals[] = {SIGSEGV, SIGBUS, SIGILL, SIGFPE, SIGABRT};
+	for (size_t i = 0; i < ARRAY_SIZE(signals); i++) {
+		sigaction(signals[i], &sa, &log_old_actions[signals[i]]);
+	}
+}
+
+static void async_file_target_dtor(struct async_log_file *lf) {
+	async_log_flush(lf, NULL, 0);
+	ev_timer_stop(lf->loop, &lf->flush_timer);
+	list_del(&lf->siblings);
+	close(lf->fd);
+	free(lf->ring);
+}
+
+static double async_file_target_get_flush_interval(struct async_log_file *lf) {
+	return lf->flush_interval;
+}
+
+static int async_file_target_set_flush_interval(struct async_log_file *lf, double interval) {
+	if (interval < 0) {
+		return -EINVAL;
+	}
+	lf->flush_interval = interval;
+	return 0;
+}
+
+/// Create a log target that writes to file `filename` asynchronously. If `overwrite` is
+/// true, the file will be truncated.
+///
+/// Return object type: AsyncFileTarget
+static struct di_object *
+async_file_target(struct di_log *l, struct di_string filename, bool overwrite) {
+	char filename_str[PATH_MAX];
+	if (!di_string_to_chars(filename, filename_str, sizeof(filename_str))) {
+		return di_new_error("Filename too long for file target");
+	}
+
+	di_object_with_cleanup di = di_module_get_deai((struct di_module *)l);
+	if (di == NULL) {
+		return di_new_error("deai is shutting down...");
+	}
+
+	int flags = O_WRONLY | O_CREAT | O_CLOEXEC | (overwrite ? O_TRUNC : O_APPEND);
+	int fd = open(filename_str, flags, 0644);
+	if (fd < 0) {
+		return di_new_error("Can't open %s for writing", filename_str);
+	}
+
+	auto lf = di_new_object_with_type(struct async_log_file);
+	di_set_type((struct di_object *)lf, "deai.builtin.log:AsyncFileTarget");
+	lf->fd = fd;
+	lf->loop = ((struct deai *)di)->loop;
+	lf->flush_interval = 0.1;
+	lf->ring = malloc(ASYNC_LOG_RING_SIZE);
+	ev_init(&lf->flush_timer, async_log_timer_cb);
+	list_add(&lf->siblings, &async_log_files);
+	log_install_crash_handlers();
+
+	lf->dtor = (void *)async_file_target_dtor;
+	di_method(lf, "write", async_file_target_write, struct di_string);
+	di_method(lf, "flush", async_file_target_flush);
+	di_getter(lf, flush_interval, async_file_target_get_flush_interval);
+	di_setter(lf, flush_interval, async_file_target_set_flush_interval, double);
+	return (void *)lf;
+}
+
+/// Write `str` to the log target
+static int
+log_write(struct di_log *l, int log_level, const char *name, struct di_string str) {
+	if (l->log_target == NULL) {
+		return 0;
+	}
+	if (l->target_is_trace) {
+		di_trace_record_string(l->log_target, log_level, name, str);
+		return (int)str.length;
+	}
+	if (l->target_write) {
+		return l->target_write(l->log_target, str);
+	}
+
+	int wrc = 0;
+	int rc = di_callr(l->log_target, "write", wrc, str);
+	return rc != 0 ? rc : wrc;
+}
+
+/// Format a message and write it to the log target. Trace targets get the arguments
+/// instead.
+static int
+log_vprintf(struct di_log *l, int log_level, const char *name, const char *fmt, va_list ap) {
+	if (l->log_target == NULL) {
+		return 0;
+	}
+	if (l->target_is_trace) {
+		di_trace_record_va(l->log_target, log_level, name, fmt, ap);
+		return 0;
+	}
+
+	struct byte_buf b = {0};
+	byte_buf_vprintf(&b, fmt, ap);
+	struct di_string str = {.data = byte_buf_data(&b), .length = byte_buf_len(&b)};
+	int ret = log_write(l, log_level, name, str);
+	byte_buf_free(&b);
+	return ret;
+}
+
 // Function exposed via di_object to be used by any plugins
-static int di_log(struct di_object *o, di_type_t *rt, union di_value *ret, struct di_tuple t) {
+static int
+log_call(struct di_object *o, di_type_t *rt, union di_value *ret, struct di_tuple t) {
 	if (t.length != 3) {
 		return -EINVAL;
 	}
@@ -80,80 +441,59 @@ static int di_log(struct di_object *o, di_type_t *rt, union di_value *ret, struc
 	*rt = DI_TYPE_NINT;
 
 	struct di_log *l = (void *)o;
-	if (level_lookup(log_level) > l->log_level) {
+	int nll = level_lookup(log_level);
+	if (nll > l->log_level) {
 		return 0;
 	}
 
-	with_object_cleanup(di_object) ltgt = NULL;
-	if (di_get(l, "log_target", ltgt) != 0) {
-		ret->nint = 0;
-		return 0;
-	}
-
-	int wrc = 0;
-	int rc = di_callr(ltgt, "write", wrc, str);
-	if (rc != 0) {
-		ret->nint = rc;
-	} else {
-		ret->nint = wrc;
-	}
+	ret->nint = log_write(l, nll, NULL, str);
 	return 0;
 }
 
-struct log_file {
-	struct di_object_internal;
-	FILE *f;
-};
-
-static int file_target_write(struct log_file *lf, struct di_string log) {
-	auto rc = fwrite(log.data, 1, log.length, lf->f);
-	if (log.data[log.length - 1] != '\n') {
-		fputs("\n", lf->f);
+/// Create a log target that keeps log messages in memory, in a ring buffer of `size`
+/// bytes (1MiB if 0). Messages from C plugins are stored without being formatted, and
+/// only formatted when the trace is dumped, with the `dump` or `dump_to_file` methods, or
+/// when deai receives SIGUSR1 or crashes. The oldest messages are dropped when the ring
+/// is full.
+///
+/// Return object type: TraceTarget
+static struct di_object *trace_target(struct di_log *l, uint64_t size) {
+	di_object_with_cleanup di = di_module_get_deai((struct di_module *)l);
+	if (di == NULL) {
+		return di_new_error("deai is shutting down...");
 	}
-	fflush(lf->f);
-	return rc;
+	auto ret = di_new_trace_target((struct deai *)di, size ? size : 1024 * 1024);
+	log_install_crash_handlers();
+	return ret;
 }
 
-static void file_target_dtor(struct log_file *lf) {
-	fclose(lf->f);
+static struct di_object *get_log_target(struct di_log *l) {
+	return di_ref_object(l->log_target);
 }
 
-static struct di_object *file_target(struct di_log *l, struct di_string filename, bool overwrite) {
-	char filename_str[PATH_MAX];
-	if (!di_string_to_chars(filename, filename_str, sizeof(filename_str))) {
-		return di_new_error("Filename too long for file target");
-	}
-
-	FILE *f = fopen(filename_str, overwrite ? "w" : "a");
-	if (!f) {
-		return di_new_error("Can't open %s for writing", filename);
+static void set_log_target(struct di_log *l, struct di_object *target) {
+	if (l->log_target) {
+		di_unref_object(l->log_target);
 	}
+	l->log_target = di_ref_object(target);
 
-	int fd = fileno(f);
-	if (fd < 0) {
-		fclose(f);
-		return di_new_error("Can't get the file descriptor");
-	}
-	int ret = fcntl(fd, F_SETFD, fcntl(fd, F_GETFD) | FD_CLOEXEC);
-	if (ret < 0) {
-		fclose(f);
-		return di_new_error("Can't set cloexec");
+	if (di_check_type(target, "deai.builtin.log:FileTarget") ||
+	    di_check_type(target, "deai.builtin.log:StderrTarget")) {
+		l->target_write = (log_write_fn)file_target_write;
+	} else if (di_check_type(target, "deai.builtin.log:AsyncFileTarget")) {
+		l->target_write = (log_write_fn)async_file_target_write;
+	} else {
+		l->target_write = NULL;
 	}
-	auto lf = di_new_object_with_type(struct log_file);
-	di_set_type((struct di_object *)lf, "deai.builtin.log:FileTarget");
-	lf->f = f;
-	lf->dtor = (void *)file_target_dtor;
-	di_method(lf, "write", file_target_write, struct di_string);
-	return (void *)lf;
+	l->target_is_trace = di_check_type(target, DI_TRACE_TARGET_TYPE);
 }
 
-static struct di_object *stderr_target(struct di_log *unused l) {
-	auto ls = di_new_object_with_type(struct log_file);
-	di_set_type((struct di_object *)ls, "deai.builtin.log:StderrTarget");
-	ls->f = stderr;
-	ls->dtor = NULL;
-	di_method(ls, "write", file_target_write, struct di_string);
-	return (void *)ls;
+static void di_log_dtor(struct di_object *o) {
+	struct di_log *l = (void *)o;
+	if (l->log_target) {
+		di_unref_object(l->log_target);
+		l->log_target = NULL;
+	}
 }
 
 // Public API to be used by C plugins
@@ -164,20 +504,48 @@ int di_log_va(struct di_object *o, int log_level, const char *fmt, ...) {
 	}
 	va_list ap;
 	va_start(ap, fmt);
-	int ret = vfprintf(stderr, fmt, ap);
+	int ret = log_vprintf(l, log_level, NULL, fmt, ap);
 	va_end(ap);
+	return ret;
+}
 
+int di_logger_log(struct di_object *o, int log_level, const char *fmt, ...) {
+	auto lg = (struct logger *)o;
+	if (log_level > lg->max_level) {
+		return 0;
+	}
+	va_list ap;
+	va_start(ap, fmt);
+	int ret = log_vprintf(lg->log, log_level, lg->name->name, fmt, ap);
+	va_end(ap);
 	return ret;
 }
 
+/// Recalculate the log levels of loggers named `name`
+static void log_name_update_loggers(struct log_name *name, int default_level) {
+	int level = name->log_level >= 0 ? name->log_level : default_level;
+	struct logger *lg;
+	list_for_each_entry (lg, &name->loggers, siblings) {
+		lg->max_level = level;
+	}
+}
+
+static void log_set_default_level(struct di_log *l, int log_level) {
+	l->log_level = log_level;
+	struct log_name *name, *tmp;
+	HASH_ITER (hh, log_names, name, tmp) {
+		log_name_update_loggers(name, log_level);
+	}
+}
+
 static const char *get_log_level(struct di_log *l) {
-	return strdup(level_tostring(l->log_level));
+	return strdup(di_log_level_to_string(l->log_level));
 }
 
 static int set_log_level(struct di_log *l, struct di_string ll) {
 	int nll = level_lookup(ll);
 	if (nll <= DI_LOG_DEBUG) {
-		l->log_level = nll;
+		log_set_default_level(l, nll);
 		return 0;
 	}
 	return -1;
@@ -187,11 +555,91 @@ int di_set_log_level(struct di_object *o, int log_level) {
 	if (log_level > DI_LOG_DEBUG) {
 		return -1;
 	}
-	struct di_log *l = (void *)o;
-	l->log_level = log_level;
+	log_set_default_level((struct di_log *)o, log_level);
 	return 0;
 }
 
+/// Log `str` with this logger, at level `log_level`
+static int
+logger_log(struct logger *lg, struct di_string log_level, struct di_string str) {
+	int nll = level_lookup(log_level);
+	if (nll > lg->max_level) {
+		return 0;
+	}
+	return log_write(lg->log, nll, lg->name->name, str);
+}
+
+static const char *logger_get_log_level(struct logger *lg) {
+	return strdup(di_log_level_to_string(lg->max_level));
+}
+
+/// Set the log level for all loggers with this name. Setting it to "default" makes them
+/// follow the log level of the log module again.
+static int logger_set_log_level(struct logger *lg, struct di_string ll) {
+	if (ll.length == strlen("default") &&
+	    strncasecmp(ll.data, "default", ll.length) == 0) {
+		lg->name->log_level = -1;
+	} else {
+		int nll = level_lookup(ll);
+		if (nll > DI_LOG_DEBUG) {
+			return -1;
+		}
+		lg->name->log_level = nll;
+	}
+	log_name_update_loggers(lg->name, lg->log->log_level);
+	return 0;
+}
+
+static struct di_string logger_get_name(struct logger *lg) {
+	return di_string_dup(lg->name->name);
+}
+
+static void logger_dtor(struct logger *lg) {
+	list_del(&lg->siblings);
+	di_unref_object((struct di_object *)lg->log);
+}
+
+struct di_object *di_new_logger(struct di_object *log_module, const char *name_str) {
+	struct log_name *name = NULL;
+	HASH_FIND_STR(log_names, name_str, name);
+	if (name == NULL) {
+		name = tmalloc(struct log_name, 1);
+		name->name = strdup(name_str);
+		name->log_level = -1;
+		INIT_LIST_HEAD(&name->loggers);
+		HASH_ADD_KEYPTR(hh, log_names, name->name, strlen(name->name), name);
+	}
+
+	auto l = (struct di_log *)log_module;
+	auto lg = di_new_object_with_type(struct logger);
+	di_set_type((struct di_object *)lg, "deai.builtin.log:Logger");
+	lg->log = (struct di_log *)di_ref_object(log_module);
+	lg->name = name;
+	lg->max_level = name->log_level >= 0 ? name->log_level : l->log_level;
+	list_add(&lg->siblings, &name->loggers);
+
+	di_set_object_dtor((struct di_object *)lg, (void *)logger_dtor);
+	di_method(lg, "log", logger_log, struct di_string, struct di_string);
+	di_getter(lg, log_level, logger_get_log_level);
+	di_setter(lg, log_level, logger_set_log_level, struct di_string);
+	di_getter(lg, name, logger_get_name);
+	return (struct di_object *)lg;
+}
+
+/// Get a logger named `name`. Loggers with the same name share their log level, which
+/// follows the log level of the log module until it's set on one of the loggers.
+///
+/// Return object type: Logger
+static struct di_object *get_logger(struct di_log *l, struct di_string name) {
+	if (name.length == 0) {
+		return di_new_error("Logger name can't be empty");
+	}
+	char *name_str = di_string_to_chars_alloc(name);
+	auto ret = di_new_logger((struct di_object *)l, name_str);
+	free(name_str);
+	return ret;
+}
+
 struct di_object *log_module;
 void di_init_log(struct deai *di) {
 	auto lm = di_new_module_with_size(di, sizeof(struct di_log));
@@ -204,12 +652,18 @@ void di_init_log(struct deai *di) {
 	l->log_level = DI_LOG_WARN;
 
 	auto dtgt = stderr_target(l);
+	set_log_target(l, dtgt);
+	di_unref_object(dtgt);
 
-	di_add_member_move((struct di_object *)l, di_string_borrow("log_target"),
-	                   (di_type_t[]){DI_TYPE_OBJECT}, &dtgt);
-	((struct di_object_internal *)l)->call = di_log;
+	((struct di_object_internal *)l)->call = log_call;
+	di_set_object_dtor((struct di_object *)l, di_log_dtor);
 	di_method(l, "file_target", file_target, struct di_string, bool);
+	di_method(l, "async_file_target", async_file_target, struct di_string, bool);
 	di_method(l, "stderr_target", stderr_target);
+	di_method(l, "trace_target", trace_target, uint64_t);
+	di_method(l, "logger", get_logger, struct di_string);
+	di_getter(l, log_target, get_log_target);
+	di_setter(l, log_target, set_log_target, struct di_object *);
 	di_getter(l, log_level, get_log_level);
 	di_setter(l, log_level, set_log_level, struct di_string);
 
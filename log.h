@@ -6,3 +6,6 @@
 
 #pragma once
 void di_init_log(struct deai *di);
+
+/// Name of `log_level`, or NULL if it's not a valid log level
+const char *di_log_level_to_string(int log_level);
@@ -0,0 +1,655 @@
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/. */
+
+/* Copyright (c) 2017, Yuxuan Shui <yshuiv7@gmail.com> */
+
+#include <errno.h>
+#include <ev.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <signal.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <deai/helper.h>
+
+#include "di_internal.h"
+#include "list.h"
+#include "log.h"
+#include "log_trace.h"
+#include "utils.h"
+
+// A trace target stores log messages as binary records in a ring, and only formats them
+// when the ring is dumped. A record keeps the format string as a pointer, and the
+// arguments are copied into the record, strings included.
+//
+// Records never wrap around the end of the ring, the space left at the end is filled
+// with a padding record instead. When the ring is full, the oldest records are dropped.
+
+#define TRACE_MAX_RECORD 4096
+// Enough for every type of argument, including long double
+#define TRACE_ALIGNMENT 16
+#define TRACE_ALIGN(x) (((x) + TRACE_ALIGNMENT - 1) & ~(size_t)(TRACE_ALIGNMENT - 1))
+
+enum trace_record_kind {
+	TRACE_RECORD_PADDING,
+	/// `fmt` and arguments
+	TRACE_RECORD_FORMAT,
+	/// An already formatted message follows the header
+	TRACE_RECORD_STRING,
+};
+
+struct trace_record {
+	/// Size of the whole record, aligned to TRACE_ALIGNMENT
+	uint32_t size;
+	uint8_t kind;
+	uint8_t level;
+	/// Length of the message for TRACE_RECORD_STRING
+	uint32_t len;
+	int64_t timestamp_ns;
+	const char *module;
+	const char *fmt;
+} __attribute__((aligned(TRACE_ALIGNMENT)));
+
+enum trace_arg_type {
+	TRACE_ARG_NONE,
+	TRACE_ARG_INT,
+	TRACE_ARG_UINT,
+	TRACE_ARG_CHAR,
+	TRACE_ARG_DOUBLE,
+	TRACE_ARG_LONG_DOUBLE,
+	TRACE_ARG_POINTER,
+	/// Null terminated string of `len` bytes follows the header
+	TRACE_ARG_STRING,
+};
+
+struct trace_arg {
+	uint32_t type;
+	uint32_t len;
+	union {
+		long long i;
+		unsigned long long u;
+		double d;
+		long double ld;
+		const void *p;
+	};
+};
+
+/// A parsed conversion specification
+struct trace_spec {
+	/// Flags, width and precision
+	const char *flags;
+	size_t flags_len;
+	int stars;
+	/// Precision given in the format, -1 if there is none, or if it's `*`
+	int precision;
+	/// Whether the precision is `*`, in which case it's the last star argument
+	bool precision_star;
+	char length[3];
+	char conv;
+	/// Pointer past the conversion character
+	const char *end;
+};
+
+struct trace_target {
+	struct di_object_internal;
+	char *ring;
+	uint64_t size;
+	/// Positions of the oldest record, and where the next record will be, they
+	/// only grow. Offsets in the ring are positions modulo `size`.
+	uint64_t read_pos, write_pos;
+	struct list_head siblings;
+};
+
+static LIST_HEAD(trace_targets);
+static ev_signal trace_sigusr1;
+static struct ev_loop *trace_loop;
+
+/// Parse the conversion specification after '%' at `p`
+static bool trace_parse_spec(const char *p, struct trace_spec *s) {
+	*s = (struct trace_spec){.flags = p, .precision = -1};
+	while (*p && strchr("-+ #0'I", *p)) {
+		p++;
+	}
+	for (int part = 0; part < 2; part++) {
+		if (part == 1) {
+			if (*p != '.') {
+				break;
+			}
+			p++;
+		}
+		if (*p == '*') {
+			s->stars++;
+			s->precision_star = part == 1;
+			p++;
+		} else {
+			if (part == 1) {
+				s->precision = 0;
+			}
+			while (*p >= '0' && *p <= '9') {
+				if (part == 1 && s->precision < INT_MAX / 10) {
+					s->precision = s->precision * 10 + (*p - '0');
+				}
+				p++;
+			}
+		}
+		if (*p == '$') {
+			// Positional arguments are not supported
+			return false;
+		}
+	}
+	s->flags_len = p - s->flags;
+
+	size_t len = 0;
+	while (*p && strchr("hlLqjzZt", *p) && len < 2) {
+		s->length[len++] = *p++;
+	}
+	if (!*p) {
+		return false;
+	}
+	s->conv = *p;
+	s->end = p + 1;
+	return true;
+}
+
+static enum trace_arg_type trace_arg_type_of(const struct trace_spec *s) {
+	switch (s->conv) {
+	case 'd':
+	case 'i':
+		return TRACE_ARG_INT;
+	case 'u':
+	case 'o':
+	case 'x':
+	case 'X':
+		return TRACE_ARG_UINT;
+	case 'c':
+		return TRACE_ARG_CHAR;
+	case 'e':
+	case 'E':
+	case 'f':
+	case 'F':
+	case 'g':
+	case 'G':
+	case 'a':
+	case 'A':
+		return s->length[0] == 'L' ? TRACE_ARG_LONG_DOUBLE : TRACE_ARG_DOUBLE;
+	case 'p':
+		return TRACE_ARG_POINTER;
+	case 's':
+	case 'm':
+		return TRACE_ARG_STRING;
+	default:
+		return TRACE_ARG_NONE;
+	}
+}
+
+/// Get an integer argument with length modifier `length`, truncated the way printf
+/// would.
+static long long trace_va_arg_signed(va_list *ap, const char *length) {
+	if (strcmp(length, "ll") == 0 || strcmp(length, "q") == 0) {
+		return va_arg(*ap, long long);
+	}
+	switch (length[0]) {
+	case 'l':
+		return va_arg(*ap, long);
+	case 'j':
+		return va_arg(*ap, intmax_t);
+	case 'z':
+	case 'Z':
+		return va_arg(*ap, ssize_t);
+	case 't':
+		return va_arg(*ap, ptrdiff_t);
+	case 'h':
+		return length[1] == 'h' ? (signed char)va_arg(*ap, int)
+		                        : (short)va_arg(*ap, int);
+	default:
+		return va_arg(*ap, int);
+	}
+}
+
+static unsigned long long trace_va_arg_unsigned(va_list *ap, const char *length) {
+	if (strcmp(length, "ll") == 0 || strcmp(length, "q") == 0) {
+		return va_arg(*ap, unsigned long long);
+	}
+	switch (length[0]) {
+	case 'l':
+		return va_arg(*ap, unsigned long);
+	case 'j':
+		return va_arg(*ap, uintmax_t);
+	case 'z':
+	case 'Z':
+		return va_arg(*ap, size_t);
+	case 't':
+		return (size_t)va_arg(*ap, ptrdiff_t);
+	case 'h':
+		return length[1] == 'h' ? (unsigned char)va_arg(*ap, unsigned int)
+		                        : (unsigned short)va_arg(*ap, unsigned int);
+	default:
+		return va_arg(*ap, unsigned int);
+	}
+}
+
+/// Append an argument to the record being built in `buf`
+static struct trace_arg *
+trace_push_arg(char *buf, size_t *pos, uint32_t type, size_t extra) {
+	size_t size = TRACE_ALIGN(sizeof(struct trace_arg) + extra);
+	if (*pos + size > TRACE_MAX_RECORD) {
+		return NULL;
+	}
+	auto arg = (struct trace_arg *)(buf + *pos);
+	arg->type = type;
+	arg->len = extra;
+	*pos += size;
+	return arg;
+}
+
+/// Build a TRACE_RECORD_FORMAT record in `buf`, returns its size, or 0 if the message
+/// can't be recorded this way.
+static size_t
+trace_build_record(char *buf, int saved_errno, const char *fmt, va_list *ap) {
+	size_t pos = sizeof(struct trace_record);
+	for (const char *p = fmt; (p = strchr(p, '%')); ) {
+		struct trace_spec s;
+		if (!trace_parse_spec(p + 1, &s)) {
+			return 0;
+		}
+		p = s.end;
+		int precision = s.precision;
+		for (int i = 0; i < s.stars; i++) {
+			auto arg = trace_push_arg(buf, &pos, TRACE_ARG_INT, 0);
+			if (!arg) {
+				return 0;
+			}
+			arg->i = va_arg(*ap, int);
+			if (s.precision_star && i == s.stars - 1) {
+				// A negative precision is taken as if it's omitted
+				precision = arg->i < 0 ? -1 : (int)arg->i;
+			}
+		}
+
+		auto type = trace_arg_type_of(&s);
+		if (s.conv == 'n') {
+			(void)va_arg(*ap, void *);
+			continue;
+		}
+		if (type == TRACE_ARG_NONE) {
+			if (s.conv != '%') {
+				return 0;
+			}
+			continue;
+		}
+		if (type == TRACE_ARG_CHAR && s.length[0] == 'l') {
+			// Wide characters are not supported
+			return 0;
+		}
+		if (type == TRACE_ARG_STRING) {
+			if (s.length[0] == 'l') {
+				// Wide strings are not supported
+				return 0;
+			}
+			const char *str = s.conv == 'm' ? strerror(saved_errno)
+			                                : va_arg(*ap, const char *);
+			if (!str) {
+				str = "(null)";
+			}
+			// With a precision, the string doesn't have to be null terminated, e.g.
+			// `%.*s` of a di_string
+			size_t len = precision >= 0 ? strnlen(str, precision) : strlen(str);
+			auto arg = trace_push_arg(buf, &pos, type, len + 1);
+			if (!arg) {
+				return 0;
+			}
+			memcpy(arg + 1, str, len);
+			((char *)(arg + 1))[len] = '\0';
+			continue;
+		}
+
+		auto arg = trace_push_arg(buf, &pos, type, 0);
+		if (!arg) {
+			return 0;
+		}
+		switch (type) {
+		case TRACE_ARG_INT:
+			arg->i = trace_va_arg_signed(ap, s.length);
+			break;
+		case TRACE_ARG_UINT:
+			arg->u = trace_va_arg_unsigned(ap, s.length);
+			break;
+		case TRACE_ARG_CHAR:
+			arg->i = va_arg(*ap, int);
+			break;
+		case TRACE_ARG_DOUBLE:
+			arg->d = va_arg(*ap, double);
+			break;
+		case TRACE_ARG_LONG_DOUBLE:
+			arg->ld = va_arg(*ap, long double);
+			break;
+		case TRACE_ARG_POINTER:
+			arg->p = va_arg(*ap, void *);
+			break;
+		case TRACE_ARG_NONE:
+		case TRACE_ARG_STRING:
+			unreachable();
+		}
+	}
+	return pos;
+}
+
+static int64_t trace_now(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_REALTIME, &ts);
+	return (int64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/// Copy a record into the ring, dropping the oldest records if there is not enough
+/// space.
+static void trace_ring_push(struct trace_target *t, const struct trace_record *r) {
+	size_t off = t->write_pos % t->size;
+	size_t pad = t->size - off < r->size ? t->size - off : 0;
+	while (t->write_pos + pad + r->size - t->read_pos > t->size) {
+		auto oldest = (struct trace_record *)(t->ring + t->read_pos % t->size);
+		t->read_pos += oldest->size;
+	}
+	if (pad) {
+		auto padding = (struct trace_record *)(t->ring + off);
+		padding->size = pad;
+		padding->kind = TRACE_RECORD_PADDING;
+		t->write_pos += pad;
+	}
+	memcpy(t->ring + t->write_pos % t->size, r, r->size);
+	// Make sure the record is complete before it's visible to the crash handler
+	__atomic_signal_fence(__ATOMIC_SEQ_CST);
+	t->write_pos += r->size;
+}
+
+void di_trace_record_string(struct di_object *obj, int log_level, const char *module,
+                            struct di_string str) {
+	auto t = (struct trace_target *)obj;
+	char buf[TRACE_MAX_RECORD] __attribute__((aligned(TRACE_ALIGNMENT)));
+	auto r = (struct trace_record *)buf;
+	size_t max_len = TRACE_MAX_RECORD - sizeof(*r) - 1;
+	r->kind = TRACE_RECORD_STRING;
+	r->level = log_level;
+	r->len = str.length > max_len ? max_len : str.length;
+	r->timestamp_ns = trace_now();
+	r->module = module;
+	r->fmt = NULL;
+	memcpy(r + 1, str.data, r->len);
+	((char *)(r + 1))[r->len] = '\0';
+	r->size = TRACE_ALIGN(sizeof(*r) + r->len + 1);
+	trace_ring_push(t, r);
+}
+
+void di_trace_record_va(struct di_object *obj, int log_level, const char *module,
+                        const char *fmt, va_list ap) {
+	int saved_errno = errno;
+	auto t = (struct trace_target *)obj;
+	char buf[TRACE_MAX_RECORD] __attribute__((aligned(TRACE_ALIGNMENT)));
+	auto r = (struct trace_record *)buf;
+
+	va_list ap2;
+	va_copy(ap2, ap);
+	size_t size = trace_build_record(buf, saved_errno, fmt, &ap2);
+	va_end(ap2);
+	if (size == 0) {
+		// Not something we can record without formatting
+		char str[TRACE_MAX_RECORD];
+		errno = saved_errno;
+		int len = vsnprintf(str, sizeof(str), fmt, ap);
+		if (len < 0) {
+			return;
+		}
+		struct di_string s = {
+		    str, (size_t)len < sizeof(str) ? (size_t)len : sizeof(str) - 1};
+		di_trace_record_string(obj, log_level, module, s);
+		return;
+	}
+
+	r->size = size;
+	r->kind = TRACE_RECORD_FORMAT;
+	r->level = log_level;
+	r->len = 0;
+	r->timestamp_ns = trace_now();
+	r->module = module;
+	r->fmt = fmt;
+	trace_ring_push(t, r);
+}
+
+/// Format one argument with conversion specification `s`
+static int trace_format_arg(char *out, size_t cap, const struct trace_spec *s,
+                            const struct trace_arg *const *args) {
+	// Rebuild the specification, with the length modifier matching how the argument
+	// is stored
+	char spec[64];
+	auto type = args[s->stars]->type;
+	const char *length = "";
+	char conv = s->conv;
+	if (type == TRACE_ARG_INT || type == TRACE_ARG_UINT) {
+		length = "ll";
+	} else if (type == TRACE_ARG_LONG_DOUBLE) {
+		length = "L";
+	} else if (type == TRACE_ARG_STRING) {
+		conv = 's';
+	}
+	if (s->flags_len + 4 > sizeof(spec)) {
+		return 0;
+	}
+	int w = s->stars > 0 ? (int)args[0]->i : 0;
+	int p = s->stars > 1 ? (int)args[1]->i : 0;
+	snprintf(spec, sizeof(spec), "%%%.*s%s%c", (int)s->flags_len, s->flags, length,
+	         conv);
+
+#define FORMAT(value)                                                                    \
+	(s->stars == 0   ? snprintf(out, cap, spec, value)                               \
+	 : s->stars == 1 ? snprintf(out, cap, spec, w, value)                            \
+	                 : snprintf(out, cap, spec, w, p, value))
+	const struct trace_arg *arg = args[s->stars];
+	switch ((enum trace_arg_type)arg->type) {
+	case TRACE_ARG_INT:
+		return FORMAT(arg->i);
+	case TRACE_ARG_UINT:
+		return FORMAT(arg->u);
+	case TRACE_ARG_CHAR:
+		return FORMAT((int)arg->i);
+	case TRACE_ARG_DOUBLE:
+		return FORMAT(arg->d);
+	case TRACE_ARG_LONG_DOUBLE:
+		return FORMAT(arg->ld);
+	case TRACE_ARG_POINTER:
+		return FORMAT(arg->p);
+	case TRACE_ARG_STRING:
+		return FORMAT((const char *)(arg + 1));
+	case TRACE_ARG_NONE:
+		break;
+	}
+#undef FORMAT
+	return 0;
+}
+
+/// Format the message of a TRACE_RECORD_FORMAT record
+static size_t trace_format_message(char *out, size_t cap, const struct trace_record *r) {
+	const char *end = (const char *)r + r->size;
+	const char *next_arg = (const char *)(r + 1);
+	size_t pos = 0;
+	const char *p = r->fmt;
+	while (*p && pos + 1 < cap) {
+		if (*p != '%') {
+			out[pos++] = *p++;
+			continue;
+		}
+
+		struct trace_spec s;
+		if (!trace_parse_spec(p + 1, &s)) {
+			break;
+		}
+		p = s.end;
+		if (s.conv == '%') {
+			out[pos++] = '%';
+			continue;
+		}
+		if (s.conv == 'n') {
+			continue;
+		}
+
+		// Collect the arguments used by this conversion
+		const struct trace_arg *args[3];
+		for (int i = 0; i <= s.stars; i++) {
+			if (next_arg + sizeof(struct trace_arg) > end) {
+				goto out;
+			}
+			args[i] = (const struct trace_arg *)next_arg;
+			next_arg += TRACE_ALIGN(sizeof(struct trace_arg) + args[i]->len);
+		}
+		int ret = trace_format_arg(out + pos, cap - pos, &s, args);
+		if (ret > 0) {
+			pos += (size_t)ret < cap - pos ? (size_t)ret : cap - pos - 1;
+		}
+	}
+out:
+	out[pos] = '\0';
+	return pos;
+}
+
+static void trace_write_all(int fd, const char *buf, size_t len) {
+	while (len > 0) {
+		ssize_t ret = write(fd, buf, len);
+		if (ret < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			return;
+		}
+		buf += ret;
+		len -= ret;
+	}
+}
+
+/// Write out the records in `t`. Doesn't allocate memory.
+static void trace_dump(struct trace_target *t, int fd) {
+	char line[TRACE_MAX_RECORD + 128];
+	uint64_t pos = t->read_pos;
+	while (pos < t->write_pos) {
+		auto r = (const struct trace_record *)(t->ring + pos % t->size);
+		if (r->size == 0 || r->size > t->write_pos - pos) {
+			// Corrupted, could happen if we crashed in the middle of writing
+			break;
+		}
+		pos += r->size;
+		if (r->kind == TRACE_RECORD_PADDING) {
+			continue;
+		}
+		if (r->size < sizeof(struct trace_record)) {
+			break;
+		}
+
+		const char *level = di_log_level_to_string(r->level);
+		int len = snprintf(line, sizeof(line), "[%lld.%06lld] %s %s%s",
+		                   (long long)(r->timestamp_ns / 1000000000),
+		                   (long long)(r->timestamp_ns % 1000000000 / 1000),
+		                   level ? level : "-", r->module ? r->module : "",
+		                   r->module ? ": " : "");
+		if (len < 0 || (size_t)len >= sizeof(line) / 2) {
+			continue;
+		}
+		size_t msg_len;
+		if (r->kind == TRACE_RECORD_STRING) {
+			msg_len = sizeof(line) - len - 1;
+			if (r->len < msg_len) {
+				msg_len = r->len;
+			}
+			memcpy(line + len, r + 1, msg_len);
+		} else {
+			msg_len =
+			    trace_format_message(line + len, sizeof(line) - len - 1, r);
+		}
+		len += msg_len;
+		if (len == 0 || line[len - 1] != '\n') {
+			line[len++] = '\n';
+		}
+		trace_write_all(fd, line, len);
+	}
+}
+
+void di_trace_dump_all(int fd) {
+	struct trace_target *t;
+	list_for_each_entry (t, &trace_targets, siblings) {
+		trace_dump(t, fd);
+	}
+}
+
+/// Write out the trace to stderr
+static void trace_target_dump(struct trace_target *t) {
+	trace_dump(t, STDERR_FILENO);
+}
+
+/// Write out the trace to file `filename`, overwriting it
+static int trace_target_dump_to_file(struct trace_target *t, struct di_string filename) {
+	char filename_str[PATH_MAX];
+	if (!di_string_to_chars(filename, filename_str, sizeof(filename_str))) {
+		return -ENAMETOOLONG;
+	}
+	int fd = open(filename_str, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+	if (fd < 0) {
+		return -errno;
+	}
+	trace_dump(t, fd);
+	close(fd);
+	return 0;
+}
+
+/// Record an already formatted log message, without a log level
+static int trace_target_write(struct trace_target *t, struct di_string log) {
+	di_trace_record_string((struct di_object *)t, -1, NULL, log);
+	return log.length;
+}
+
+static void trace_sigusr1_cb(EV_P_ ev_signal *w, int revents) {
+	di_trace_dump_all(STDERR_FILENO);
+}
+
+static void trace_target_dtor(struct trace_target *t) {
+	list_del(&t->siblings);
+	munmap(t->ring, t->size);
+	if (list_empty(&trace_targets)) {
+		ev_ref(trace_loop);
+		ev_signal_stop(trace_loop, &trace_sigusr1);
+	}
+}
+
+struct di_object *di_new_trace_target(struct deai *di, uint64_t size) {
+	long page_size = sysconf(_SC_PAGESIZE);
+	size = (size + page_size - 1) / page_size * page_size;
+	if (size < 2 * TRACE_MAX_RECORD) {
+		size = 2 * TRACE_MAX_RECORD;
+	}
+	void *ring =
+	    mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (ring == MAP_FAILED) {
+		return di_new_error("Failed to allocate the trace ring: %s",
+		                    strerror(errno));
+	}
+
+	auto t = di_new_object_with_type(struct trace_target);
+	di_set_type((struct di_object *)t, DI_TRACE_TARGET_TYPE);
+	t->ring = ring;
+	t->size = size;
+	t->dtor = (void *)trace_target_dtor;
+	di_method(t, "write", trace_target_write, struct di_string);
+	di_method(t, "dump", trace_target_dump);
+	di_method(t, "dump_to_file", trace_target_dump_to_file, struct di_string);
+
+	if (list_empty(&trace_targets)) {
+		// Dump the traces on SIGUSR1, this shouldn't keep the event loop running
+		trace_loop = di->loop;
+		ev_signal_init(&trace_sigusr1, trace_sigusr1_cb, SIGUSR1);
+		ev_signal_start(trace_loop, &trace_sigusr1);
+		ev_unref(trace_loop);
+	}
+	list_add(&t->siblings, &trace_targets);
+	return (struct di_object *)t;
+}
@@ -0,0 +1,30 @@
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/. */
+
+/* Copyright (c) 2017, Yuxuan Shui <yshuiv7@gmail.com> */
+
+#pragma once
+
+#include <stdarg.h>
+#include <stdint.h>
+
+#include <deai/deai.h>
+
+#define DI_TRACE_TARGET_TYPE "deai.builtin.log:TraceTarget"
+
+/// Create a trace target with a ring of `size` bytes
+struct di_object *di_new_trace_target(struct deai *di, uint64_t size);
+
+/// Record a log message in the trace target `t`, without formatting it. The format
+/// string and `module` have to stay valid as long as the trace target is alive.
+void di_trace_record_va(struct di_object *t, int log_level, const char *module,
+                        const char *fmt, va_list ap);
+
+/// Record an already formatted log message in the trace target `t`
+void di_trace_record_string(struct di_object *t, int log_level, const char *module,
+                            struct di_string str);
+
+/// Format and write out the content of all trace targets to `fd`. Doesn't allocate
+/// memory, so it can be used when we crash.
+void di_trace_dump_all(int fd);
@@ -25,8 +25,10 @@
 
 #include <config.h>
 
+#include "cgroup.h"
 #include "di_internal.h"
 #include "event.h"
+#include "launcher.h"
 #include "log.h"
 #include "os.h"
 #include "spawn.h"
@@ -159,8 +161,9 @@ static void kill_all_descendants(void) {
 	return;
 }
 #else
-// Consider PRDEATHSIG
-static void kill_all_descendants(void) {
+// Fallback for when the kernel doesn't list children of processes in /proc, this has to
+// look at every process on the system.
+static void kill_all_descendants_by_scan(void) {
 	// Best effort attempt to kill all descendants of ourself
 	struct _childp {
 		pid_t pid, ppid;
@@ -266,6 +269,83 @@ static void kill_all_descendants(void) {
 		free(i);
 	}
 }
+
+struct pid_list {
+	pid_t *pids;
+	size_t len, cap;
+};
+
+/// Append the children of all threads of `pid` to `l`
+static void collect_children(pid_t pid, struct pid_list *l) {
+	char path[64];
+	snprintf(path, sizeof(path), "/proc/%d/task", pid);
+	auto dir = opendir(path);
+	if (!dir) {
+		// The process is gone
+		return;
+	}
+
+	struct dirent *dent;
+	while ((dent = readdir(dir))) {
+		if (!isdigit(dent->d_name[0])) {
+			continue;
+		}
+		snprintf(path, sizeof(path), "/proc/%d/task/%s/children", pid, dent->d_name);
+		auto f = fopen(path, "re");
+		if (!f) {
+			continue;
+		}
+		pid_t cpid;
+		while (fscanf(f, "%d", &cpid) == 1) {
+			if (l->len == l->cap) {
+				l->cap = l->cap ? l->cap * 2 : 16;
+				l->pids = realloc(l->pids, sizeof(pid_t) * l->cap);
+			}
+			l->pids[l->len++] = cpid;
+		}
+		fclose(f);
+	}
+	closedir(dir);
+}
+
+/// How long children in cgroups get to exit after SIGTERM, in seconds
+#define KILL_GRACE_PERIOD 1.0
+
+static void kill_all_descendants(void) {
+	// If every child is in its own cgroup, all the descendants can be found there.
+	// Give them a chance to clean up, then kill whatever is left. SIGKILL goes
+	// through cgroup.kill, so processes forked in the meantime won't escape.
+	// Otherwise, some descendants can only be found by walking the process tree.
+	if (di_spawn_all_in_cgroup() && di_cgroup_kill_all(SIGTERM) >= 0) {
+		if (!di_cgroup_wait_empty(KILL_GRACE_PERIOD)) {
+			di_cgroup_kill_all(SIGKILL);
+		}
+		return;
+	}
+
+	char path[64];
+	snprintf(path, sizeof(path), "/proc/%d/task/%d/children", getpid(), getpid());
+	if (access(path, R_OK) != 0) {
+		kill_all_descendants_by_scan();
+		return;
+	}
+
+	// Walk down the process tree from ourself, breadth first. Only our own
+	// descendants are visited. New processes can be forked while we are doing this,
+	// they won't be killed.
+	struct pid_list l = {0};
+	collect_children(getpid(), &l);
+	for (size_t i = 0; i < l.len; i++) {
+		collect_children(l.pids[i], &l);
+	}
+
+	// Kill them after the walk, so the tree doesn't change under us as processes
+	// die and their children are re-parented to us.
+	for (size_t i = 0; i < l.len; i++) {
+		kill(l.pids[i], SIGTERM);
+	}
+	free(l.pids);
+}
 #endif
 
 void di_dtor(struct deai *di) {
@@ -531,7 +611,9 @@ int main(int argc, char *argv[]) {
 	// after struct deai is freed.
 	int exit_code = 0;
 	bool quit = false;
-	p->loop = EV_DEFAULT;
+	// Not the default loop, otherwise libev would reap our children before the spawn
+	// module has a chance to collect their resource usage.
+	p->loop = ev_loop_new(EVFLAG_AUTO);
 	p->exit_code = &exit_code;
 	p->quit = &quit;
 	p->dtor = (void *)di_dtor;
@@ -539,6 +621,9 @@ int main(int argc, char *argv[]) {
 	// We want to be our own process group leader
 	setpgid(0, 0);
 
+	// Start the launcher before anything big is loaded, so it stays small
+	di_launcher_start();
+
 	// (1) Initialize builtin modules first
 	di_init_event(p);
 	di_init_log(p);
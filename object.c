@@ -383,6 +383,8 @@ static void _di_finalize_object(struct di_object_internal *obj) {
 		auto tmp = obj->dtor;
 		// Never call dtor more than once
 		obj->dtor = NULL;
+		// Whatever the traverse function looks at is about to be freed by the dtor
+		obj->traverse = NULL;
 		tmp((struct di_object *)obj);
 	}
 
@@ -637,6 +639,11 @@ void di_set_object_call(struct di_object *nonnull obj, di_call_fn_t nullable cal
 	internal->call = call;
 }
 
+void di_set_object_traverse(struct di_object *nonnull obj, di_traverse_fn_t nullable traverse) {
+	auto internal = (struct di_object_internal *)obj;
+	internal->traverse = traverse;
+}
+
 bool di_is_object_callable(struct di_object *nonnull obj) {
 	auto internal = (struct di_object_internal *)obj;
 	return internal->call != NULL;
@@ -952,6 +959,10 @@ struct di_object *di_get_roots(void) {
 }
 
 #ifdef TRACK_OBJECTS
+static void di_dump_object_visit(struct di_object *o) {
+	((struct di_object_internal *)o)->excess_ref_count--;
+}
+
 static void di_dump_object(struct di_object_internal *obj) {
 	fprintf(stderr, "%p, ref count: %lu strong %lu weak (live: %d), type: %s\n", obj,
 	        obj->ref_count, obj->weak_ref_count, obj->mark, di_get_type((void *)obj));
@@ -966,6 +977,9 @@ static void di_dump_object(struct di_object_internal *obj) {
 		}
 		fprintf(stderr, "\n");
 	}
+	if (obj->traverse) {
+		obj->traverse((struct di_object *)obj, di_dump_object_visit);
+	}
 	for (struct di_signal *s = obj->signals; s != NULL; s = s->hh.next) {
 		fprintf(stderr, "\tsignal: %.*s, nlisteners: %d\n", (int)s->name.length,
 		        s->name.data, s->nlisteners);
@@ -996,6 +1010,11 @@ void di_dump_objects(void) {
 	}
 }
 
+static void di_mark_and_sweep_dfs(struct di_object_internal *o);
+static void di_mark_and_sweep_visit(struct di_object *o) {
+	di_mark_and_sweep_dfs((struct di_object_internal *)o);
+}
+
 static void di_mark_and_sweep_dfs(struct di_object_internal *o) {
 	if (o->mark != 0) {
 		if (o->mark == 1) {
@@ -1012,6 +1031,9 @@ static void di_mark_and_sweep_dfs(struct di_object_internal *o) {
 		union di_value *val = i->data;
 		di_mark_and_sweep_dfs((struct di_object_internal *)val->object);
 	}
+	if (o->traverse) {
+		o->traverse((struct di_object *)o, di_mark_and_sweep_visit);
+	}
 
 	o->mark = 2;
 }
@@ -1,5 +1,6 @@
 #include <assert.h>
 #include <stdio.h>
+#include <time.h>
 
 #include <deai/builtins/event.h>
 #include <deai/deai.h>
@@ -7,41 +8,187 @@
 #include <dbus/dbus.h>
 
 #include "common.h"
+#include "introspect.h"
 #include "list.h"
 #include "sedes.h"
+#include "uthash.h"
 
 #define DBUS_INTROSPECT_IFACE "org.freedesktop.DBus.Introspectable"
+/// Route keys shorter than this are built on the stack
+#define ROUTE_KEY_BUFFER_SIZE 512
 
+typedef struct dbus_unique_name dbus_unique_name;
+
+/// A well-known name, and the unique name currently owning it
 typedef struct {
+	UT_hash_handle hh;
+	dbus_unique_name *owner;
 	struct list_head sibling;
-	char *well_known;
-	char *unique;
-	char buf[];
+	char well_known[];
 } dbus_bus_name;
 
+/// A unique name, and the well-known names it owns
+struct dbus_unique_name {
+	UT_hash_handle hh;
+	struct list_head well_knowns;
+	char unique[];
+};
+
+/// A signal name on the connection that has listeners. Incoming signals are only
+/// deserialized when they are going to be emitted under one of these names.
+///
+/// Routes are keyed by the sender, path, interface and member of the signal, each
+/// followed by a null byte. The interface is empty for interface-less signal names.
+struct dbus_signal_route {
+	UT_hash_handle hh;
+	struct di_string name;
+	size_t key_len;
+	char key[];
+};
+
+/// A bus name whose owner is being tracked, shared by all the objects of that bus name
+struct dbus_name_watch {
+	UT_hash_handle hh;
+	int refcount;
+	char name[];
+};
+
+/// A method call waiting for the introspection data of its object
+struct dbus_deferred_call {
+	struct list_head sibling;
+	/// The DBusPendingReply object returned to the caller
+	struct di_weak_object *reply;
+	char *interface;
+	char *method;
+	/// When the call times out, in seconds on the monotonic clock. Negative if the call
+	/// uses libdbus' default timeout.
+	double deadline;
+	struct di_tuple args;
+};
+
+/// Introspection data of an object, used to serialize the arguments of method calls to
+/// that object with the right types. Each object is introspected once, the data is
+/// dropped when the owner of its bus name changes.
+///
+/// Keyed by the bus name and the object path, each followed by a null byte.
+struct dbus_introspection {
+	UT_hash_handle hh;
+	/// Whether the Introspect call has returned
+	bool done;
+	/// NULL if the object can't be introspected
+	struct dbus_interface_info *interfaces;
+	/// The in-flight Introspect call, and the listen handle for its reply
+	struct di_object *request, *request_listen_handle;
+	/// Calls made before the Introspect call returns
+	struct list_head deferred_calls;
+	size_t key_len;
+	char key[];
+};
+
+/// The property caches of an object interface, keyed like signal routes, by the bus
+/// name, the path, the interface and an empty member name.
+struct dbus_property_watch {
+	UT_hash_handle hh;
+	struct list_head caches;
+	size_t key_len;
+	char key[];
+};
+
+/// An object path that has deai objects exported on it
+struct dbus_exported_path {
+	UT_hash_handle hh;
+	/// The DBusExport objects on this path, one for each interface
+	struct list_head exports;
+	char path[];
+};
+
 typedef struct {
 	struct di_object;
 	DBusConnection *conn;
-	struct list_head known_names;
+	/// Well-known name -> dbus_bus_name
+	dbus_bus_name *known_names;
+	/// Unique name -> dbus_unique_name
+	dbus_unique_name *unique_names;
+	struct dbus_signal_route *routes;
+	struct dbus_name_watch *name_watches;
+	struct dbus_introspection *introspections;
+	struct dbus_property_watch *property_watches;
+	/// Object path -> dbus_exported_path
+	struct dbus_exported_path *exported_paths;
+	/// Default timeout of method calls in seconds, negative means using libdbus' default
+	double timeout;
 } di_dbus_connection;
 
 typedef struct {
 	struct di_object;
 	char *bus;
 	char *obj;
+	/// Timeout of method calls on this object in seconds, negative means using the
+	/// connection's default
+	double timeout;
 } di_dbus_object;
 
+/// Object type: DBusExport
+///
+/// A deai object exported on the bus, under an object path and an interface. Method
+/// calls on that interface call the methods of the object, and what the methods return
+/// is sent back as the reply. A method returning an error object replies with a D-Bus
+/// error. Calls without an interface go to the first object on the path that has the
+/// method. Members whose names start with "__" can't be called.
+///
+/// The object stays exported until the export is closed, or dropped.
+typedef struct {
+	struct di_object;
+	struct di_object *conn;
+	struct di_object *target;
+	/// NULL once the export is closed
+	struct dbus_exported_path *exported_path;
+	struct list_head sibling;
+	char *path;
+	char *interface;
+} di_dbus_export;
+
+struct dbus_batch;
+
+/// Object type: DBusPendingReply
+///
+/// A method call waiting for its reply. There are no other objects involved in
+/// delivering the reply, libdbus notifies this object directly.
+///
+/// # Signals
+///
+/// * reply(...) the method returned, with the return values as arguments
+/// * error(...) the method call failed
 typedef struct {
 	struct di_object;
+	/// NULL until the call is sent
 	DBusPendingCall *p;
+	/// Keep the dbus connection alive, otherwise we won't get a reply even if the
+	/// pending reply object is kept alive. NULL for raw replies.
+	struct di_object *conn;
+	/// Emit the reply message as is, as the only argument of "reply", instead of
+	/// deserializing it. The listener takes the ownership of the message.
+	bool raw;
+	/// The batch this call is part of, the reply is given to the batch instead of
+	/// being emitted. NULL if the call is not part of a batch.
+	struct dbus_batch *batch;
+	unsigned int batch_index;
 } di_dbus_pending_reply;
 
+static void dbus_batch_reply(struct dbus_batch *b, unsigned int index, DBusMessage *msg);
+static void dbus_unexport(di_dbus_connection *c, di_dbus_export *e);
+
 static void di_dbus_free_pending_reply(struct di_object *_p) {
 	auto p = (di_dbus_pending_reply *)_p;
-	// Cancel the reply so the callback won't be called, as the callback would need
-	// the pending reply object which we are freeing now.
-	dbus_pending_call_cancel(p->p);
-	dbus_pending_call_unref(p->p);
+	if (p->p) {
+		// Cancel the reply so the callback won't be called, as the callback would
+		// need the pending reply object which we are freeing now.
+		dbus_pending_call_cancel(p->p);
+		dbus_pending_call_unref(p->p);
+	}
+	if (p->conn) {
+		di_unref_object(p->conn);
+	}
 }
 
 static void dbus_pending_call_notify_fn(DBusPendingCall *dp, void *ud) {
@@ -52,121 +199,337 @@ static void dbus_pending_call_notify_fn(DBusPendingCall *dp, void *ud) {
 	DI_CHECK(p != NULL);
 
 	auto msg = dbus_pending_call_steal_reply(dp);
-
-	di_emit(p, "reply", (void *)msg);
+	if (p->batch) {
+		dbus_batch_reply(p->batch, p->batch_index, msg);
+	} else if (p->raw) {
+		di_emit(p, "reply", (void *)msg);
+	} else {
+		struct di_tuple t;
+		DBusMessageIter i;
+		dbus_message_iter_init(msg, &i);
+		_dbus_deserialize_struct(&i, &t);
+
+		if (dbus_message_get_type(msg) == DBUS_MESSAGE_TYPE_METHOD_RETURN) {
+			di_emitn(p_obj, di_string_borrow("reply"), t);
+		} else if (dbus_message_get_type(msg) == DBUS_MESSAGE_TYPE_ERROR) {
+			di_emitn(p_obj, di_string_borrow("error"), t);
+		}
+		di_free_tuple(t);
+		dbus_message_unref(msg);
+	}
 
 	// finalize the object since nothing can happen with it any more
 	di_finalize_object(p_obj);
 }
 
-static struct di_object *di_dbus_send(di_dbus_connection *c, DBusMessage *msg) {
-	auto ret = di_new_object_with_type(di_dbus_pending_reply);
-	di_set_type((struct di_object *)ret, "deai.plugin.dbus:DBusPendingReplyRaw");
+/// Current time in seconds on the monotonic clock
+static double dbus_now(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (double)ts.tv_sec + (double)ts.tv_nsec / 1e9;
+}
 
-	bool rc = dbus_connection_send_with_reply(c->conn, msg, &ret->p, -1);
-	if (!rc || !ret->p) {
-		di_unref_object((void *)ret);
-		return NULL;
+/// Convert a timeout in seconds to what libdbus expects
+static int dbus_timeout_ms(double timeout) {
+	if (timeout < 0) {
+		return DBUS_TIMEOUT_USE_DEFAULT;
 	}
+	if (timeout * 1000 >= DBUS_TIMEOUT_INFINITE) {
+		return DBUS_TIMEOUT_INFINITE;
+	}
+	return (int)(timeout * 1000);
+}
 
+static di_dbus_pending_reply *dbus_new_pending_reply(void) {
+	auto ret = di_new_object_with_type(di_dbus_pending_reply);
 	di_set_object_dtor((struct di_object *)ret, di_dbus_free_pending_reply);
+	return ret;
+}
+
+/// Send `msg`, the reply is delivered to `p`
+static bool dbus_pending_reply_send(di_dbus_connection *c, di_dbus_pending_reply *p,
+                                    DBusMessage *msg, double timeout) {
+	if (timeout < 0) {
+		timeout = c->timeout;
+	}
+	bool rc =
+	    dbus_connection_send_with_reply(c->conn, msg, &p->p, dbus_timeout_ms(timeout));
+	if (!rc || !p->p) {
+		return false;
+	}
 
-	dbus_pending_call_set_notify(ret->p, dbus_pending_call_notify_fn,
-	                             di_weakly_ref_object((struct di_object *)ret),
+	dbus_pending_call_set_notify(p->p, dbus_pending_call_notify_fn,
+	                             di_weakly_ref_object((struct di_object *)p),
 	                             (void *)di_drop_weak_ref_rvalue);
+	return true;
+}
+
+/// Send `msg`, returns an object which emits the reply message as is
+static struct di_object *
+di_dbus_send(di_dbus_connection *c, DBusMessage *msg, double timeout) {
+	auto ret = dbus_new_pending_reply();
+	di_set_type((struct di_object *)ret, "deai.plugin.dbus:DBusPendingReplyRaw");
+	ret->raw = true;
+	if (!dbus_pending_reply_send(c, ret, msg, timeout)) {
+		di_unref_object((void *)ret);
+		return NULL;
+	}
 	return (void *)ret;
 }
 
-static void di_dbus_update_name(di_dbus_connection *c, struct di_string wk,
-                                struct di_string unused old, struct di_string unique,
-                                bool force_remove) {
-	dbus_bus_name *i, *ni;
-	if (wk.data[0] == ':') {
+/// Object type: DBusBatch
+///
+/// A group of method calls, which are sent together. The results are delivered all at
+/// once, when every call has finished.
+///
+/// # Signals
+///
+/// * done(results: [any]) all the calls have finished. The result of each call, in the
+///   order they are added, is either an array of the return values, or an error object
+///   if the call failed.
+typedef struct dbus_batch {
+	struct di_object;
+	struct di_object *conn;
+	struct dbus_batch_call {
+		struct di_object *dobj;
+		char *interface;
+		char *method;
+		struct di_tuple args;
+		di_dbus_pending_reply *reply;
+		struct di_variant result;
+	} * calls;
+	unsigned int ncalls;
+	/// Number of calls whose results haven't arrived yet
+	unsigned int nremaining;
+	bool sent;
+} di_dbus_batch;
+
+static void dbus_batch_finish(di_dbus_batch *b) {
+	// The results are moved into the array
+	struct di_array results = {
+	    .length = b->ncalls,
+	    .arr = b->ncalls ? tmalloc(struct di_variant, b->ncalls) : NULL,
+	    .elem_type = DI_TYPE_VARIANT,
+	};
+	struct di_variant *arr = results.arr;
+	for (unsigned int i = 0; i < b->ncalls; i++) {
+		arr[i] = b->calls[i].result;
+		b->calls[i].result = (struct di_variant){NULL, DI_TYPE_NIL};
+	}
+
+	// Listeners could drop the last reference to the batch
+	di_ref_object((struct di_object *)b);
+	di_emit(b, "done", results);
+	di_free_array(results);
+
+	// Nothing more will happen with the batch
+	di_finalize_object((struct di_object *)b);
+	di_unref_object((struct di_object *)b);
+}
+
+static void dbus_batch_set_result(di_dbus_batch *b, unsigned int index, di_type_t type,
+                                  union di_value *value) {
+	DI_CHECK(b->nremaining > 0);
+	b->calls[index].result = (struct di_variant){value, type};
+	if (--b->nremaining == 0) {
+		dbus_batch_finish(b);
+	}
+}
+
+static void dbus_batch_reply(di_dbus_batch *b, unsigned int index, DBusMessage *msg) {
+	auto value = tmalloc(union di_value, 1);
+	di_type_t type;
+	if (dbus_message_get_type(msg) == DBUS_MESSAGE_TYPE_ERROR) {
+		DBusError e;
+		dbus_error_init(&e);
+		dbus_set_error_from_message(&e, msg);
+		value->object = di_new_error("%s: %s", e.name, e.message ? e.message : "");
+		dbus_error_free(&e);
+		type = DI_TYPE_OBJECT;
+	} else {
+		DBusMessageIter i;
+		dbus_message_iter_init(msg, &i);
+		_dbus_deserialize_struct(&i, &value->tuple);
+		type = DI_TYPE_TUPLE;
+	}
+	dbus_message_unref(msg);
+	dbus_batch_set_result(b, index, type, value);
+}
+
+/// A method call failed before it's sent
+static void dbus_pending_reply_fail(di_dbus_pending_reply *p, const char *message) {
+	if (p->batch) {
+		auto value = tmalloc(union di_value, 1);
+		value->object = di_new_error("%s", message);
+		dbus_batch_set_result(p->batch, p->batch_index, DI_TYPE_OBJECT, value);
 		return;
 	}
+	di_emit(p, "error", di_string_borrow(message));
+	di_finalize_object((struct di_object *)p);
+}
 
-	// remove out dated entries
-	// old being empty means this is a new wellknown name, unless force_remove == true
-	if (force_remove || old.length > 0) {
-		list_for_each_entry_safe (i, ni, &c->known_names, sibling) {
-			if (strncmp(wk.data, i->well_known, wk.length) != 0) {
-				continue;
-			}
+/// Record that `unique` now owns `wk`. `unique` being empty means `wk` has no owner.
+static void
+di_dbus_update_name(di_dbus_connection *c, struct di_string wk, struct di_string unique) {
+	if (wk.length == 0 || wk.data[0] == ':') {
+		return;
+	}
 
-			// fprintf(stderr, "remove old %s -> %s\n", wk, i->unique);
-			list_del(&i->sibling);
-			free(i);
+	dbus_bus_name *n = NULL;
+	HASH_FIND(hh, c->known_names, wk.data, wk.length, n);
+	if (n) {
+		auto owner = n->owner;
+		list_del(&n->sibling);
+		if (list_empty(&owner->well_knowns)) {
+			HASH_DEL(c->unique_names, owner);
+			free(owner);
+		}
+		if (unique.length == 0) {
+			HASH_DEL(c->known_names, n);
+			free(n);
+			return;
+		}
+	} else {
+		if (unique.length == 0) {
+			return;
 		}
+		n = malloc(sizeof(dbus_bus_name) + wk.length + 1);
+		memcpy(n->well_known, wk.data, wk.length);
+		n->well_known[wk.length] = '\0';
+		HASH_ADD_KEYPTR(hh, c->known_names, n->well_known, wk.length, n);
 	}
-	if (unique.length != 0) {
-		// fprintf(stderr, "%s -> %s\n", wk, unique);
-		dbus_bus_name *newi =
-		    malloc(sizeof(dbus_bus_name) + wk.length + unique.length + 2);
-		newi->well_known = newi->buf;
-		newi->unique = newi->buf + wk.length + 1;
-		newi->unique[-1] = '\0';
 
-		strncpy(newi->well_known, wk.data, wk.length);
-		strncpy(newi->unique, unique.data, unique.length);
-		newi->unique[unique.length] = '\0';
-		list_add(&newi->sibling, &c->known_names);
+	dbus_unique_name *u = NULL;
+	HASH_FIND(hh, c->unique_names, unique.data, unique.length, u);
+	if (!u) {
+		u = malloc(sizeof(dbus_unique_name) + unique.length + 1);
+		memcpy(u->unique, unique.data, unique.length);
+		u->unique[unique.length] = '\0';
+		INIT_LIST_HEAD(&u->well_knowns);
+		HASH_ADD_KEYPTR(hh, c->unique_names, u->unique, unique.length, u);
 	}
+	n->owner = u;
+	list_add(&n->sibling, &u->well_knowns);
 }
 
-static void di_dbus_update_name_from_msg(struct di_weak_object *weak,
-                                         struct di_string busname, DBusMessage *msg) {
-	if (dbus_message_get_type(msg) != DBUS_MESSAGE_TYPE_METHOD_RETURN) {
-		return;
+static void di_dbus_free_names(di_dbus_connection *c) {
+	dbus_bus_name *n, *nn;
+	HASH_ITER (hh, c->known_names, n, nn) {
+		HASH_DEL(c->known_names, n);
+		free(n);
+	}
+	dbus_unique_name *u, *nu;
+	HASH_ITER (hh, c->unique_names, u, nu) {
+		HASH_DEL(c->unique_names, u);
+		free(u);
 	}
+}
 
-	di_object_with_cleanup conn_obj = di_upgrade_weak_ref(weak);
-	auto conn = (di_dbus_connection *)conn_obj;
-	// the fact we received message must mean the connection is still alive
-	DI_CHECK(conn != NULL);
+static void dbus_free_deferred_call(struct dbus_deferred_call *d) {
+	di_drop_weak_ref(&d->reply);
+	free(d->interface);
+	free(d->method);
+	di_free_tuple(d->args);
+	free(d);
+}
 
-	// Stop listening for GetNameOwner reply
+static void dbus_free_introspection(di_dbus_connection *c, struct dbus_introspection *i) {
+	HASH_DEL(c->introspections, i);
+	if (i->request) {
+		di_unref_object(i->request_listen_handle);
+		di_unref_object(i->request);
+	}
+	struct dbus_deferred_call *d, *nd;
+	list_for_each_entry_safe (d, nd, &i->deferred_calls, sibling) {
+		list_del(&d->sibling);
+		dbus_free_deferred_call(d);
+	}
+	dbus_free_interfaces(&i->interfaces);
+	free(i);
+}
+
+/// Drop the introspection data of the objects on `bus`, they might have changed. Objects
+/// still being introspected are kept, their callers are waiting for them.
+static void dbus_drop_introspections(di_dbus_connection *c, const char *bus) {
+	size_t len = strlen(bus) + 1;
+	struct dbus_introspection *i, *ni;
+	HASH_ITER (hh, c->introspections, i, ni) {
+		if (i->done && i->key_len > len && memcmp(i->key, bus, len) == 0) {
+			dbus_free_introspection(c, i);
+		}
+	}
+}
+
+static void di_dbus_stop_name_owner_request(di_dbus_connection *c, struct di_string busname) {
 	char *buf;
 	asprintf(&buf, "__dbus_watch_%.*s_change_request", (int)busname.length, busname.data);
-	DI_CHECK_OK(di_remove_member_raw((struct di_object *)conn, di_string_borrow(buf)));
+	di_remove_member_raw((struct di_object *)c, di_string_borrow(buf));
 	free(buf);
 
 	asprintf(&buf, "__dbus_watch_%.*s_change_request_listen_handle",
 	         (int)busname.length, busname.data);
-	DI_CHECK_OK(di_remove_member_raw((struct di_object *)conn, di_string_borrow(buf)));
+	di_remove_member_raw((struct di_object *)c, di_string_borrow(buf));
 	free(buf);
+}
 
-	// Update busname
-	DBusError e;
-	dbus_error_init(&e);
+static void di_dbus_update_name_from_msg(struct di_weak_object *weak,
+                                         struct di_string busname, DBusMessage *msg) {
+	di_object_with_cleanup conn_obj = di_upgrade_weak_ref(weak);
+	auto conn = (di_dbus_connection *)conn_obj;
+	// the fact we received message must mean the connection is still alive
+	DI_CHECK(conn != NULL);
+
+	// Stop listening for GetNameOwner reply
+	di_dbus_stop_name_owner_request(conn, busname);
+
+	// Update busname. An error reply means the name has no owner yet.
 	const char *unique;
-	bool ret = dbus_message_get_args(msg, &e, DBUS_TYPE_STRING, &unique, DBUS_TYPE_INVALID);
-	if (!ret) {
-		return;
+	if (dbus_message_get_type(msg) == DBUS_MESSAGE_TYPE_METHOD_RETURN &&
+	    dbus_message_get_args(msg, NULL, DBUS_TYPE_STRING, &unique, DBUS_TYPE_INVALID)) {
+		di_dbus_update_name(conn, busname, di_string_borrow(unique));
 	}
-	di_dbus_update_name(conn, busname, DI_STRING_INIT, di_string_borrow(unique), true);
 	dbus_message_unref(msg);
 }
 
-static void di_dbus_watch_name(di_dbus_connection *c, const char *busname) {
-	// watch for name changes
-	if (!c->conn) {
-		return;
-	}
-
+static char *name_owner_changed_match_rule(const char *busname) {
 	char *match;
 	asprintf(&match,
 	         "type='signal',sender='" DBUS_SERVICE_DBUS "',path='" DBUS_PATH_DBUS
 	         "',interface='" DBUS_INTERFACE_DBUS "',member='NameOwnerChanged',arg0='"
 	         "%s'",
 	         busname);
+	return match;
+}
 
+/// Start tracking the owner of `busname`. Watches are reference counted, so there is
+/// only one match rule, and one owner lookup per bus name.
+static void di_dbus_watch_name(di_dbus_connection *c, const char *busname) {
+	// watch for name changes
+	if (!c->conn) {
+		return;
+	}
+
+	struct dbus_name_watch *w = NULL;
+	HASH_FIND_STR(c->name_watches, busname, w);
+	if (w) {
+		w->refcount++;
+		return;
+	}
+
+	size_t len = strlen(busname);
+	w = malloc(sizeof(*w) + len + 1);
+	w->refcount = 1;
+	memcpy(w->name, busname, len + 1);
+	HASH_ADD_KEYPTR(hh, c->name_watches, w->name, len, w);
+
+	char *match = name_owner_changed_match_rule(busname);
 	dbus_bus_add_match(c->conn, match, NULL);
 	free(match);
 
 	auto msg = dbus_message_new_method_call(DBUS_SERVICE_DBUS, DBUS_PATH_DBUS,
 	                                        DBUS_INTERFACE_DBUS, "GetNameOwner");
 	dbus_message_append_args(msg, DBUS_TYPE_STRING, &busname, DBUS_TYPE_INVALID);
-	auto ret = di_dbus_send(c, msg);
+	auto ret = di_dbus_send(c, msg, -1);
 	DI_CHECK(ret != NULL);
 	dbus_message_unref(msg);
 
@@ -193,134 +556,184 @@ static void di_dbus_unwatch_name(di_dbus_connection *c, const char *busname) {
 		return;
 	}
 
-	char *match;
-	asprintf(&match,
-	         "type='signal',sender='" DBUS_SERVICE_DBUS "',path='" DBUS_PATH_DBUS
-	         "',interface='" DBUS_INTERFACE_DBUS "',member='NameOwnerChanged',arg0='%"
-	         "s'",
-	         busname);
+	struct dbus_name_watch *w = NULL;
+	HASH_FIND_STR(c->name_watches, busname, w);
+	if (!w || --w->refcount > 0) {
+		return;
+	}
+	HASH_DEL(c->name_watches, w);
+	free(w);
 
+	auto busname_str = di_string_borrow(busname);
+	di_dbus_stop_name_owner_request(c, busname_str);
+	dbus_drop_introspections(c, busname);
+	// We won't be told about changes of this name any more
+	di_dbus_update_name(c, busname_str, DI_STRING_INIT);
+
+	char *match = name_owner_changed_match_rule(busname);
 	dbus_bus_remove_match(c->conn, match, NULL);
 	free(match);
 }
 
-#if 0
-static struct di_object *_dbus_introspect(_di_dbus_object *o) {
-	DBusMessage *msg = dbus_message_new_method_call(
-	    o->bus, o->obj, DBUS_INTROSPECT_IFACE, "Introspect");
-	auto ret = di_dbus_send(o->c, msg);
-	dbus_message_unref(msg);
-	return ret;
-}
+/// Send a method call, the reply is emitted from `reply`. If the method is found in the
+/// introspection data of the object, its arguments are serialized with the types from
+/// there, otherwise the types are guessed from the values.
+static int dbus_call_method_send(di_dbus_connection *c, di_dbus_pending_reply *reply,
+                                 const char *bus, const char *path,
+                                 struct dbus_interface_info *interfaces, const char *iface,
+                                 const char *method, double timeout, struct di_tuple args) {
+	const char *signature = NULL;
+	if (interfaces) {
+		const char *found_iface = NULL;
+		auto m = dbus_find_method(interfaces, iface, method, &found_iface);
+		if (m) {
+			signature = m->signature;
+			iface = found_iface;
+		}
+	}
 
-static void _dbus_lookup_member_cb(char *method, bool is_signal,
-                                   struct di_object *cb, void *msg) {
+	DBusMessage *msg = dbus_message_new_method_call(bus, path, iface, method);
 	DBusMessageIter i;
-	dbus_message_iter_init(msg, &i);
-	if (dbus_message_iter_get_arg_type(&i) != DBUS_TYPE_STRING)
-		goto err;
-
-	const char *reply;
-	dbus_message_iter_get_basic(&i, &reply);
-
-	char xmlstack[4096];
-	yxml_t t;
-	yxml_init(&t, xmlstack, sizeof(xmlstack));
-
-	char name[256];
-	char *current_interface = NULL;
-	const char *mtype = is_signal ? "signal" : "method";
-	while (*reply) {
-		auto r = yxml_parse(&t, *reply++);
-		if (r == YXML_OK)
-			continue;
-		if (r < YXML_OK)
-			goto err;
-		switch (r) {
-		case YXML_ATTRVAL:
-			if (strcmp(t.attr, "name") == 0) {
-				yxml_ret_t r2;
-				int nlen = 0;
-				do {
-					int nlen2 = nlen + strlen(t.data);
-					if (nlen2 >= 255)
-						goto err;
-					strcpy(name + nlen, t.data);
-					nlen = nlen2;
-					r2 = yxml_parse(&t, *reply++);
-				} while (r2 != YXML_ATTREND);
-			}
-			//fprintf(stderr, "%s: %s\n", t.elem, name);
-			if (strcmp(t.elem, mtype) == 0) {
-				if (strcmp(name, method) == 0) {
-					di_call_callable(cb, current_interface,
-					                 (struct di_object *)NULL);
-					free(current_interface);
-					dbus_message_unref(msg);
-					return;
-				}
-			} else if (strcmp(t.elem, "interface") == 0) {
-				if (current_interface)
-					goto err;
-				current_interface = strdup(name);
-			}
-			break;
-		case YXML_ELEMEND:
-			if (strcmp(t.elem, "node") == 0 && current_interface) {
-				free(current_interface);
-				current_interface = NULL;
-			}
-			break;
-		default:;
-		}
+	dbus_message_iter_init_append(msg, &i);
+
+	int ret = signature ? _dbus_serialize_struct_typed(&i, args, signature)
+	                    : _dbus_serialize_struct(&i, args);
+	if (ret < 0) {
+		dbus_message_unref(msg);
+		return ret;
 	}
-err:
+
+	bool sent = dbus_pending_reply_send(c, reply, msg, timeout);
 	dbus_message_unref(msg);
-	di_call_callable(cb, (char *)NULL, di_new_error("Can't find method"));
+	return sent ? 0 : -ENOMEM;
 }
 
-static void _dbus_lookup_member(_di_dbus_object *o, const char *method,
-                                bool is_signal, struct di_object *closure) {
-	auto p = _dbus_introspect(o);
+static void dbus_introspect_reply_cb(struct di_weak_object *weak, struct di_string key,
+                                     DBusMessage *msg) {
+	di_object_with_cleanup conn_obj = di_upgrade_weak_ref(weak);
+	auto c = (di_dbus_connection *)conn_obj;
+	DI_CHECK(c != NULL);
+
+	struct dbus_introspection *i = NULL;
+	HASH_FIND(hh, c->introspections, key.data, key.length, i);
+	DI_CHECK(i != NULL);
+
+	const char *xml;
+	if (dbus_message_get_type(msg) == DBUS_MESSAGE_TYPE_METHOD_RETURN &&
+	    dbus_message_get_args(msg, NULL, DBUS_TYPE_STRING, &xml, DBUS_TYPE_INVALID)) {
+		// Malformed data is treated like objects that can't be introspected
+		dbus_parse_introspection(xml, &i->interfaces);
+	}
+	dbus_message_unref(msg);
 
-	auto cl = di_closure(_dbus_lookup_member_cb,
-	                     (method, is_signal, closure), void *);
-	di_listen_to_once(p, "reply", (void *)cl, true);
-	di_unref_object((void *)cl);
-	di_unref_object(p);
+	i->done = true;
+	di_unref_object(i->request_listen_handle);
+	di_unref_object(i->request);
+	i->request = i->request_listen_handle = NULL;
+
+	// Listeners of the replies could make new calls, or drop the introspection data,
+	// so `i` can't be used after a reply is emitted.
+	struct list_head calls;
+	list_replace_init(&i->deferred_calls, &calls);
+	const char *bus = key.data, *path = key.data + strlen(key.data) + 1;
+
+	struct dbus_deferred_call *d, *nd;
+	list_for_each_entry_safe (d, nd, &calls, sibling) {
+		list_del(&d->sibling);
+		HASH_FIND(hh, c->introspections, key.data, key.length, i);
+		di_object_with_cleanup reply = di_upgrade_weak_ref(d->reply);
+		// The time spent waiting for the introspection data counts towards the
+		// timeout of the call
+		double timeout = d->deadline < 0 ? -1 : d->deadline - dbus_now();
+		if (reply != NULL && d->deadline >= 0 && timeout <= 0) {
+			dbus_pending_reply_fail((void *)reply, "Method call timed out");
+		} else if (reply != NULL &&
+		           dbus_call_method_send(c, (void *)reply, bus, path,
+		                                 i ? i->interfaces : NULL, d->interface,
+		                                 d->method, timeout, d->args) < 0) {
+			dbus_pending_reply_fail((void *)reply, "Can't send the method call");
+		}
+		dbus_free_deferred_call(d);
+	}
 }
-#endif
 
-static void dbus_call_method_reply_cb(struct di_weak_object *weak, void *msg) {
-	di_object_with_cleanup sig = di_upgrade_weak_ref(weak);
-	if (sig == NULL) {
-		return;
+/// Find the introspection data of an object, start introspecting it if it's not known,
+/// with `timeout` as the timeout of the Introspect call. Returns NULL if the Introspect
+/// call can't be sent.
+static struct dbus_introspection *
+dbus_get_introspection(di_dbus_connection *c, const char *bus, const char *path,
+                       double timeout) {
+	size_t bus_len = strlen(bus), path_len = strlen(path);
+	size_t key_len = bus_len + path_len + 2;
+	char *key = malloc(key_len);
+	memcpy(key, bus, bus_len + 1);
+	memcpy(key + bus_len + 1, path, path_len + 1);
+
+	struct dbus_introspection *i = NULL;
+	HASH_FIND(hh, c->introspections, key, key_len, i);
+	if (i) {
+		free(key);
+		return i;
 	}
 
-	struct di_tuple t;
-	DBusMessageIter i;
-	dbus_message_iter_init(msg, &i);
-	_dbus_deserialize_struct(&i, &t);
-
-	if (dbus_message_get_type(msg) == DBUS_MESSAGE_TYPE_METHOD_RETURN) {
-		di_emitn(sig, di_string_borrow("reply"), t);
-	} else if (dbus_message_get_type(msg) == DBUS_MESSAGE_TYPE_ERROR) {
-		di_emitn(sig, di_string_borrow("error"), t);
+	auto msg = dbus_message_new_method_call(bus, path, DBUS_INTROSPECT_IFACE, "Introspect");
+	auto request = di_dbus_send(c, msg, timeout);
+	dbus_message_unref(msg);
+	if (request == NULL) {
+		free(key);
+		return NULL;
 	}
 
-	di_free_tuple(t);
-	dbus_message_unref(msg);
+	i = calloc(1, sizeof(*i) + key_len);
+	memcpy(i->key, key, key_len);
+	i->key_len = key_len;
+	INIT_LIST_HEAD(&i->deferred_calls);
+	HASH_ADD_KEYPTR(hh, c->introspections, i->key, key_len, i);
+
+	di_weak_object_with_cleanup weak = di_weakly_ref_object((struct di_object *)c);
+	di_closure_with_cleanup cl = di_closure(
+	    dbus_introspect_reply_cb, (weak, ((struct di_string){key, key_len})), void *);
+	i->request = request;
+	i->request_listen_handle =
+	    di_listen_to(request, di_string_borrow("reply"), (struct di_object *)cl);
+	free(key);
+	return i;
+}
+
+/// Call a method of `dobj`, the reply is delivered to `reply`
+static int dbus_call_method_start(di_dbus_connection *c, di_dbus_object *dobj,
+                                  di_dbus_pending_reply *reply, const char *iface,
+                                  const char *method, double timeout, struct di_tuple args) {
+	if (timeout < 0) {
+		timeout = dobj->timeout;
+	}
+	if (timeout < 0) {
+		timeout = c->timeout;
+	}
 
-	// Stop the listener
-	di_remove_member_raw(sig, di_string_borrow("___original_object"));
-	di_remove_member_raw(sig, di_string_borrow("___original_object_listen_handle"));
+	struct dbus_introspection *intro = NULL;
+	if (!iface || strcmp(iface, DBUS_INTROSPECT_IFACE) != 0) {
+		intro = dbus_get_introspection(c, dobj->bus, dobj->obj, timeout);
+	}
+	if (intro && !intro->done) {
+		// Wait for the introspection data
+		auto d = tmalloc(struct dbus_deferred_call, 1);
+		d->reply = di_weakly_ref_object((struct di_object *)reply);
+		d->interface = iface ? strdup(iface) : NULL;
+		d->method = strdup(method);
+		d->deadline = timeout < 0 ? -1 : dbus_now() + timeout;
+		di_copy_value(DI_TYPE_TUPLE, &d->args, &args);
+		list_add_tail(&d->sibling, &intro->deferred_calls);
+		return 0;
+	}
 
-	// Drop the dbus connection
-	di_remove_member_raw(sig, di_string_borrow("___deai_dbus_connection"));
+	return dbus_call_method_send(c, reply, dobj->bus, dobj->obj,
+	                             intro ? intro->interfaces : NULL, iface, method,
+	                             timeout, args);
 }
 
 static struct di_object *
-dbus_call_method(const char *iface, const char *method, struct di_tuple t) {
+dbus_call_method(const char *iface, const char *method, double timeout, struct di_tuple t) {
 	// The first argument is the dbus object
 	if (t.length == 0 || t.elements[0].type != DI_TYPE_OBJECT) {
 		return di_new_error("first argument to dbus method call is not a dbus "
@@ -342,30 +755,18 @@ dbus_call_method(const char *iface, const char *method, struct di_tuple t) {
 		return NULL;
 	}
 
-	DBusMessage *msg = dbus_message_new_method_call(dobj->bus, dobj->obj, iface, method);
-	DBusMessageIter i;
-	dbus_message_iter_init_append(msg, &i);
+	auto ret = dbus_new_pending_reply();
+	di_set_type((struct di_object *)ret, "deai.plugin.dbus:DBusPendingReply");
+	ret->conn = di_ref_object(conn);
 
-	if (_dbus_serialize_struct(&i, shifted_args) < 0) {
-		return di_new_error("Can't serialize arguments");
+	int rc = dbus_call_method_start((di_dbus_connection *)conn, dobj, ret, iface, method,
+	                                timeout, shifted_args);
+	if (rc < 0) {
+		di_unref_object((void *)ret);
+		return di_new_error(rc == -ENOMEM ? "Failed to send message"
+		                                  : "Can't serialize arguments");
 	}
-
-	auto ret = di_new_object_with_type(struct di_object);
-	di_set_type(ret, "deai.plugin.dbus:DBusPendingReply");
-
-	auto p = di_dbus_send((di_dbus_connection *)conn, msg);
-	di_weak_object_with_cleanup weak = di_weakly_ref_object(ret);
-	di_closure_with_cleanup cl = di_closure(dbus_call_method_reply_cb, (weak), void *);
-	auto listen_handle = di_listen_to(p, di_string_borrow("reply"), (void *)cl);
-	dbus_message_unref(msg);
-
-	di_member(ret, "___original_object", p);
-	di_member(ret, "___original_object_listen_handle", listen_handle);
-
-	// Keep the dbus connection alive, otherwise we won't get a reply even if the
-	// pending reply object is kept alive
-	di_member_clone(ret, "___deai_dbus_connection", conn);
-	return ret;
+	return (void *)ret;
 }
 
 static void di_free_dbus_object(struct di_object *o) {
@@ -383,6 +784,9 @@ typedef struct {
 	struct di_object;
 	char *method;
 	char *interface;
+	/// Timeout of calls of this method in seconds, negative means using the object's
+	/// default
+	double timeout;
 } di_dbus_method;
 
 static void di_dbus_free_method(struct di_object *o) {
@@ -395,32 +799,55 @@ static int
 call_dbus_method(struct di_object *m, di_type_t *rt, union di_value *ret, struct di_tuple t) {
 	auto dbus_method = (di_dbus_method *)m;
 	*rt = DI_TYPE_OBJECT;
-	ret->object = dbus_call_method(dbus_method->interface, dbus_method->method, t);
+	ret->object = dbus_call_method(dbus_method->interface, dbus_method->method,
+	                               dbus_method->timeout, t);
 	return 0;
 }
 
-static struct di_object *di_dbus_object_getter(di_dbus_object *dobj, struct di_string method) {
-	const char *dot = memrchr(method.data, '.', method.length);
-	char *ifc, *m;
+static double di_dbus_method_get_timeout(di_dbus_method *m) {
+	return m->timeout;
+}
+
+static void di_dbus_method_set_timeout(di_dbus_method *m, double timeout) {
+	m->timeout = timeout;
+}
+
+/// Split "interface.Method" into the interface and the method name. The interface is
+/// NULL if `name` doesn't have one. Returns an error object if `name` is invalid.
+static struct di_object *
+dbus_split_method_name(struct di_string name, char **interface, char **method) {
+	const char *dot = memrchr(name.data, '.', name.length);
 	if (dot) {
-		const char *dot2 = memchr(method.data, '.', method.length);
-		if (dot == method.data || !*(dot + 1)) {
+		const char *dot2 = memchr(name.data, '.', name.length);
+		if (dot == name.data || dot + 1 == name.data + name.length) {
 			return di_new_error("Method name or interface name is empty");
 		}
 		if (dot2 == dot) {
 			return di_new_error("Invalid interface name");
 		}
-		ifc = strndup(method.data, dot - method.data);
-		m = strndup(dot + 1, method.length - (dot + 1 - method.data));
+		*interface = strndup(name.data, dot - name.data);
+		*method = strndup(dot + 1, name.length - (dot + 1 - name.data));
 	} else {
-		ifc = NULL;
-		m = di_string_to_chars_alloc(method);
+		*interface = NULL;
+		*method = di_string_to_chars_alloc(name);
+	}
+	return NULL;
+}
+
+static struct di_object *di_dbus_object_getter(di_dbus_object *dobj, struct di_string method) {
+	char *ifc, *m;
+	auto err = dbus_split_method_name(method, &ifc, &m);
+	if (err) {
+		return err;
 	}
 
 	auto ret = di_new_object_with_type(di_dbus_method);
 	di_set_type((struct di_object *)ret, "deai.plugin.dbus:DBusMethod");
 	ret->method = m;
 	ret->interface = ifc;
+	ret->timeout = -1;
+	di_getter(ret, timeout, di_dbus_method_get_timeout);
+	di_setter(ret, timeout, di_dbus_method_set_timeout, double);
 
 	di_set_object_dtor((void *)ret, di_dbus_free_method);
 	di_set_object_call((void *)ret, call_dbus_method);
@@ -438,6 +865,375 @@ static void di_dbus_object_new_signal(di_dbus_object *dobj, struct di_string nam
 	free(srcsig);
 }
 
+static double di_dbus_object_get_timeout(di_dbus_object *dobj) {
+	return dobj->timeout;
+}
+
+static void di_dbus_object_set_timeout(di_dbus_object *dobj, double timeout) {
+	dobj->timeout = timeout;
+}
+
+/// Write the route key for a signal into `buf`, if it fits. Returns the length of the
+/// key.
+static size_t route_key(char *buf, size_t cap, struct di_string bus, struct di_string path,
+                        struct di_string interface, struct di_string member) {
+	const struct di_string parts[] = {bus, path, interface, member};
+	size_t len = 0;
+	for (size_t i = 0; i < ARRAY_SIZE(parts); i++) {
+		if (len + parts[i].length + 1 <= cap) {
+			memcpy(buf + len, parts[i].data, parts[i].length);
+			buf[len + parts[i].length] = '\0';
+		}
+		len += parts[i].length + 1;
+	}
+	return len;
+}
+
+/// Object type: DBusPropertyCache
+///
+/// The properties of an interface of a D-Bus object. All the properties are fetched
+/// once, then kept up to date with the PropertiesChanged signal. Properties are members
+/// of this object, reading them doesn't involve the bus.
+///
+/// # Signals
+///
+/// * <name>-changed(value) the property `name` has a new value, this includes the first
+///   time it's fetched
+/// * ready() the properties have been fetched for the first time
+/// * error(message: string) the properties can't be fetched
+typedef struct {
+	struct di_object;
+	struct di_object *conn;
+	/// NULL once the connection is closed
+	struct dbus_property_watch *watch;
+	struct list_head sibling;
+	char *bus;
+	char *path;
+	char *interface;
+	/// The in-flight GetAll call, and the listen handle for its reply
+	struct di_object *request, *request_listen_handle;
+	/// In-flight Get calls for properties that are invalidated
+	struct list_head gets;
+} di_dbus_property_cache;
+
+struct dbus_property_get {
+	struct list_head sibling;
+	struct di_object *request, *request_listen_handle;
+	char name[];
+};
+
+static char *properties_changed_match_rule(const char *bus, const char *path,
+                                           const char *interface) {
+	char *match;
+	asprintf(&match,
+	         "type='signal',sender='%s',path='%s',interface='" DBUS_INTERFACE_PROPERTIES
+	         "',member='PropertiesChanged',arg0='%s'",
+	         bus, path, interface);
+	return match;
+}
+
+/// Store the new value of a property, and tell the listeners. Takes the ownership of
+/// `value`.
+static void dbus_property_cache_set(di_dbus_property_cache *pc, struct di_string name,
+                                    struct di_variant value) {
+	di_remove_member_raw((struct di_object *)pc, name);
+	if (value.type != DI_TYPE_NIL) {
+		di_add_member_clone((struct di_object *)pc, name, value.type, value.value);
+	}
+
+	char *signal;
+	asprintf(&signal, "%.*s-changed", (int)name.length, name.data);
+	di_emitn((struct di_object *)pc, di_string_borrow(signal), (struct di_tuple){1, &value});
+	free(signal);
+	di_free_value(DI_TYPE_VARIANT, (union di_value *)&value);
+}
+
+/// Update the properties from an a{sv} dict `i` points to
+static void dbus_property_cache_set_all(di_dbus_property_cache *pc, DBusMessageIter *i) {
+	if (dbus_message_iter_get_arg_type(i) != DBUS_TYPE_ARRAY) {
+		return;
+	}
+	DBusMessageIter entries;
+	dbus_message_iter_recurse(i, &entries);
+	while (dbus_message_iter_get_arg_type(&entries) == DBUS_TYPE_DICT_ENTRY) {
+		DBusMessageIter entry;
+		dbus_message_iter_recurse(&entries, &entry);
+		if (dbus_message_iter_get_arg_type(&entry) == DBUS_TYPE_STRING) {
+			const char *name;
+			dbus_message_iter_get_basic(&entry, &name);
+			dbus_message_iter_next(&entry);
+
+			struct di_variant value;
+			_dbus_deserialize_value(&entry, &value);
+			dbus_property_cache_set(pc, di_string_borrow(name), value);
+		}
+		dbus_message_iter_next(&entries);
+	}
+}
+
+static void dbus_property_get_reply_cb(struct di_weak_object *weak, void *ptr,
+                                       DBusMessage *msg) {
+	di_object_with_cleanup pc_obj = di_upgrade_weak_ref(weak);
+	auto pc = (di_dbus_property_cache *)pc_obj;
+	DI_CHECK(pc != NULL);
+
+	struct dbus_property_get *g = ptr;
+	list_del(&g->sibling);
+	di_unref_object(g->request_listen_handle);
+	di_unref_object(g->request);
+
+	DBusMessageIter i;
+	if (dbus_message_get_type(msg) == DBUS_MESSAGE_TYPE_METHOD_RETURN &&
+	    dbus_message_iter_init(msg, &i)) {
+		struct di_variant value;
+		_dbus_deserialize_value(&i, &value);
+		dbus_property_cache_set(pc, di_string_borrow(g->name), value);
+	}
+	dbus_message_unref(msg);
+	free(g);
+}
+
+/// Fetch the value of a property that has been invalidated
+static void dbus_property_cache_get(di_dbus_property_cache *pc, const char *name) {
+	auto msg = dbus_message_new_method_call(pc->bus, pc->path, DBUS_INTERFACE_PROPERTIES,
+	                                        "Get");
+	dbus_message_append_args(msg, DBUS_TYPE_STRING, &pc->interface, DBUS_TYPE_STRING,
+	                         &name, DBUS_TYPE_INVALID);
+	auto request = di_dbus_send((di_dbus_connection *)pc->conn, msg, -1);
+	dbus_message_unref(msg);
+	if (request == NULL) {
+		return;
+	}
+
+	size_t len = strlen(name);
+	struct dbus_property_get *g = malloc(sizeof(*g) + len + 1);
+	memcpy(g->name, name, len + 1);
+	g->request = request;
+
+	di_weak_object_with_cleanup weak = di_weakly_ref_object((struct di_object *)pc);
+	di_closure_with_cleanup cl =
+	    di_closure(dbus_property_get_reply_cb, (weak, (void *)g), void *);
+	g->request_listen_handle =
+	    di_listen_to(request, di_string_borrow("reply"), (struct di_object *)cl);
+	list_add_tail(&g->sibling, &pc->gets);
+}
+
+/// Apply a PropertiesChanged signal
+static void dbus_property_cache_changed(di_dbus_property_cache *pc, DBusMessage *msg) {
+	DBusMessageIter i;
+	// The first argument is the interface, it's been checked already
+	if (!dbus_message_iter_init(msg, &i) || !dbus_message_iter_next(&i)) {
+		return;
+	}
+	dbus_property_cache_set_all(pc, &i);
+
+	// Invalidated properties, their values have to be fetched
+	if (!dbus_message_iter_next(&i) ||
+	    dbus_message_iter_get_arg_type(&i) != DBUS_TYPE_ARRAY) {
+		return;
+	}
+	DBusMessageIter names;
+	dbus_message_iter_recurse(&i, &names);
+	while (dbus_message_iter_get_arg_type(&names) == DBUS_TYPE_STRING) {
+		const char *name;
+		dbus_message_iter_get_basic(&names, &name);
+		dbus_property_cache_get(pc, name);
+		dbus_message_iter_next(&names);
+	}
+}
+
+/// Collect the property caches of the object interface that sent the signal
+static void
+dbus_collect_property_caches(di_dbus_connection *c, struct di_string bus, struct di_string path,
+                             struct di_string interface, di_dbus_property_cache ***caches,
+                             size_t *ncaches) {
+	char buf[ROUTE_KEY_BUFFER_SIZE];
+	size_t key_len = route_key(buf, sizeof(buf), bus, path, interface, DI_STRING_INIT);
+	char *key = key_len <= sizeof(buf) ? buf : malloc(key_len);
+	route_key(key, key_len, bus, path, interface, DI_STRING_INIT);
+
+	struct dbus_property_watch *w = NULL;
+	HASH_FIND(hh, c->property_watches, key, key_len, w);
+	if (key != buf) {
+		free(key);
+	}
+	if (!w) {
+		return;
+	}
+
+	di_dbus_property_cache *pc;
+	list_for_each_entry (pc, &w->caches, sibling) {
+		*caches = realloc(*caches, sizeof(**caches) * (*ncaches + 1));
+		(*caches)[(*ncaches)++] = (void *)di_ref_object((struct di_object *)pc);
+	}
+}
+
+/// Update the property caches with a PropertiesChanged signal
+static void dbus_update_property_caches(di_dbus_connection *c, DBusMessage *msg,
+                                        const char *bus, const char *path) {
+	DBusMessageIter i;
+	if (!dbus_message_iter_init(msg, &i) ||
+	    dbus_message_iter_get_arg_type(&i) != DBUS_TYPE_STRING) {
+		return;
+	}
+	const char *interface;
+	dbus_message_iter_get_basic(&i, &interface);
+
+	// Listeners could drop any of the caches, so collect them first
+	di_dbus_property_cache **caches = NULL;
+	size_t ncaches = 0;
+	auto path_str = di_string_borrow(path);
+	auto interface_str = di_string_borrow(interface);
+	dbus_collect_property_caches(c, di_string_borrow(bus), path_str, interface_str,
+	                             &caches, &ncaches);
+	if (*bus == ':') {
+		dbus_unique_name *u = NULL;
+		HASH_FIND_STR(c->unique_names, bus, u);
+		if (u) {
+			dbus_bus_name *n;
+			list_for_each_entry (n, &u->well_knowns, sibling) {
+				dbus_collect_property_caches(c, di_string_borrow(n->well_known),
+				                             path_str, interface_str, &caches,
+				                             &ncaches);
+			}
+		}
+	}
+
+	for (size_t x = 0; x < ncaches; x++) {
+		dbus_property_cache_changed(caches[x], msg);
+		di_unref_object((struct di_object *)caches[x]);
+	}
+	free(caches);
+}
+
+static void dbus_property_cache_get_all_reply_cb(struct di_weak_object *weak,
+                                                 DBusMessage *msg) {
+	di_object_with_cleanup pc_obj = di_upgrade_weak_ref(weak);
+	auto pc = (di_dbus_property_cache *)pc_obj;
+	DI_CHECK(pc != NULL);
+
+	di_unref_object(pc->request_listen_handle);
+	di_unref_object(pc->request);
+	pc->request = pc->request_listen_handle = NULL;
+
+	if (dbus_message_get_type(msg) == DBUS_MESSAGE_TYPE_ERROR) {
+		DBusError e;
+		dbus_error_init(&e);
+		dbus_set_error_from_message(&e, msg);
+		char *message;
+		asprintf(&message, "%s: %s", e.name, e.message ? e.message : "");
+		di_emit(pc, "error", di_string_borrow(message));
+		free(message);
+		dbus_error_free(&e);
+	} else {
+		DBusMessageIter i;
+		if (dbus_message_iter_init(msg, &i)) {
+			dbus_property_cache_set_all(pc, &i);
+		}
+		di_emit(pc, "ready");
+	}
+	dbus_message_unref(msg);
+}
+
+static void di_dbus_free_property_cache(struct di_object *o) {
+	auto pc = (di_dbus_property_cache *)o;
+	auto c = (di_dbus_connection *)pc->conn;
+	if (pc->watch) {
+		list_del(&pc->sibling);
+		if (list_empty(&pc->watch->caches)) {
+			auto match = properties_changed_match_rule(pc->bus, pc->path, pc->interface);
+			dbus_bus_remove_match(c->conn, match, NULL);
+			free(match);
+			HASH_DEL(c->property_watches, pc->watch);
+			free(pc->watch);
+		}
+	}
+	di_dbus_unwatch_name(c, pc->bus);
+
+	if (pc->request) {
+		di_unref_object(pc->request_listen_handle);
+		di_unref_object(pc->request);
+	}
+	struct dbus_property_get *g, *ng;
+	list_for_each_entry_safe (g, ng, &pc->gets, sibling) {
+		di_unref_object(g->request_listen_handle);
+		di_unref_object(g->request);
+		free(g);
+	}
+
+	free(pc->bus);
+	free(pc->path);
+	free(pc->interface);
+	di_unref_object(pc->conn);
+}
+
+static struct di_object *
+di_dbus_object_properties(di_dbus_object *dobj, struct di_string interface) {
+	if (interface.length == 0) {
+		return di_new_error("Interface name can't be empty");
+	}
+
+	struct di_object *conn = NULL;
+	DI_CHECK_OK(di_get(dobj, "___deai_dbus_connection", conn));
+	auto c = (di_dbus_connection *)conn;
+	if (!c->conn) {
+		di_unref_object(conn);
+		return di_new_error("The connection is closed");
+	}
+
+	auto pc = di_new_object_with_type(di_dbus_property_cache);
+	di_set_type((struct di_object *)pc, "deai.plugin.dbus:DBusPropertyCache");
+	pc->conn = conn;
+	pc->bus = strdup(dobj->bus);
+	pc->path = strdup(dobj->obj);
+	pc->interface = di_string_to_chars_alloc(interface);
+	INIT_LIST_HEAD(&pc->gets);
+	di_dbus_watch_name(c, pc->bus);
+
+	// Start listening for changes before fetching the properties, so no change is
+	// missed
+	size_t key_len = route_key(NULL, 0, di_string_borrow(pc->bus),
+	                           di_string_borrow(pc->path), interface, DI_STRING_INIT);
+	struct dbus_property_watch *w = NULL;
+	char *key = malloc(key_len);
+	route_key(key, key_len, di_string_borrow(pc->bus), di_string_borrow(pc->path),
+	          interface, DI_STRING_INIT);
+	HASH_FIND(hh, c->property_watches, key, key_len, w);
+	if (!w) {
+		w = malloc(sizeof(*w) + key_len);
+		memcpy(w->key, key, key_len);
+		w->key_len = key_len;
+		INIT_LIST_HEAD(&w->caches);
+		HASH_ADD_KEYPTR(hh, c->property_watches, w->key, key_len, w);
+
+		auto match = properties_changed_match_rule(pc->bus, pc->path, pc->interface);
+		dbus_bus_add_match(c->conn, match, NULL);
+		free(match);
+	}
+	free(key);
+	list_add_tail(&pc->sibling, &w->caches);
+	pc->watch = w;
+	di_set_object_dtor((struct di_object *)pc, di_dbus_free_property_cache);
+
+	auto msg = dbus_message_new_method_call(pc->bus, pc->path, DBUS_INTERFACE_PROPERTIES,
+	                                        "GetAll");
+	dbus_message_append_args(msg, DBUS_TYPE_STRING, &pc->interface, DBUS_TYPE_INVALID);
+	auto request = di_dbus_send(c, msg, -1);
+	dbus_message_unref(msg);
+	if (request == NULL) {
+		di_unref_object((struct di_object *)pc);
+		return di_new_error("Failed to send message");
+	}
+
+	di_weak_object_with_cleanup weak = di_weakly_ref_object((struct di_object *)pc);
+	di_closure_with_cleanup cl =
+	    di_closure(dbus_property_cache_get_all_reply_cb, (weak), void *);
+	pc->request = request;
+	pc->request_listen_handle =
+	    di_listen_to(request, di_string_borrow("reply"), (struct di_object *)cl);
+	return (void *)pc;
+}
+
 static struct di_object *
 di_dbus_get_object(struct di_object *o, struct di_string bus, struct di_string obj) {
 	di_dbus_connection *oc = (void *)o;
@@ -448,15 +1244,140 @@ di_dbus_get_object(struct di_object *o, struct di_string bus, struct di_string o
 
 	ret->bus = di_string_to_chars_alloc(bus);
 	ret->obj = di_string_to_chars_alloc(obj);
+	ret->timeout = -1;
 	di_dbus_watch_name(oc, ret->bus);
+	di_getter(ret, timeout, di_dbus_object_get_timeout);
+	di_setter(ret, timeout, di_dbus_object_set_timeout, double);
 	di_method(ret, "put", di_finalize_object);
 	di_method(ret, "__get", di_dbus_object_getter, struct di_string);
 	di_method(ret, "__new_signal", di_dbus_object_new_signal, struct di_string);
+	di_method(ret, "properties", di_dbus_object_properties, struct di_string);
 
 	di_set_object_dtor((void *)ret, di_free_dbus_object);
 	return (void *)ret;
 }
 
+static void di_dbus_free_batch(struct di_object *o) {
+	auto b = (di_dbus_batch *)o;
+	for (unsigned int i = 0; i < b->ncalls; i++) {
+		auto call = &b->calls[i];
+		if (call->reply) {
+			call->reply->batch = NULL;
+			di_unref_object((struct di_object *)call->reply);
+		}
+		di_unref_object(call->dobj);
+		free(call->interface);
+		free(call->method);
+		di_free_tuple(call->args);
+		if (call->result.value) {
+			di_free_value(DI_TYPE_VARIANT, (union di_value *)&call->result);
+		}
+	}
+	free(b->calls);
+	di_unref_object(b->conn);
+}
+
+/// Queue a method call, the arguments are: the batch, the DBusObject, the name of the
+/// method, optionally with the interface, then the arguments of the method.
+static int
+di_dbus_batch_add(struct di_object *m, di_type_t *rt, union di_value *ret, struct di_tuple t) {
+	*rt = DI_TYPE_NIL;
+	if (t.length < 3 || t.elements[0].type != DI_TYPE_OBJECT ||
+	    !di_check_type(t.elements[0].value->object, "deai.plugin.dbus:DBusBatch") ||
+	    t.elements[1].type != DI_TYPE_OBJECT ||
+	    !di_check_type(t.elements[1].value->object, "deai.plugin.dbus:DBusObject")) {
+		*rt = DI_TYPE_OBJECT;
+		ret->object = di_new_error("Expecting a DBusObject and a method name");
+		return 0;
+	}
+
+	auto b = (di_dbus_batch *)t.elements[0].value->object;
+	struct di_string name;
+	if (t.elements[2].type == DI_TYPE_STRING) {
+		name = t.elements[2].value->string;
+	} else if (t.elements[2].type == DI_TYPE_STRING_LITERAL) {
+		name = di_string_borrow(t.elements[2].value->string_literal);
+	} else {
+		*rt = DI_TYPE_OBJECT;
+		ret->object = di_new_error("Method name is not a string");
+		return 0;
+	}
+	if (b->sent) {
+		*rt = DI_TYPE_OBJECT;
+		ret->object = di_new_error("The batch has already been sent");
+		return 0;
+	}
+
+	char *ifc, *method;
+	auto err = dbus_split_method_name(name, &ifc, &method);
+	if (err) {
+		*rt = DI_TYPE_OBJECT;
+		ret->object = err;
+		return 0;
+	}
+
+	b->calls = realloc(b->calls, sizeof(*b->calls) * (b->ncalls + 1));
+	auto call = &b->calls[b->ncalls++];
+	*call = (struct dbus_batch_call){
+	    .dobj = di_ref_object(t.elements[1].value->object),
+	    .interface = ifc,
+	    .method = method,
+	    .result = {NULL, DI_TYPE_NIL},
+	};
+	struct di_tuple args = {.length = t.length - 3, .elements = t.elements + 3};
+	di_copy_value(DI_TYPE_TUPLE, &call->args, &args);
+	return 0;
+}
+
+/// Send all the queued calls back-to-back, their replies are waited for together
+static void di_dbus_batch_send(di_dbus_batch *b) {
+	if (b->sent) {
+		return;
+	}
+	b->sent = true;
+	b->nremaining = b->ncalls;
+	if (b->ncalls == 0) {
+		dbus_batch_finish(b);
+		return;
+	}
+
+	// Failed calls are finished immediately, the batch could be finished before we
+	// return.
+	di_ref_object((struct di_object *)b);
+	unsigned int ncalls = b->ncalls;
+	for (unsigned int i = 0; i < ncalls; i++) {
+		auto call = &b->calls[i];
+		auto reply = dbus_new_pending_reply();
+		di_set_type((struct di_object *)reply, "deai.plugin.dbus:DBusPendingReply");
+		reply->batch = b;
+		reply->batch_index = i;
+		call->reply = reply;
+
+		auto dobj = (di_dbus_object *)call->dobj;
+		int rc = dbus_call_method_start((di_dbus_connection *)b->conn, dobj, reply,
+		                                call->interface, call->method, -1, call->args);
+		if (rc < 0) {
+			dbus_pending_reply_fail(reply, rc == -ENOMEM ? "Failed to send message"
+			                                             : "Can't serialize arguments");
+		}
+	}
+	di_unref_object((struct di_object *)b);
+}
+
+static struct di_object *di_dbus_new_batch(di_dbus_connection *c) {
+	auto ret = di_new_object_with_type(di_dbus_batch);
+	di_set_type((struct di_object *)ret, "deai.plugin.dbus:DBusBatch");
+	ret->conn = di_ref_object((struct di_object *)c);
+
+	auto add = di_new_object_with_type(struct di_object);
+	di_set_object_call(add, di_dbus_batch_add);
+	di_member(ret, "add", add);
+	di_method(ret, "send", di_dbus_batch_send);
+
+	di_set_object_dtor((struct di_object *)ret, di_dbus_free_batch);
+	return (void *)ret;
+}
+
 static void ioev_callback(void *conn, void *ptr, int event) {
 	if (event & IOEV_READ) {
 		dbus_watch_handle(ptr, DBUS_WATCH_READABLE);
@@ -505,16 +1426,50 @@ static void di_dbus_shutdown(di_dbus_connection *conn) {
 	// cannot keep the handle inside `conn`.
 	di_callr(roots, "__add_anonymous", *root_handle_storage, listen_handle);
 
+	struct dbus_exported_path *p, *np;
+	HASH_ITER (hh, conn->exported_paths, p, np) {
+		di_dbus_export *e, *ne;
+		list_for_each_entry_safe (e, ne, &p->exports, sibling) {
+			dbus_unexport(conn, e);
+		}
+	}
+
 	// Clear the watch functions so they won't get called. They need the connection
 	// object which we are freeing now. And we don't need to be notified about watch
 	// removal, as we will destroy the ioev objects with the connection objects.
 	dbus_connection_set_watch_functions(conn->conn, NULL, NULL, NULL, NULL, NULL);
+	dbus_connection_set_timeout_functions(conn->conn, NULL, NULL, NULL, NULL, NULL);
 	conn->conn = NULL;
 
-	dbus_bus_name *i, *ni;
-	list_for_each_entry_safe (i, ni, &conn->known_names, sibling) {
-		list_del(&i->sibling);
-		free(i);
+	di_dbus_free_names(conn);
+
+	struct dbus_name_watch *w, *nw;
+	HASH_ITER (hh, conn->name_watches, w, nw) {
+		HASH_DEL(conn->name_watches, w);
+		free(w);
+	}
+
+	struct dbus_introspection *i, *ni;
+	HASH_ITER (hh, conn->introspections, i, ni) {
+		dbus_free_introspection(conn, i);
+	}
+
+	struct dbus_property_watch *pw, *npw;
+	HASH_ITER (hh, conn->property_watches, pw, npw) {
+		di_dbus_property_cache *pc, *npc;
+		list_for_each_entry_safe (pc, npc, &pw->caches, sibling) {
+			list_del(&pc->sibling);
+			pc->watch = NULL;
+		}
+		HASH_DEL(conn->property_watches, pw);
+		free(pw);
+	}
+
+	struct dbus_signal_route *r, *nr;
+	HASH_ITER (hh, conn->routes, r, nr) {
+		HASH_DEL(conn->routes, r);
+		di_free_string(r->name);
+		free(r);
 	}
 }
 
@@ -596,44 +1551,139 @@ static void dbus_toggle_watch(DBusWatch *w, void *ud) {
 	di_call(ioev, "toggle");
 }
 
+static void dbus_timeout_callback(struct di_weak_object *weak, void *ptr, double now) {
+	di_object_with_cleanup conn_obj = di_upgrade_weak_ref(weak);
+	auto oc = (di_dbus_connection *)conn_obj;
+	if (oc == NULL || oc->conn == NULL) {
+		return;
+	}
+
+	DBusTimeout *t = ptr;
+	dbus_timeout_handle(t);
+
+	// libdbus timeouts fire repeatedly until they are removed or disabled, and the
+	// timer has to be restarted if the timeout is still there
+	with_cleanup_t(char) timer_name;
+	di_object_with_cleanup timer = NULL;
+	asprintf(&timer_name, "__dbus_timer_for_timeout_%p", t);
+	if (di_get(oc, timer_name, timer) == 0) {
+		di_call(timer, "again");
+	}
+
+	// A timed out pending call has its error reply queued
+	while (dbus_connection_dispatch(oc->conn) != DBUS_DISPATCH_COMPLETE) {}
+}
+
+static bool dbus_start_timeout(di_dbus_connection *oc, DBusTimeout *t) {
+	if (!dbus_timeout_get_enabled(t)) {
+		return true;
+	}
+
+	di_object_with_cleanup eventm = NULL;
+	di_object_with_cleanup di = di_object_get_deai_strong((struct di_object *)oc);
+	if (di == NULL || di_get(di, "event", eventm) != 0) {
+		return false;
+	}
+
+	di_object_with_cleanup timer = NULL;
+	double interval = dbus_timeout_get_interval(t) / 1000.0;
+	if (di_callr(eventm, "timer", timer, interval) != 0) {
+		return false;
+	}
+
+	di_weak_object_with_cleanup weak = di_weakly_ref_object((struct di_object *)oc);
+	di_closure_with_cleanup cl =
+	    di_closure(dbus_timeout_callback, (weak, (void *)t), double);
+	auto l = di_listen_to(timer, di_string_borrow("elapsed"), (void *)cl);
+
+	// Keep the listen handle and the timer
+	with_cleanup_t(char) timer_name;
+	with_cleanup_t(char) listen_handle_name;
+	asprintf(&timer_name, "__dbus_timer_for_timeout_%p", t);
+	asprintf(&listen_handle_name, "__dbus_timer_listen_handle_for_timeout_%p", t);
+	DI_CHECK_OK(di_member(oc, listen_handle_name, l));
+	DI_CHECK_OK(di_member_clone(oc, timer_name, timer));
+	return true;
+}
+
+static void dbus_stop_timeout(struct di_object *oc, DBusTimeout *t) {
+	with_cleanup_t(char) timer_name;
+	asprintf(&timer_name, "__dbus_timer_for_timeout_%p", t);
+	di_remove_member_raw(oc, di_string_borrow(timer_name));
+	with_cleanup_t(char) listen_handle_name;
+	asprintf(&listen_handle_name, "__dbus_timer_listen_handle_for_timeout_%p", t);
+	di_remove_member_raw(oc, di_string_borrow(listen_handle_name));
+}
+
+static unsigned int dbus_add_timeout(DBusTimeout *t, void *ud) {
+	return dbus_start_timeout(ud, t);
+}
+
+static void dbus_remove_timeout(DBusTimeout *t, void *ud) {
+	di_object_with_cleanup conn = di_upgrade_weak_ref(ud);
+	DI_CHECK(conn != NULL);
+	dbus_stop_timeout(conn, t);
+}
+
+static void dbus_toggle_timeout(DBusTimeout *t, void *ud) {
+	// The interval could have changed as well, so just start over
+	dbus_stop_timeout(ud, t);
+	dbus_start_timeout(ud, t);
+}
+
+/// Parts of a signal name on the connection
+struct dbus_signal_name {
+	struct di_string bus, path, interface, member;
+};
+
 // connection will emit signal like this:
 // <bus name>%<path>%<interface>.<signal name>
-static char *to_dbus_match_rule(struct di_string name) {
+// or, for signals of any interface:
+// <bus name>%<path>%<signal name>
+static bool parse_signal_name(struct di_string name, struct dbus_signal_name *out) {
 	const char *sep = memchr(name.data, '%', name.length);
 	if (!sep) {
-		return NULL;
+		return false;
 	}
 	const char *sep2 = memchr(sep + 1, '%', name.length - (sep + 1 - name.data));
 	if (!sep2 || sep2 == sep + 1) {
-		return NULL;
+		return false;
 	}
-	const char *sep3 = memchr(sep2 + 1, '.', name.length - (sep2 + 1 - name.data));
-	if (sep3 == sep2 + 1 || (sep3 && !*(sep3 + 1))) {
-		return NULL;
+	const char *end = name.data + name.length;
+	if (sep2 + 1 == end) {
+		return false;
+	}
+	const char *sep3 = memrchr(sep2 + 1, '.', end - (sep2 + 1));
+	if (sep3 && (sep3 == sep2 + 1 || sep3 + 1 == end)) {
+		return false;
 	}
 
-	char *bus = strndup(name.data, sep - name.data);
-	char *path = strndup(sep + 1, sep2 - sep - 1);
-	char *interface = NULL;
+	out->bus = (struct di_string){name.data, sep - name.data};
+	out->path = (struct di_string){sep + 1, sep2 - sep - 1};
 	if (sep3) {
-		interface = strndup(sep2 + 1, sep3 - sep2 - 1);
+		out->interface = (struct di_string){sep2 + 1, sep3 - sep2 - 1};
+		out->member = (struct di_string){sep3 + 1, end - sep3 - 1};
+	} else {
+		out->interface = DI_STRING_INIT;
+		out->member = (struct di_string){sep2 + 1, end - sep2 - 1};
 	}
-	const char *signal = sep3 ? sep3 + 1 : sep2 + 1;
+	return true;
+}
 
+static char *to_dbus_match_rule(const struct dbus_signal_name *n) {
 	char *match;
-	if (interface) {
+	if (n->interface.length) {
 		asprintf(&match,
-		         "type='signal',sender='%s',path='%s',interface='%s'"
-		         ",member='%s'",
-		         bus, path, interface, signal);
+		         "type='signal',sender='%.*s',path='%.*s',interface='%.*s'"
+		         ",member='%.*s'",
+		         (int)n->bus.length, n->bus.data, (int)n->path.length, n->path.data,
+		         (int)n->interface.length, n->interface.data, (int)n->member.length,
+		         n->member.data);
 	} else {
-		asprintf(&match, "type='signal',sender='%s',path='%s',member='%s'", bus,
-		         path, signal);
+		asprintf(&match, "type='signal',sender='%.*s',path='%.*s',member='%.*s'",
+		         (int)n->bus.length, n->bus.data, (int)n->path.length, n->path.data,
+		         (int)n->member.length, n->member.data);
 	}
-
-	free(bus);
-	free(path);
-	free(interface);
 	return match;
 }
 
@@ -646,13 +1696,18 @@ static void di_dbus_new_signal(di_dbus_connection *c, struct di_string name) {
 		return;
 	}
 
-	if (*name.data == '%') {
-		auto match = to_dbus_match_rule(di_substring_start(name, 1));
-		if (!match) {
-			return;
-		}
+	struct dbus_signal_name n;
+	if (*name.data == '%' && parse_signal_name(di_substring_start(name, 1), &n)) {
+		auto match = to_dbus_match_rule(&n);
 		dbus_bus_add_match(c->conn, match, NULL);
 		free(match);
+
+		size_t key_len = route_key(NULL, 0, n.bus, n.path, n.interface, n.member);
+		struct dbus_signal_route *r = malloc(sizeof(*r) + key_len);
+		route_key(r->key, key_len, n.bus, n.path, n.interface, n.member);
+		r->key_len = key_len;
+		r->name = di_clone_string(name);
+		HASH_ADD_KEYPTR(hh, c->routes, r->key, r->key_len, r);
 	}
 }
 
@@ -664,14 +1719,72 @@ static void di_dbus_del_signal(di_dbus_connection *c, struct di_string name) {
 		return;
 	}
 
-	if (*name.data == '%') {
-		auto match = to_dbus_match_rule(di_substring_start(name, 1));
-		if (!match) {
-			return;
-		}
+	struct dbus_signal_name n;
+	if (*name.data == '%' && parse_signal_name(di_substring_start(name, 1), &n)) {
+		auto match = to_dbus_match_rule(&n);
 		dbus_bus_remove_match(c->conn, match, NULL);
 		free(match);
+
+		char buf[ROUTE_KEY_BUFFER_SIZE];
+		size_t key_len =
+		    route_key(buf, sizeof(buf), n.bus, n.path, n.interface, n.member);
+		char *key = key_len <= sizeof(buf) ? buf : malloc(key_len);
+		route_key(key, key_len, n.bus, n.path, n.interface, n.member);
+
+		struct dbus_signal_route *r = NULL;
+		HASH_FIND(hh, c->routes, key, key_len, r);
+		if (key != buf) {
+			free(key);
+		}
+		if (r) {
+			HASH_DEL(c->routes, r);
+			di_free_string(r->name);
+			free(r);
+		}
+	}
+}
+
+/// Arguments of an incoming signal, deserialized when they are first needed
+struct dbus_signal_args {
+	DBusMessage *msg;
+	struct di_string path, interface, member;
+	struct di_tuple t;
+	bool deserialized;
+};
+
+static void dbus_emit_signal_one(di_dbus_connection *c, struct dbus_signal_args *args,
+                                 struct di_string bus, struct di_string interface) {
+	char buf[ROUTE_KEY_BUFFER_SIZE];
+	size_t key_len = route_key(buf, sizeof(buf), bus, args->path, interface, args->member);
+	char *key = key_len <= sizeof(buf) ? buf : malloc(key_len);
+	route_key(key, key_len, bus, args->path, interface, args->member);
+
+	struct dbus_signal_route *r = NULL;
+	HASH_FIND(hh, c->routes, key, key_len, r);
+	if (key != buf) {
+		free(key);
+	}
+	if (!r) {
+		return;
+	}
+
+	if (!args->deserialized) {
+		DBusMessageIter i;
+		dbus_message_iter_init(args->msg, &i);
+		_dbus_deserialize_struct(&i, &args->t);
+		args->deserialized = true;
+	}
+	di_emitn((struct di_object *)c, r->name, args->t);
+}
+
+/// Emit the signal under the names with, and without the interface
+static void
+dbus_emit_signal(di_dbus_connection *c, struct dbus_signal_args *args, const char *bus) {
+	auto bus_str = di_string_borrow(bus);
+	if (args->interface.length) {
+		dbus_emit_signal_one(c, args, bus_str, args->interface);
 	}
+	dbus_emit_signal_one(c, args, bus_str, DI_STRING_INIT);
 }
 
 static DBusHandlerResult dbus_filter(DBusConnection *conn, DBusMessage *msg, void *ud) {
@@ -679,97 +1792,402 @@ static DBusHandlerResult dbus_filter(DBusConnection *conn, DBusMessage *msg, voi
 		return DBUS_HANDLER_RESULT_NOT_YET_HANDLED;
 	}
 
-	DBusMessageIter i;
-	dbus_message_iter_init(msg, &i);
+	di_dbus_connection *c = ud;
+	auto bus_name = dbus_message_get_sender(msg);
+	auto path = dbus_message_get_path(msg);
+	auto ifc = dbus_message_get_interface(msg);
+	auto mbr = dbus_message_get_member(msg);
 
-	struct di_tuple t;
-	_dbus_deserialize_struct(&i, &t);
+	if (!bus_name) {
+		return DBUS_HANDLER_RESULT_NOT_YET_HANDLED;
+	}
 
-	di_dbus_connection *c = ud;
-	if (strcmp(dbus_message_get_member(msg), "NameOwnerChanged") == 0 &&
-	    strcmp(dbus_message_get_sender(msg), DBUS_SERVICE_DBUS) == 0 &&
-	    strcmp(dbus_message_get_path(msg), DBUS_PATH_DBUS) == 0 &&
-	    strcmp(dbus_message_get_interface(msg), DBUS_INTERFACE_DBUS) == 0) {
+	if (dbus_message_is_signal(msg, DBUS_INTERFACE_DBUS, "NameOwnerChanged") &&
+	    strcmp(bus_name, DBUS_SERVICE_DBUS) == 0 && strcmp(path, DBUS_PATH_DBUS) == 0) {
 		// Handle name change
-		auto wk = t.elements[0].value->string;
-		auto old = t.elements[1].value->string;
-		auto new = t.elements[2].value->string;
-		di_dbus_update_name(c, wk, old, new, false);
+		const char *wk, *old, *new;
+		struct dbus_name_watch *w = NULL;
+		if (dbus_message_get_args(msg, NULL, DBUS_TYPE_STRING, &wk, DBUS_TYPE_STRING,
+		                          &old, DBUS_TYPE_STRING, &new, DBUS_TYPE_INVALID)) {
+			HASH_FIND_STR(c->name_watches, wk, w);
+		}
+		if (w) {
+			di_dbus_update_name(c, di_string_borrow(wk), di_string_borrow(new));
+			dbus_drop_introspections(c, wk);
+		}
+	}
+
+	if (c->property_watches &&
+	    dbus_message_is_signal(msg, DBUS_INTERFACE_PROPERTIES, "PropertiesChanged")) {
+		// Prevent connection object from dying during signal emission
+		di_ref_object(ud);
+		dbus_update_property_caches(c, msg, bus_name, path);
+		di_unref_object(ud);
+	}
+
+	if (c->routes == NULL) {
+		// Nobody is listening to any signal
+		return DBUS_HANDLER_RESULT_HANDLED;
 	}
 
-	char *sig;
+	struct dbus_signal_args args = {
+	    .msg = msg,
+	    .path = di_string_borrow(path),
+	    .interface = ifc ? di_string_borrow(ifc) : DI_STRING_INIT,
+	    .member = di_string_borrow(mbr),
+	};
 
 	// Prevent connection object from dying during signal emission
 	di_ref_object(ud);
-	auto bus_name = dbus_message_get_sender(msg);
-	auto path = dbus_message_get_path(msg);
-	auto ifc = dbus_message_get_interface(msg);
-	auto mbr = dbus_message_get_member(msg);
+	dbus_emit_signal(c, &args, bus_name);
+	if (*bus_name == ':') {
+		// Also emit the signal under the well-known names owned by the sender
+		dbus_unique_name *u = NULL;
+		HASH_FIND_STR(c->unique_names, bus_name, u);
+		if (u) {
+			dbus_bus_name *n;
+			list_for_each_entry (n, &u->well_knowns, sibling) {
+				dbus_emit_signal(c, &args, n->well_known);
+			}
+		}
+	}
+	if (args.deserialized) {
+		di_free_tuple(args.t);
+	}
+	di_unref_object(ud);
+	return DBUS_HANDLER_RESULT_HANDLED;
+}
 
-	if (!bus_name) {
-		di_unref_object(ud);
+/// Emits a signal of an exported object on the bus
+struct dbus_signal_forwarder {
+	struct di_object;
+	struct di_weak_object *export;
+	char *member;
+};
+
+static void dbus_unexport(di_dbus_connection *c, di_dbus_export *e) {
+	list_del(&e->sibling);
+	if (list_empty(&e->exported_path->exports)) {
+		dbus_connection_unregister_object_path(c->conn, e->path);
+		HASH_DEL(c->exported_paths, e->exported_path);
+		free(e->exported_path);
+	}
+	e->exported_path = NULL;
+}
+
+static void di_dbus_free_export(struct di_object *o) {
+	auto e = (di_dbus_export *)o;
+	if (e->exported_path) {
+		dbus_unexport((di_dbus_connection *)e->conn, e);
+	}
+	di_unref_object(e->target);
+	di_unref_object(e->conn);
+	free(e->path);
+	free(e->interface);
+}
+
+/// Build the reply of a method call from what the method returned
+static DBusMessage *dbus_export_reply(DBusMessage *msg, di_type_t rt, union di_value *ret) {
+	if (rt == DI_TYPE_OBJECT && di_check_type(ret->object, "deai:Error")) {
+		struct di_string errmsg = DI_STRING_INIT;
+		di_get(ret->object, "errmsg", errmsg);
+		char *message = di_string_to_chars_alloc(errmsg);
+		auto reply = dbus_message_new_error(msg, DBUS_ERROR_FAILED, message);
+		free(message);
+		di_free_string(errmsg);
+		return reply;
+	}
+
+	struct di_variant value = {ret, rt};
+	struct di_tuple t = {1, &value};
+	if (rt == DI_TYPE_NIL) {
+		t = DI_TUPLE_INIT;
+	} else if (rt == DI_TYPE_TUPLE) {
+		// Multiple return values
+		t = ret->tuple;
+	}
+
+	auto reply = dbus_message_new_method_return(msg);
+	DBusMessageIter i;
+	dbus_message_iter_init_append(reply, &i);
+	if (_dbus_serialize_struct(&i, t) != 0) {
+		dbus_message_unref(reply);
+		reply = dbus_message_new_error(msg, DBUS_ERROR_FAILED,
+		                               "Can't serialize the return value");
+	}
+	return reply;
+}
+
+static DBusHandlerResult dbus_export_message(DBusConnection *conn, DBusMessage *msg, void *ud) {
+	struct dbus_exported_path *p = ud;
+	auto interface = dbus_message_get_interface(msg);
+	auto member = dbus_message_get_member(msg);
+	if (dbus_message_get_type(msg) != DBUS_MESSAGE_TYPE_METHOD_CALL ||
+	    strncmp(member, "__", 2) == 0) {
+		return DBUS_HANDLER_RESULT_NOT_YET_HANDLED;
+	}
+
+	struct di_tuple t;
+	DBusMessageIter i;
+	dbus_message_iter_init(msg, &i);
+	_dbus_deserialize_struct(&i, &t);
+	if (t.length >= MAX_NARGS) {
+		di_free_tuple(t);
 		return DBUS_HANDLER_RESULT_NOT_YET_HANDLED;
 	}
 
-	if (*bus_name != ':') {
-		// We got a well known name
-		asprintf(&sig, "%%%s%%%s%%%s.%s", bus_name, path, ifc, mbr);
-		di_emitn(ud, di_string_borrow(sig), t);
-		free(sig);
-		// Emit the interface-less version of the signal
-		asprintf(&sig, "%%%s%%%s%%%s", bus_name, path, mbr);
-		di_emitn(ud, di_string_borrow(sig), t);
-		free(sig);
+	di_type_t rt;
+	union di_value ret;
+	bool called = false;
+	int rc = -ENOENT;
+	di_dbus_export *e;
+	list_for_each_entry (e, &p->exports, sibling) {
+		if (interface && strcmp(interface, e->interface) != 0) {
+			continue;
+		}
+		// The method could close the export, and free `p`. Neither can be used once
+		// the method is called.
+		di_object_with_cleanup target = di_ref_object(e->target);
+		rc = di_callx(target, di_string_borrow(member), &rt, &ret, t, &called);
+		if (called || rc != -ENOENT) {
+			break;
+		}
+	}
+	di_free_tuple(t);
+
+	DBusMessage *reply;
+	if (!called) {
+		if (rc == -ENOENT) {
+			// libdbus replies with UnknownMethod
+			return DBUS_HANDLER_RESULT_NOT_YET_HANDLED;
+		}
+		reply = dbus_message_new_error(msg, DBUS_ERROR_UNKNOWN_METHOD, "Not a method");
+	} else if (rc != 0) {
+		reply = dbus_message_new_error(msg,
+		                               rc == -EINVAL ? DBUS_ERROR_INVALID_ARGS
+		                                             : DBUS_ERROR_FAILED,
+		                               strerror(-rc));
 	} else {
-		dbus_bus_name *ni;
-		list_for_each_entry (ni, &c->known_names, sibling) {
-			if (strcmp(ni->unique, bus_name) != 0) {
-				continue;
+		reply = dbus_export_reply(msg, rt, &ret);
+		di_free_value(rt, &ret);
+	}
+
+	if (!dbus_message_get_no_reply(msg)) {
+		dbus_connection_send(conn, reply, NULL);
+	}
+	dbus_message_unref(reply);
+	return DBUS_HANDLER_RESULT_HANDLED;
+}
+
+static const DBusObjectPathVTable dbus_export_vtable = {
+    .message_function = dbus_export_message,
+};
+
+static int dbus_forward_signal(struct di_object *o, di_type_t *rt,
+                               union di_value *ret unused, struct di_tuple t) {
+	auto f = (struct dbus_signal_forwarder *)o;
+	*rt = DI_TYPE_NIL;
+
+	di_object_with_cleanup export_obj = di_upgrade_weak_ref(f->export);
+	auto e = (di_dbus_export *)export_obj;
+	if (e == NULL || e->exported_path == NULL) {
+		return 0;
+	}
+
+	auto c = (di_dbus_connection *)e->conn;
+	auto msg = dbus_message_new_signal(e->path, e->interface, f->member);
+	DBusMessageIter i;
+	dbus_message_iter_init_append(msg, &i);
+	// Signals whose arguments can't be serialized are dropped
+	if (_dbus_serialize_struct(&i, t) == 0) {
+		dbus_connection_send(c->conn, msg, NULL);
+	}
+	dbus_message_unref(msg);
+	return 0;
+}
+
+static void dbus_free_signal_forwarder(struct di_object *o) {
+	auto f = (struct dbus_signal_forwarder *)o;
+	di_drop_weak_ref(&f->export);
+	free(f->member);
+}
+
+/// Emit `signal` of the exported object on the bus too, as long as it's exported.
+///
+/// @return 0 on success, -EINVAL if `signal` isn't a valid D-Bus member name, -EEXIST
+///         if the signal is already forwarded, -ENOENT if the export is closed.
+static int di_dbus_export_forward(di_dbus_export *e, struct di_string signal) {
+	if (e->exported_path == NULL) {
+		return -ENOENT;
+	}
+
+	char *member = di_string_to_chars_alloc(signal);
+	if (!dbus_validate_member(member, NULL)) {
+		free(member);
+		return -EINVAL;
+	}
+
+	with_cleanup_t(char) listen_handle_name;
+	asprintf(&listen_handle_name, "__dbus_listen_handle_for_signal_%s", member);
+	if (di_has_member(e, listen_handle_name)) {
+		free(member);
+		return -EEXIST;
+	}
+
+	auto f = di_new_object_with_type(struct dbus_signal_forwarder);
+	f->export = di_weakly_ref_object((struct di_object *)e);
+	f->member = member;
+	di_set_object_dtor((struct di_object *)f, dbus_free_signal_forwarder);
+	di_set_object_call((struct di_object *)f, dbus_forward_signal);
+
+	auto l = di_listen_to(e->target, signal, (struct di_object *)f);
+	di_unref_object((struct di_object *)f);
+	DI_CHECK_OK(di_member(e, listen_handle_name, l));
+	return 0;
+}
+
+static struct di_object *di_dbus_export_object(di_dbus_connection *c, struct di_string path,
+                                               struct di_string interface,
+                                               struct di_object *obj) {
+	if (c->conn == NULL) {
+		return di_new_error("Connection is closed");
+	}
+
+	auto e = di_new_object_with_type(di_dbus_export);
+	di_set_type((struct di_object *)e, "deai.plugin.dbus:DBusExport");
+	e->conn = di_ref_object((struct di_object *)c);
+	e->target = di_ref_object(obj);
+	e->path = di_string_to_chars_alloc(path);
+	e->interface = di_string_to_chars_alloc(interface);
+	di_set_object_dtor((struct di_object *)e, di_dbus_free_export);
+
+	if (!dbus_validate_path(e->path, NULL)) {
+		di_unref_object((struct di_object *)e);
+		return di_new_error("Invalid object path");
+	}
+	if (!dbus_validate_interface(e->interface, NULL)) {
+		di_unref_object((struct di_object *)e);
+		return di_new_error("Invalid interface name");
+	}
+
+	struct dbus_exported_path *p = NULL;
+	HASH_FIND_STR(c->exported_paths, e->path, p);
+	if (p) {
+		di_dbus_export *other;
+		list_for_each_entry (other, &p->exports, sibling) {
+			if (strcmp(other->interface, e->interface) == 0) {
+				di_unref_object((struct di_object *)e);
+				return di_new_error("The interface is already exported on the path");
 			}
-			asprintf(&sig, "%%%s%%%s%%%s.%s", ni->well_known, path, ifc, mbr);
-			di_emitn(ud, di_string_borrow(sig), t);
-			free(sig);
-			// Emit the interface-less version of the signal
-			asprintf(&sig, "%%%s%%%s%%%s", ni->well_known, path, mbr);
-			di_emitn(ud, di_string_borrow(sig), t);
-			free(sig);
 		}
+	} else {
+		size_t len = strlen(e->path);
+		p = malloc(sizeof(*p) + len + 1);
+		memcpy(p->path, e->path, len + 1);
+		INIT_LIST_HEAD(&p->exports);
+		if (!dbus_connection_try_register_object_path(c->conn, p->path,
+		                                              &dbus_export_vtable, p, NULL)) {
+			free(p);
+			di_unref_object((struct di_object *)e);
+			return di_new_error("Failed to register the object path");
+		}
+		HASH_ADD_KEYPTR(hh, c->exported_paths, p->path, len, p);
 	}
-	di_free_value(DI_TYPE_TUPLE, (union di_value *)&t);
-	di_unref_object(ud);
-	return DBUS_HANDLER_RESULT_HANDLED;
+	list_add_tail(&e->sibling, &p->exports);
+	e->exported_path = p;
+
+	di_method(e, "forward", di_dbus_export_forward, struct di_string);
+	di_method(e, "close", di_finalize_object);
+	return (void *)e;
 }
 
-static struct di_object *di_dbus_get_session_bus(struct di_object *o) {
-	struct di_module *m = (void *)o;
+/// Ask the bus for a well-known name. The reply is the result code of RequestName, 1
+/// means the name is now owned by this connection. The request isn't queued if the name
+/// is already owned by someone else.
+static struct di_object *di_dbus_request_name(di_dbus_connection *c, struct di_string name) {
+	if (c->conn == NULL) {
+		return di_new_error("Connection is closed");
+	}
+
+	char *bus_name = di_string_to_chars_alloc(name);
+	if (!dbus_validate_bus_name(bus_name, NULL)) {
+		free(bus_name);
+		return di_new_error("Invalid bus name");
+	}
+
+	auto msg = dbus_message_new_method_call(DBUS_SERVICE_DBUS, DBUS_PATH_DBUS,
+	                                        DBUS_INTERFACE_DBUS, "RequestName");
+	dbus_uint32_t flags = DBUS_NAME_FLAG_DO_NOT_QUEUE;
+	dbus_message_append_args(msg, DBUS_TYPE_STRING, &bus_name, DBUS_TYPE_UINT32, &flags,
+	                         DBUS_TYPE_INVALID);
+	free(bus_name);
+
+	auto ret = dbus_new_pending_reply();
+	di_set_type((struct di_object *)ret, "deai.plugin.dbus:DBusPendingReply");
+	ret->conn = di_ref_object((struct di_object *)c);
+	bool sent = dbus_pending_reply_send(c, ret, msg, -1);
+	dbus_message_unref(msg);
+	if (!sent) {
+		di_unref_object((struct di_object *)ret);
+		return di_new_error("Failed to send message");
+	}
+	return (void *)ret;
+}
+
+static struct di_string di_dbus_connection_get_unique_name(di_dbus_connection *c) {
+	if (c->conn == NULL) {
+		return DI_STRING_INIT;
+	}
+	return di_string_dup(dbus_bus_get_unique_name(c->conn));
+}
+
+static double di_dbus_connection_get_timeout(di_dbus_connection *c) {
+	return c->timeout;
+}
+
+static void di_dbus_connection_set_timeout(di_dbus_connection *c, double timeout) {
+	c->timeout = timeout;
+}
+
+static struct di_object *di_dbus_connect(struct di_module *m, DBusBusType type) {
+	auto di = di_module_get_deai(m);
+	if (di == NULL) {
+		return di_new_error("deai is shutting down...");
+	}
+
 	DBusError e;
 	dbus_error_init(&e);
 
-	DBusConnection *conn = dbus_bus_get_private(DBUS_BUS_SESSION, &e);
+	DBusConnection *conn = dbus_bus_get_private(type, &e);
 	if (conn == NULL) {
+		di_unref_object(di);
 		auto ret = di_new_error(e.message);
 		dbus_error_free(&e);
 		return ret;
 	}
 
-	auto di = di_module_get_deai(m);
-	if (di == NULL) {
-		return di_new_error("deai is shutting down...");
-	}
-
 	dbus_connection_set_exit_on_disconnect(conn, 0);
 	auto ret = di_new_object_with_type(di_dbus_connection);
 	di_set_type((struct di_object *)ret, "deai.plugin.dbus:DBusConnection");
 
 	ret->conn = conn;
+	ret->timeout = -1;
 	di_member(ret, DEAI_MEMBER_NAME_RAW, di);
-	INIT_LIST_HEAD(&ret->known_names);
 	di_method(ret, "get", di_dbus_get_object, struct di_string, struct di_string);
+	di_method(ret, "batch", di_dbus_new_batch);
+	di_method(ret, "export", di_dbus_export_object, struct di_string, struct di_string,
+	          struct di_object *);
+	di_method(ret, "request_name", di_dbus_request_name, struct di_string);
 	di_method(ret, "__new_signal", di_dbus_new_signal, struct di_string);
 	di_method(ret, "__del_signal", di_dbus_del_signal, struct di_string);
+	di_getter(ret, unique_name, di_dbus_connection_get_unique_name);
+	di_getter(ret, timeout, di_dbus_connection_get_timeout);
+	di_setter(ret, timeout, di_dbus_connection_set_timeout, double);
 
 	dbus_connection_set_watch_functions(conn, dbus_add_watch, dbus_remove_watch,
 	                                    dbus_toggle_watch, ret, NULL);
+	dbus_connection_set_timeout_functions(conn, dbus_add_timeout, dbus_remove_timeout,
+	                                      dbus_toggle_timeout, ret, NULL);
 
 	dbus_connection_add_filter(conn, dbus_filter, ret, NULL);
 
@@ -778,10 +2196,43 @@ static struct di_object *di_dbus_get_session_bus(struct di_object *o) {
 	return (void *)ret;
 }
 
+/// Get the connection to a bus. The connection is shared by everyone using the module,
+/// as long as it is alive. The module only keeps a weak reference to it, so the
+/// connection is closed once nobody uses it.
+static struct di_object *
+di_dbus_get_or_create_bus(struct di_module *m, DBusBusType type, const char *cache_name) {
+	struct di_weak_object *weak = NULL;
+	if (di_get(m, cache_name, weak) == 0) {
+		auto conn = di_upgrade_weak_ref(weak);
+		di_drop_weak_ref(&weak);
+		if (conn != NULL) {
+			return conn;
+		}
+		di_remove_member_raw((struct di_object *)m, di_string_borrow(cache_name));
+	}
+
+	auto conn = di_dbus_connect(m, type);
+	if (di_check_type(conn, "deai:Error")) {
+		return conn;
+	}
+	weak = di_weakly_ref_object(conn);
+	di_member(m, cache_name, weak);
+	return conn;
+}
+
+static struct di_object *di_dbus_get_session_bus(struct di_object *o) {
+	return di_dbus_get_or_create_bus((void *)o, DBUS_BUS_SESSION, "__dbus_session_bus");
+}
+
+static struct di_object *di_dbus_get_system_bus(struct di_object *o) {
+	return di_dbus_get_or_create_bus((void *)o, DBUS_BUS_SYSTEM, "__dbus_system_bus");
+}
+
 DEAI_PLUGIN_ENTRY_POINT(di) {
 	auto m = di_new_module(di);
 
 	di_getter(m, session_bus, di_dbus_get_session_bus);
+	di_getter(m, system_bus, di_dbus_get_system_bus);
 
 	di_register_module(di, di_string_borrow("dbus"), &m);
 	return 0;
@@ -0,0 +1,361 @@
+/// A minimal parser for D-Bus introspection data. Only what is needed to know the type
+/// signatures of methods, signals and properties is understood: elements, attributes,
+/// comments, processing instructions and the doctype declaration.
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <deai/helper.h>
+
+#include "common.h"
+#include "introspect.h"
+
+struct introspect_parser {
+	const char *p;
+	/// Depth of <node> elements, only the interfaces of the outermost node are kept
+	int node_depth;
+	struct dbus_interface_info *interface;
+	struct dbus_member_info *member;
+	/// Whether `member` is a method
+	bool in_method;
+	struct dbus_interface_info **interfaces;
+};
+
+struct xml_attr {
+	const char *name;
+	size_t name_len;
+	char *value;
+};
+
+#define MAX_ATTRS 8
+
+static bool is_name_char(char c) {
+	return c && !strchr(" \t\r\n/>=<\"'", c);
+}
+
+static void skip_space(struct introspect_parser *p) {
+	while (*p->p && strchr(" \t\r\n", *p->p)) {
+		p->p++;
+	}
+}
+
+/// Copy an attribute value, replacing the predefined entities
+static char *unescape(const char *s, size_t len) {
+	static const struct {
+		const char *entity;
+		char c;
+	} entities[] = {
+	    {"&lt;", '<'}, {"&gt;", '>'}, {"&amp;", '&'}, {"&quot;", '"'}, {"&apos;", '\''},
+	};
+	char *ret = malloc(len + 1), *out = ret;
+	const char *end = s + len;
+	while (s < end) {
+		if (*s == '&') {
+			bool found = false;
+			for (size_t i = 0; i < ARRAY_SIZE(entities); i++) {
+				size_t elen = strlen(entities[i].entity);
+				if ((size_t)(end - s) >= elen &&
+				    strncmp(s, entities[i].entity, elen) == 0) {
+					*out++ = entities[i].c;
+					s += elen;
+					found = true;
+					break;
+				}
+			}
+			if (found) {
+				continue;
+			}
+		}
+		*out++ = *s++;
+	}
+	*out = '\0';
+	return ret;
+}
+
+static const char *attr_value(struct xml_attr *attrs, int nattrs, const char *name) {
+	for (int i = 0; i < nattrs; i++) {
+		if (attrs[i].name_len == strlen(name) &&
+		    strncmp(attrs[i].name, name, attrs[i].name_len) == 0) {
+			return attrs[i].value;
+		}
+	}
+	return NULL;
+}
+
+static void append_signature(char **sig, const char *type) {
+	size_t len = *sig ? strlen(*sig) : 0;
+	*sig = realloc(*sig, len + strlen(type) + 1);
+	strcpy(*sig + len, type);
+}
+
+static struct dbus_member_info *
+new_member(struct dbus_member_info **members, const char *name) {
+	size_t len = strlen(name);
+	struct dbus_member_info *m = NULL;
+	HASH_FIND(hh, *members, name, len, m);
+	if (m) {
+		// Duplicated member, the last one wins
+		HASH_DEL(*members, m);
+		free(m->signature);
+		free(m->out_signature);
+		free(m);
+	}
+	m = calloc(1, sizeof(*m) + len + 1);
+	memcpy(m->name, name, len + 1);
+	m->signature = strdup("");
+	m->readable = m->writable = true;
+	HASH_ADD_KEYPTR(hh, *members, m->name, len, m);
+	return m;
+}
+
+static int open_element(struct introspect_parser *p, const char *tag, size_t tag_len,
+                        struct xml_attr *attrs, int nattrs) {
+#define IS_TAG(name) (tag_len == strlen(name) && strncmp(tag, name, tag_len) == 0)
+	if (IS_TAG("node")) {
+		p->node_depth++;
+		return 0;
+	}
+	if (p->node_depth != 1) {
+		return 0;
+	}
+
+	const char *name = attr_value(attrs, nattrs, "name");
+	if (IS_TAG("interface")) {
+		if (!name || p->interface) {
+			return -EINVAL;
+		}
+		size_t len = strlen(name);
+		struct dbus_interface_info *i = NULL;
+		HASH_FIND(hh, *p->interfaces, name, len, i);
+		if (!i) {
+			i = calloc(1, sizeof(*i) + len + 1);
+			memcpy(i->name, name, len + 1);
+			HASH_ADD_KEYPTR(hh, *p->interfaces, i->name, len, i);
+		}
+		p->interface = i;
+	} else if (IS_TAG("method") || IS_TAG("signal")) {
+		if (!name || !p->interface || p->member) {
+			return -EINVAL;
+		}
+		p->in_method = IS_TAG("method");
+		if (p->in_method) {
+			p->member = new_member(&p->interface->methods, name);
+			p->member->out_signature = strdup("");
+		} else {
+			p->member = new_member(&p->interface->signals, name);
+		}
+	} else if (IS_TAG("property")) {
+		const char *type = attr_value(attrs, nattrs, "type");
+		const char *access = attr_value(attrs, nattrs, "access");
+		if (!name || !type || !p->interface || p->member) {
+			return -EINVAL;
+		}
+		auto m = new_member(&p->interface->properties, name);
+		append_signature(&m->signature, type);
+		if (access) {
+			m->readable = strstr(access, "read") != NULL;
+			m->writable = strstr(access, "write") != NULL;
+		}
+	} else if (IS_TAG("arg")) {
+		const char *type = attr_value(attrs, nattrs, "type");
+		const char *direction = attr_value(attrs, nattrs, "direction");
+		if (!type) {
+			return -EINVAL;
+		}
+		if (!p->member) {
+			// Annotation-like use of arg, ignore it
+			return 0;
+		}
+		if (p->in_method && direction && strcmp(direction, "out") == 0) {
+			append_signature(&p->member->out_signature, type);
+		} else {
+			append_signature(&p->member->signature, type);
+		}
+	}
+	return 0;
+#undef IS_TAG
+}
+
+static void close_element(struct introspect_parser *p, const char *tag, size_t tag_len) {
+#define IS_TAG(name) (tag_len == strlen(name) && strncmp(tag, name, tag_len) == 0)
+	if (IS_TAG("node")) {
+		p->node_depth--;
+	} else if (p->node_depth != 1) {
+		return;
+	} else if (IS_TAG("interface")) {
+		p->interface = NULL;
+	} else if (IS_TAG("method") || IS_TAG("signal")) {
+		p->member = NULL;
+	}
+#undef IS_TAG
+}
+
+/// Parse one tag, `p->p` points to the character after '<'
+static int parse_tag(struct introspect_parser *p) {
+	if (strncmp(p->p, "!--", 3) == 0) {
+		const char *end = strstr(p->p, "-->");
+		if (!end) {
+			return -EINVAL;
+		}
+		p->p = end + 3;
+		return 0;
+	}
+	if (*p->p == '?' || *p->p == '!') {
+		const char *end = strchr(p->p, '>');
+		if (!end) {
+			return -EINVAL;
+		}
+		p->p = end + 1;
+		return 0;
+	}
+
+	bool closing = *p->p == '/';
+	if (closing) {
+		p->p++;
+	}
+	const char *tag = p->p;
+	while (is_name_char(*p->p)) {
+		p->p++;
+	}
+	size_t tag_len = p->p - tag;
+	if (tag_len == 0) {
+		return -EINVAL;
+	}
+
+	if (closing) {
+		skip_space(p);
+		if (*p->p != '>') {
+			return -EINVAL;
+		}
+		p->p++;
+		close_element(p, tag, tag_len);
+		return 0;
+	}
+
+	struct xml_attr attrs[MAX_ATTRS];
+	int nattrs = 0, ret = 0;
+	bool self_closing = false;
+	while (true) {
+		skip_space(p);
+		if (*p->p == '>') {
+			p->p++;
+			break;
+		}
+		if (strncmp(p->p, "/>", 2) == 0) {
+			p->p += 2;
+			self_closing = true;
+			break;
+		}
+
+		const char *name = p->p;
+		while (is_name_char(*p->p)) {
+			p->p++;
+		}
+		size_t name_len = p->p - name;
+		skip_space(p);
+		if (name_len == 0 || *p->p != '=') {
+			ret = -EINVAL;
+			goto out;
+		}
+		p->p++;
+		skip_space(p);
+		char quote = *p->p;
+		if (quote != '"' && quote != '\'') {
+			ret = -EINVAL;
+			goto out;
+		}
+		const char *value = ++p->p;
+		const char *end = strchr(value, quote);
+		if (!end) {
+			ret = -EINVAL;
+			goto out;
+		}
+		p->p = end + 1;
+		if (nattrs < MAX_ATTRS) {
+			attrs[nattrs].name = name;
+			attrs[nattrs].name_len = name_len;
+			attrs[nattrs].value = unescape(value, end - value);
+			nattrs++;
+		}
+	}
+
+	ret = open_element(p, tag, tag_len, attrs, nattrs);
+	if (ret == 0 && self_closing) {
+		close_element(p, tag, tag_len);
+	}
+out:
+	for (int i = 0; i < nattrs; i++) {
+		free(attrs[i].value);
+	}
+	return ret;
+}
+
+int dbus_parse_introspection(const char *xml, struct dbus_interface_info **out) {
+	struct introspect_parser p = {.p = xml, .interfaces = out};
+	*out = NULL;
+	while (true) {
+		const char *next = strchr(p.p, '<');
+		if (!next) {
+			break;
+		}
+		p.p = next + 1;
+		if (parse_tag(&p) != 0) {
+			dbus_free_interfaces(out);
+			return -EINVAL;
+		}
+	}
+	return 0;
+}
+
+static void free_members(struct dbus_member_info **members) {
+	struct dbus_member_info *m, *tmp;
+	HASH_ITER (hh, *members, m, tmp) {
+		HASH_DEL(*members, m);
+		free(m->signature);
+		free(m->out_signature);
+		free(m);
+	}
+}
+
+void dbus_free_interfaces(struct dbus_interface_info **interfaces) {
+	struct dbus_interface_info *i, *tmp;
+	HASH_ITER (hh, *interfaces, i, tmp) {
+		HASH_DEL(*interfaces, i);
+		free_members(&i->methods);
+		free_members(&i->signals);
+		free_members(&i->properties);
+		free(i);
+	}
+}
+
+struct dbus_member_info *
+dbus_find_method(struct dbus_interface_info *interfaces, const char *interface,
+                 const char *name, const char **found_interface) {
+	struct dbus_member_info *ret = NULL;
+	if (interface) {
+		struct dbus_interface_info *i = NULL;
+		HASH_FIND_STR(interfaces, interface, i);
+		if (i) {
+			HASH_FIND_STR(i->methods, name, ret);
+			*found_interface = i->name;
+		}
+		return ret;
+	}
+
+	struct dbus_interface_info *i, *tmp;
+	HASH_ITER (hh, interfaces, i, tmp) {
+		struct dbus_member_info *m = NULL;
+		HASH_FIND_STR(i->methods, name, m);
+		if (!m) {
+			continue;
+		}
+		if (ret) {
+			// Ambiguous
+			return NULL;
+		}
+		ret = m;
+		*found_interface = i->name;
+	}
+	return ret;
+}
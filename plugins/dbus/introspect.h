@@ -0,0 +1,39 @@
+#pragma once
+#include <stdbool.h>
+
+#include "uthash.h"
+
+/// A method, signal or property of an interface
+struct dbus_member_info {
+	UT_hash_handle hh;
+	/// Types of the input arguments for methods, of the arguments for signals, and
+	/// the type of the value for properties
+	char *signature;
+	/// Types of the output arguments for methods, NULL otherwise
+	char *out_signature;
+	/// Whether the property can be read, and written. Always true for methods and
+	/// signals.
+	bool readable, writable;
+	char name[];
+};
+
+struct dbus_interface_info {
+	UT_hash_handle hh;
+	struct dbus_member_info *methods, *signals, *properties;
+	char name[];
+};
+
+/// Parse the XML returned by org.freedesktop.DBus.Introspectable.Introspect. Only the
+/// interfaces of the object itself are kept, child nodes are ignored.
+///
+/// @return 0 on success, -EINVAL if the XML is malformed
+int dbus_parse_introspection(const char *xml, struct dbus_interface_info **out);
+void dbus_free_interfaces(struct dbus_interface_info **interfaces);
+
+/// Find a method named `name`. If `interface` is NULL, look in all interfaces, the
+/// method is not found if more than one interface has it.
+///
+/// @param[out] found_interface the interface the method is found in
+struct dbus_member_info *
+dbus_find_method(struct dbus_interface_info *interfaces, const char *interface,
+                 const char *name, const char **found_interface);
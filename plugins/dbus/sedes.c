@@ -17,6 +17,7 @@ static di_type_t dbus_type_to_di(int type) {
 	case DBUS_TYPE_INT32:
 	case DBUS_TYPE_INT64:
 		return DI_TYPE_INT;
+	case DBUS_TYPE_BYTE:
 	case DBUS_TYPE_UINT16:
 	case DBUS_TYPE_UINT32:
 	case DBUS_TYPE_UINT64:
@@ -24,7 +25,11 @@ static di_type_t dbus_type_to_di(int type) {
 	case DBUS_TYPE_DOUBLE:
 		return DI_TYPE_FLOAT;
 	case DBUS_TYPE_STRING:
+	case DBUS_TYPE_OBJECT_PATH:
+	case DBUS_TYPE_SIGNATURE:
 		return DI_TYPE_STRING;
+	case DBUS_TYPE_VARIANT:
+		return DI_TYPE_VARIANT;
 	case DBUS_TYPE_UNIX_FD:
 		// TODO(yshui)
 		return DI_TYPE_INT;
@@ -54,11 +59,14 @@ dbus_deserialize_basic(DBusMessageIter *i, union di_value *retp, di_type_t *otyp
 		DESERIAL(DBUS_TYPE_INT32, dbus_int32_t, int_);
 		DESERIAL(DBUS_TYPE_UNIX_FD, dbus_int32_t, int_);
 		DESERIAL(DBUS_TYPE_INT64, dbus_int64_t, int_);
+		DESERIAL(DBUS_TYPE_BYTE, uint8_t, uint);
 		DESERIAL(DBUS_TYPE_UINT16, dbus_uint16_t, uint);
 		DESERIAL(DBUS_TYPE_UINT32, dbus_uint32_t, uint);
 		DESERIAL(DBUS_TYPE_UINT64, dbus_uint64_t, uint);
 		DESERIAL(DBUS_TYPE_DOUBLE, double, float_);
-	case DBUS_TYPE_STRING:;
+	case DBUS_TYPE_STRING:
+	case DBUS_TYPE_OBJECT_PATH:
+	case DBUS_TYPE_SIGNATURE:;
 		const char *dbus_string;
 		dbus_message_iter_get_basic(i, &dbus_string);
 		retp->string = di_string_dup(dbus_string);
@@ -73,17 +81,78 @@ dbus_deserialize_basic(DBusMessageIter *i, union di_value *retp, di_type_t *otyp
 
 static void dbus_deserialize_one(DBusMessageIter *i, void *retp, di_type_t *otype, int type);
 
+/// Copy a fixed-size dbus array out of the message. 32-bit and 64-bit integers, and
+/// doubles, have the same layout in deai, they are copied in one go. Narrower types are
+/// widened into a di_array of the smallest deai type that holds them.
+///
+/// Unix fds are fixed-size, but can't be read with dbus_message_iter_get_fixed_array,
+/// they must not be passed here.
+static void dbus_deserialize_fixed_array(DBusMessageIter *i, struct di_array *retp, int type) {
+	const void *data = NULL;
+	int length = 0;
+	dbus_message_iter_get_fixed_array(i, &data, &length);
+
+	struct di_array ret = DI_ARRAY_INIT;
+	switch (type) {
+	case DBUS_TYPE_INT32:
+		ret.elem_type = DI_TYPE_NINT;
+		break;
+	case DBUS_TYPE_UINT32:
+		ret.elem_type = DI_TYPE_NUINT;
+		break;
+	case DBUS_TYPE_BOOLEAN:
+	case DBUS_TYPE_BYTE:
+	case DBUS_TYPE_INT16:
+	case DBUS_TYPE_UINT16:
+	case DBUS_TYPE_INT64:
+	case DBUS_TYPE_UINT64:
+	case DBUS_TYPE_DOUBLE:
+		ret.elem_type = dbus_type_to_di(type);
+		break;
+	default:
+		assert(false);
+	}
+	if (length <= 0) {
+		*retp = ret;
+		return;
+	}
+
+	size_t esize = di_sizeof_type(ret.elem_type);
+	ret.length = length;
+	ret.arr = malloc(esize * ret.length);
+	switch (type) {
+	case DBUS_TYPE_BOOLEAN:
+		for (int x = 0; x < length; x++) {
+			((bool *)ret.arr)[x] = ((const dbus_bool_t *)data)[x];
+		}
+		break;
+	case DBUS_TYPE_BYTE:
+		for (int x = 0; x < length; x++) {
+			((uint64_t *)ret.arr)[x] = ((const uint8_t *)data)[x];
+		}
+		break;
+	case DBUS_TYPE_INT16:
+		for (int x = 0; x < length; x++) {
+			((int64_t *)ret.arr)[x] = ((const dbus_int16_t *)data)[x];
+		}
+		break;
+	case DBUS_TYPE_UINT16:
+		for (int x = 0; x < length; x++) {
+			((uint64_t *)ret.arr)[x] = ((const dbus_uint16_t *)data)[x];
+		}
+		break;
+	default:
+		memcpy(ret.arr, data, esize * ret.length);
+	}
+	*retp = ret;
+}
+
 // Deserialize an array. `i' is the iterator, already recursed into the array
 // `type' is the array element type
 static void
 dbus_deserialize_array(DBusMessageIter *i, struct di_array *retp, int type, int length) {
-	if (dbus_type_is_fixed(type)) {
-		struct di_array ret;
-		int length;
-		dbus_message_iter_get_fixed_array(i, &ret.arr, &length);
-		ret.length = length;
-		*retp = ret;
-		return;
+	if (dbus_type_is_fixed(type) && type != DBUS_TYPE_UNIX_FD) {
+		return dbus_deserialize_fixed_array(i, retp, type);
 	}
 
 	struct di_array ret;
@@ -135,18 +204,27 @@ void _dbus_deserialize_struct(DBusMessageIter *i, void *retp) {
 	*(struct di_tuple *)retp = t;
 }
 
-static void dbus_deserialize_dict(DBusMessageIter *i, void *retp, int length) {
+/// Deserialize a dict with string or object path keys as an object, with one member for
+/// each key. Members are hashed, so looking up a key doesn't scan the dict. `i` is the
+/// iterator, already recursed into the array.
+static void dbus_deserialize_dict(DBusMessageIter *i, void *retp) {
 	auto o = di_new_object_with_type(struct di_object);
-	for (int x = 0; x < length; x++) {
-		struct di_tuple t;
+	while (dbus_message_iter_get_arg_type(i) == DBUS_TYPE_DICT_ENTRY) {
 		DBusMessageIter i2;
 		dbus_message_iter_recurse(i, &i2);
-		_dbus_deserialize_struct(&i2, &t);
-		assert(t.length == 2);
-		assert(t.elements[0].type == DI_TYPE_STRING);
-		di_add_member_move(o, t.elements[0].value->string, &t.elements[1].type,
-		                   t.elements[1].value);
-		di_free_tuple(t);
+
+		const char *key;
+		dbus_message_iter_get_basic(&i2, &key);
+		dbus_message_iter_next(&i2);
+
+		// Values of a{sv} dicts are stored as what's inside the variants
+		struct di_variant value;
+		_dbus_deserialize_value(&i2, &value);
+		if (value.type != DI_TYPE_NIL) {
+			// For duplicated keys, the first one wins
+			di_add_member_move(o, di_string_borrow(key), &value.type, value.value);
+		}
+		free(value.value);
 		dbus_message_iter_next(i);
 	}
 	*(struct di_object **)retp = o;
@@ -161,15 +239,14 @@ static void dbus_deserialize_one(DBusMessageIter *i, void *retp, di_type_t *otyp
 		DBusMessageIter i2;
 		dbus_message_iter_recurse(i, &i2);
 		int type2 = dbus_message_iter_get_arg_type(&i2);
-		// deserialize dict with string keys as object
+		// deserialize dict with string or object path keys as object
 		if (type2 == DBUS_TYPE_DICT_ENTRY) {
 			DBusMessageIter i3;
 			dbus_message_iter_recurse(&i2, &i3);
 			int type3 = dbus_message_iter_get_arg_type(&i3);
-			if (type3 == DBUS_TYPE_STRING) {
+			if (type3 == DBUS_TYPE_STRING || type3 == DBUS_TYPE_OBJECT_PATH) {
 				*otype = DI_TYPE_OBJECT;
-				return dbus_deserialize_dict(
-				    &i2, retp, dbus_message_iter_get_element_count(i));
+				return dbus_deserialize_dict(&i2, retp);
 			}
 		}
 
@@ -190,6 +267,35 @@ static void dbus_deserialize_one(DBusMessageIter *i, void *retp, di_type_t *otyp
 		*otype = DI_TYPE_TUPLE;
 		_dbus_deserialize_struct(&i2, retp);
 	}
+
+	if (type == DBUS_TYPE_VARIANT) {
+		DBusMessageIter i2;
+		dbus_message_iter_recurse(i, &i2);
+		*otype = DI_TYPE_VARIANT;
+		_dbus_deserialize_value(&i2, retp);
+	}
+}
+
+void _dbus_deserialize_value(DBusMessageIter *i, struct di_variant *out) {
+	DBusMessageIter i2;
+	int type = dbus_message_iter_get_arg_type(i);
+	if (type == DBUS_TYPE_VARIANT) {
+		dbus_message_iter_recurse(i, &i2);
+		i = &i2;
+		type = dbus_message_iter_get_arg_type(i);
+	}
+
+	out->type = dbus_type_to_di(type);
+	if (out->type == DI_LAST_TYPE) {
+		*out = (struct di_variant){NULL, DI_TYPE_NIL};
+		return;
+	}
+	out->value = calloc(1, di_sizeof_type(out->type));
+
+	di_type_t rtype;
+	dbus_deserialize_one(i, out->value, &rtype, type);
+	// Dicts are deserialized as objects
+	out->type = rtype;
 }
 
 static int di_type_to_dbus_basic(di_type_t type) {
@@ -478,3 +584,256 @@ int _dbus_serialize_struct(DBusMessageIter *it, struct di_tuple t) {
 	free_dbus_signature(sig);
 	return 0;
 }
+
+/// Return the end of the first complete type in `sig`, or NULL if `sig` is malformed
+static const char *signature_skip(const char *sig) {
+	switch (*sig) {
+	case '\0':
+		return NULL;
+	case DBUS_TYPE_ARRAY:
+		return signature_skip(sig + 1);
+	case DBUS_STRUCT_BEGIN_CHAR:
+	case DBUS_DICT_ENTRY_BEGIN_CHAR:;
+		char close = *sig == DBUS_STRUCT_BEGIN_CHAR ? DBUS_STRUCT_END_CHAR
+		                                             : DBUS_DICT_ENTRY_END_CHAR;
+		sig++;
+		while (*sig != close) {
+			sig = signature_skip(sig);
+			if (!sig) {
+				return NULL;
+			}
+		}
+		return sig + 1;
+	default:
+		return sig + 1;
+	}
+}
+
+/// Convert an integer to the bit pattern of a dbus integer in the range [min, max]
+static int typed_integer(di_type_t type, const union di_value *v, int64_t min,
+                         uint64_t max, uint64_t *out) {
+	int64_t s;
+	if (type == DI_TYPE_UINT || type == DI_TYPE_NUINT) {
+		*out = type == DI_TYPE_UINT ? v->uint : v->nuint;
+		return *out <= max ? 0 : -ERANGE;
+	}
+	if (type == DI_TYPE_INT) {
+		s = v->int_;
+	} else if (type == DI_TYPE_NINT) {
+		s = v->nint;
+	} else {
+		return -EINVAL;
+	}
+	*out = (uint64_t)s;
+	if (s < 0) {
+		return s >= min ? 0 : -ERANGE;
+	}
+	return (uint64_t)s <= max ? 0 : -ERANGE;
+}
+
+static int serialize_typed_one(DBusMessageIter *i, di_type_t type, const union di_value *v,
+                               const char *sig, const char *end);
+
+/// Serialize `count` values of `type` stored consecutively at `values`, as elements of
+/// an array of type `sig`
+static int serialize_typed_array(DBusMessageIter *i, di_type_t type, const void *values,
+                                 uint64_t count, const char *sig, const char *end) {
+	// The C representation is the same as the dbus one, the array can be copied as is.
+	// Booleans are not, dbus_bool_t is 4 bytes.
+	if (end == sig + 1 &&
+	    ((*sig == DBUS_TYPE_DOUBLE && type == DI_TYPE_FLOAT) ||
+	     (*sig == DBUS_TYPE_INT64 && type == DI_TYPE_INT) ||
+	     (*sig == DBUS_TYPE_UINT64 && type == DI_TYPE_UINT) ||
+	     (*sig == DBUS_TYPE_INT32 && type == DI_TYPE_NINT) ||
+	     (*sig == DBUS_TYPE_UINT32 && type == DI_TYPE_NUINT))) {
+		// append_fixed_array takes pointer to pointer
+		if (!dbus_message_iter_append_fixed_array(i, *sig, &values, (int)count)) {
+			return -ENOMEM;
+		}
+		return 0;
+	}
+
+	size_t step = di_sizeof_type(type);
+	for (uint64_t x = 0; x < count; x++) {
+		int ret = serialize_typed_one(i, type, values + step * x, sig, end);
+		if (ret < 0) {
+			return ret;
+		}
+	}
+	return 0;
+}
+
+static int serialize_typed_one(DBusMessageIter *i, di_type_t type, const union di_value *v,
+                               const char *sig, const char *end) {
+	while (type == DI_TYPE_VARIANT) {
+		type = v->variant.type;
+		v = v->variant.value;
+	}
+
+	DBusMessageIter vi;
+	uint64_t n;
+	int ret;
+	switch (*sig) {
+#define TYPED_INTEGER(typeid, ctype, min, max)                                           \
+	case typeid:                                                                     \
+		ret = typed_integer(type, v, min, max, &n);                              \
+		if (ret < 0) {                                                           \
+			return ret;                                                      \
+		}                                                                        \
+		do {                                                                     \
+			ctype __o = (ctype)n;                                            \
+			if (!dbus_message_iter_append_basic(i, typeid, &__o)) {          \
+				return -ENOMEM;                                          \
+			}                                                                \
+		} while (0);                                                             \
+		return 0
+		TYPED_INTEGER(DBUS_TYPE_BYTE, uint8_t, 0, UINT8_MAX);
+		TYPED_INTEGER(DBUS_TYPE_INT16, dbus_int16_t, INT16_MIN, INT16_MAX);
+		TYPED_INTEGER(DBUS_TYPE_UINT16, dbus_uint16_t, 0, UINT16_MAX);
+		TYPED_INTEGER(DBUS_TYPE_INT32, dbus_int32_t, INT32_MIN, INT32_MAX);
+		TYPED_INTEGER(DBUS_TYPE_UINT32, dbus_uint32_t, 0, UINT32_MAX);
+		TYPED_INTEGER(DBUS_TYPE_INT64, dbus_int64_t, INT64_MIN, INT64_MAX);
+		TYPED_INTEGER(DBUS_TYPE_UINT64, dbus_uint64_t, 0, UINT64_MAX);
+		TYPED_INTEGER(DBUS_TYPE_UNIX_FD, dbus_int32_t, 0, INT32_MAX);
+#undef TYPED_INTEGER
+	case DBUS_TYPE_BOOLEAN:;
+		if (type != DI_TYPE_BOOL) {
+			return -EINVAL;
+		}
+		dbus_bool_t b = v->bool_;
+		return dbus_message_iter_append_basic(i, DBUS_TYPE_BOOLEAN, &b) ? 0 : -ENOMEM;
+	case DBUS_TYPE_DOUBLE:;
+		double d;
+		if (type == DI_TYPE_FLOAT) {
+			d = v->float_;
+		} else if (type == DI_TYPE_INT || type == DI_TYPE_NINT) {
+			d = type == DI_TYPE_INT ? (double)v->int_ : (double)v->nint;
+		} else if (type == DI_TYPE_UINT || type == DI_TYPE_NUINT) {
+			d = type == DI_TYPE_UINT ? (double)v->uint : (double)v->nuint;
+		} else {
+			return -EINVAL;
+		}
+		return dbus_message_iter_append_basic(i, DBUS_TYPE_DOUBLE, &d) ? 0 : -ENOMEM;
+	case DBUS_TYPE_STRING:
+	case DBUS_TYPE_OBJECT_PATH:
+	case DBUS_TYPE_SIGNATURE:;
+		char *str;
+		if (type == DI_TYPE_STRING) {
+			str = di_string_to_chars_alloc(v->string);
+		} else if (type == DI_TYPE_STRING_LITERAL) {
+			str = strdup(v->string_literal);
+		} else {
+			return -EINVAL;
+		}
+		// libdbus doesn't like invalid object paths and signatures
+		if ((*sig == DBUS_TYPE_OBJECT_PATH && !dbus_validate_path(str, NULL)) ||
+		    (*sig == DBUS_TYPE_SIGNATURE && !dbus_signature_validate(str, NULL))) {
+			free(str);
+			return -EINVAL;
+		}
+		ret = dbus_message_iter_append_basic(i, *sig, &str) ? 0 : -ENOMEM;
+		free(str);
+		return ret;
+	case DBUS_TYPE_VARIANT:;
+		// There is no type information for what's inside a variant, guess it from
+		// the value. Only basic types, and arrays of them are supported.
+		char inner[3] = {0};
+		if (dbus_type_is_basic(di_type_to_dbus_basic(type))) {
+			inner[0] = (char)di_type_to_dbus_basic(type);
+		} else if (type == DI_TYPE_ARRAY &&
+		           dbus_type_is_basic(di_type_to_dbus_basic(v->array.elem_type))) {
+			inner[0] = DBUS_TYPE_ARRAY;
+			inner[1] = (char)di_type_to_dbus_basic(v->array.elem_type);
+		} else {
+			return -ENOTSUP;
+		}
+		if (!dbus_message_iter_open_container(i, DBUS_TYPE_VARIANT, inner, &vi)) {
+			return -ENOMEM;
+		}
+		ret = serialize_typed_one(&vi, type, v, inner, inner + strlen(inner));
+		break;
+	case DBUS_TYPE_ARRAY:;
+		uint64_t count = 0;
+		if (type == DI_TYPE_ARRAY) {
+			count = v->array.length;
+		} else if (type != DI_TYPE_NIL) {
+			return -EINVAL;
+		}
+		if (count > 0 && sig[1] == DBUS_DICT_ENTRY_BEGIN_CHAR) {
+			// Members of a di_object can't be enumerated
+			return -ENOTSUP;
+		}
+
+		char elem[DBUS_MAXIMUM_SIGNATURE_LENGTH + 1];
+		if (end - sig - 1 > DBUS_MAXIMUM_SIGNATURE_LENGTH) {
+			return -EINVAL;
+		}
+		memcpy(elem, sig + 1, end - sig - 1);
+		elem[end - sig - 1] = '\0';
+		if (!dbus_message_iter_open_container(i, DBUS_TYPE_ARRAY, elem, &vi)) {
+			return -ENOMEM;
+		}
+		ret = count == 0 ? 0
+		                 : serialize_typed_array(&vi, v->array.elem_type, v->array.arr,
+		                                         count, sig + 1, end);
+		break;
+	case DBUS_STRUCT_BEGIN_CHAR:
+		if (type != DI_TYPE_TUPLE && type != DI_TYPE_ARRAY) {
+			return -EINVAL;
+		}
+		if (!dbus_message_iter_open_container(i, DBUS_TYPE_STRUCT, NULL, &vi)) {
+			return -ENOMEM;
+		}
+		// Fields are matched to the elements of the tuple, or the array, in order
+		const char *field = sig + 1;
+		uint64_t length = type == DI_TYPE_TUPLE ? v->tuple.length : v->array.length;
+		size_t step = type == DI_TYPE_ARRAY ? di_sizeof_type(v->array.elem_type) : 0;
+		ret = 0;
+		for (uint64_t x = 0; x < length && ret == 0; x++) {
+			const char *field_end = signature_skip(field);
+			if (*field == DBUS_STRUCT_END_CHAR || !field_end) {
+				ret = -EINVAL;
+			} else if (type == DI_TYPE_TUPLE) {
+				ret = serialize_typed_one(&vi, v->tuple.elements[x].type,
+				                          v->tuple.elements[x].value, field, field_end);
+			} else {
+				ret = serialize_typed_one(&vi, v->array.elem_type,
+				                          v->array.arr + step * x, field, field_end);
+			}
+			field = field_end;
+		}
+		if (ret == 0 && field != end - 1) {
+			ret = -EINVAL;
+		}
+		break;
+	default:
+		return -EINVAL;
+	}
+
+	// A container has been opened
+	if (ret < 0) {
+		dbus_message_iter_abandon_container(i, &vi);
+		return ret;
+	}
+	return dbus_message_iter_close_container(i, &vi) ? 0 : -ENOMEM;
+}
+
+int _dbus_serialize_struct_typed(DBusMessageIter *i, struct di_tuple t,
+                                 const char *signature) {
+	const char *sig = signature;
+	for (uint64_t x = 0; x < t.length; x++) {
+		const char *end = *sig ? signature_skip(sig) : NULL;
+		if (!end) {
+			// Too many arguments
+			return -EINVAL;
+		}
+		int ret =
+		    serialize_typed_one(i, t.elements[x].type, t.elements[x].value, sig, end);
+		if (ret < 0) {
+			return ret;
+		}
+		sig = end;
+	}
+	// Too few arguments
+	return *sig ? -EINVAL : 0;
+}
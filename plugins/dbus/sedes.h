@@ -2,6 +2,16 @@
 #include <deai/deai.h>
 #include <dbus/dbus.h>
 void _dbus_deserialize_struct(DBusMessageIter *i, void *retp);
+/// Deserialize the value `i` points to. A variant is deserialized as what's inside it.
+void _dbus_deserialize_value(DBusMessageIter *i, struct di_variant *out);
 
 /// Serialize a di_array as dbus struct
 int _dbus_serialize_struct(DBusMessageIter *i, struct di_tuple);
+
+/// Serialize a di_tuple as the arguments of a method call, following the type `signature`.
+/// Integers are converted to the integer types in the signature, if they fit.
+///
+/// @return 0 on success, -EINVAL if the values don't match the signature, -ENOTSUP for
+///         values that can't be serialized as dictionaries or variants.
+int _dbus_serialize_struct_typed(DBusMessageIter *i, struct di_tuple,
+                                 const char *signature);
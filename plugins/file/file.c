@@ -4,7 +4,11 @@
 
 /* Copyright (c) 2017, Yuxuan Shui <yshuiv7@gmail.com> */
 
+#include <errno.h>
 #include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
 #include <sys/inotify.h>
 #include <unistd.h>
 
@@ -12,6 +16,7 @@
 #include <deai/deai.h>
 #include <deai/helper.h>
 
+#include "file.h"
 #include "uthash.h"
 #include "utils.h"
 
@@ -21,81 +26,323 @@ struct di_file_watch_entry {
 	UT_hash_handle hh, hh2;
 };
 
+/// Object type: Watch
+///
+/// # Signals
+///
+/// * create, access, attrib, close-write, close-nowrite, delete, delete-self, modify,
+///   move-self, open (watch: string, path: string)
+/// * moved-from, moved-to (watch: string, path: string, cookie: uint)
+/// * events(events: [Event]) all events read in one go, in order. Each event has the
+///   `event`, `watch`, `path` and `cookie` members.
+/// * error(message: string) a watch couldn't be updated for a change of listeners
+///
+/// Repeated "modify" events of the same path are coalesced, if they are read in one go
+/// and there is no other event of that path between them.
+///
+/// Only events that have listeners are requested from the kernel. The watches are updated
+/// when signals gain their first listener, or lose their last one.
 struct di_file_watch {
 	struct di_object;
 	int fd;
 
 	struct di_file_watch_entry *byname, *bywd;
+	/// Whether there are listeners of the "events" signal
+	bool has_batch_listener;
+	/// Events that have listeners
+	uint32_t listened;
+	/// Event mask the inotify watches are added with
+	uint32_t mask;
 };
 
+/// Inotify events are read into a buffer this big, so a burst of events can be drained
+/// with a few reads.
+#define INOTIFY_BUFFER_SIZE (64 * 1024)
+
+static const struct {
+	uint32_t mask;
+	const char *name;
+} inotify_event_names[] = {
+    {IN_CREATE, "create"},
+    {IN_ACCESS, "access"},
+    {IN_ATTRIB, "attrib"},
+    {IN_CLOSE_WRITE, "close-write"},
+    {IN_CLOSE_NOWRITE, "close-nowrite"},
+    {IN_DELETE, "delete"},
+    {IN_DELETE_SELF, "delete-self"},
+    {IN_MODIFY, "modify"},
+    {IN_MOVE_SELF, "move-self"},
+    {IN_OPEN, "open"},
+    {IN_MOVED_FROM, "moved-from"},
+    {IN_MOVED_TO, "moved-to"},
+};
+
+/// A path that has had a "modify" event in the current batch, with no other events since
+struct modified_path {
+	UT_hash_handle hh;
+	size_t key_len;
+	/// Directory id followed by the path
+	char key[];
+};
+
+bool di_file_coalesce_modify(struct modified_path **modified, int id, uint32_t mask,
+                             const char *path) {
+	size_t path_len = strlen(path);
+	char key[sizeof(id) + PATH_MAX];
+	if (path_len > PATH_MAX) {
+		return false;
+	}
+	memcpy(key, &id, sizeof(id));
+	memcpy(key + sizeof(id), path, path_len);
+	size_t key_len = sizeof(id) + path_len;
+
+	struct modified_path *m = NULL;
+	HASH_FIND(hh, *modified, key, key_len, m);
+	if ((mask & ~IN_ISDIR) == IN_MODIFY) {
+		if (m) {
+			return true;
+		}
+		m = malloc(sizeof(*m) + key_len);
+		m->key_len = key_len;
+		memcpy(m->key, key, key_len);
+		HASH_ADD_KEYPTR(hh, *modified, m->key, m->key_len, m);
+	} else if (m) {
+		HASH_DEL(*modified, m);
+		free(m);
+	}
+	return false;
+}
+
+void di_file_free_modified(struct modified_path **modified) {
+	struct modified_path *m, *tmp;
+	HASH_ITER (hh, *modified, m, tmp) {
+		HASH_DEL(*modified, m);
+		free(m);
+	}
+}
+
+static struct di_object *new_event_object(const char *event, const char *watch,
+                                          const char *path, uint32_t cookie) {
+	auto e = di_new_object_with_type(struct di_object);
+	di_set_type(e, "deai.plugin.file:Event");
+	struct di_string watch_str = di_string_borrow(watch);
+	struct di_string path_str = di_string_borrow(path);
+	unsigned int cookie_ = cookie;
+	di_member_clone(e, "event", event);
+	di_member_clone(e, "watch", watch_str);
+	di_member_clone(e, "path", path_str);
+	di_member_clone(e, "cookie", cookie_);
+	return e;
+}
+
+static void batch_push(struct di_file_event_batch *batch, struct di_object *e) {
+	if (batch->events.length == batch->capacity) {
+		batch->capacity = batch->capacity ? batch->capacity * 2 : 16;
+		size_t size = sizeof(struct di_object *) * batch->capacity;
+		batch->events.arr = realloc(batch->events.arr, size);
+	}
+	struct di_object **events = batch->events.arr;
+	events[batch->events.length++] = e;
+}
+
+void di_file_emit_event(struct di_object *watch, uint32_t mask, uint32_t cookie,
+                        const char *watch_path, const char *path,
+                        struct di_file_event_batch *batch) {
+	for (size_t i = 0; i < ARRAY_SIZE(inotify_event_names); i++) {
+		if (!(mask & inotify_event_names[i].mask)) {
+			continue;
+		}
+		const char *name = inotify_event_names[i].name;
+		if (batch) {
+			auto e = new_event_object(name, watch_path, path, cookie);
+			batch_push(batch, e);
+		}
+		if (mask & (IN_MOVED_FROM | IN_MOVED_TO)) {
+			unsigned int cookie_ = cookie;
+			di_emit(watch, name, watch_path, path, cookie_);
+		} else {
+			di_emit(watch, name, watch_path, path);
+		}
+	}
+}
+
+void di_file_emit_batch(struct di_object *watch, struct di_file_event_batch *batch) {
+	batch->events.elem_type = DI_TYPE_OBJECT;
+	if (batch->events.length > 0) {
+		di_emit(watch, "events", batch->events);
+	}
+	di_free_array(batch->events);
+	batch->events = DI_ARRAY_INIT;
+	batch->capacity = 0;
+}
+
 define_object_cleanup(di_file_watch);
 static int di_file_ioev(struct di_weak_object *weak) {
 	with_object_cleanup(di_file_watch) fw = (void *)di_upgrade_weak_ref(weak);
 	DI_CHECK(fw != NULL, "got ioev events but the listener has died");
 
-	char evbuf[sizeof(struct inotify_event) + NAME_MAX + 1];
-	struct inotify_event *ev = (void *)evbuf;
-	int ret = read(fw->fd, evbuf, sizeof(evbuf));
-	ptrdiff_t off = 0;
-	while (off < ret) {
-		const char *path = "";
-		if (ev->len > 0) {
-			path = ev->name;
+	char evbuf[INOTIFY_BUFFER_SIZE]
+	    __attribute__((aligned(__alignof__(struct inotify_event))));
+	struct modified_path *modified = NULL;
+	struct di_file_event_batch batch = {0};
+
+	// Read until the queue is drained, so a burst of events only costs us one wakeup
+	while (true) {
+		ssize_t ret = read(fw->fd, evbuf, sizeof(evbuf));
+		if (ret < 0 && errno == EINTR) {
+			continue;
 		}
+		if (ret <= 0) {
+			break;
+		}
+
+		ptrdiff_t off = 0;
+		while (off < ret) {
+			const struct inotify_event *ev = (void *)(evbuf + off);
+			off += sizeof(struct inotify_event) + ev->len;
 
-		struct di_file_watch_entry *we = NULL;
-		HASH_FIND_INT(fw->bywd, &ev->wd, we);
-		if (!we) {
-			// ???
+			const char *path = "";
+			if (ev->len > 0) {
+				path = ev->name;
+			}
+
+			struct di_file_watch_entry *we = NULL;
+			HASH_FIND_INT(fw->bywd, &ev->wd, we);
+			if (!we) {
+				// Watch has been removed, or the queue overflowed
+				continue;
+			}
+			if (di_file_coalesce_modify(&modified, ev->wd, ev->mask, path)) {
+				continue;
+			}
+			di_file_emit_event((struct di_object *)fw, ev->mask, ev->cookie,
+			                   we->fname, path,
+			                   fw->has_batch_listener ? &batch : NULL);
+		}
+	}
+
+	di_file_free_modified(&modified);
+	di_file_emit_batch((struct di_object *)fw, &batch);
+	return 0;
+}
+
+/// The inotify event mask needed by the current listeners
+static uint32_t di_file_wanted_mask(struct di_file_watch *fw) {
+	if (fw->has_batch_listener) {
+		return IN_ALL_EVENTS;
+	}
+	// The mask can't be empty, this event is rare enough to not matter
+	return fw->listened ? fw->listened : IN_DELETE_SELF;
+}
+
+/// Update the event mask of all watches, if it has changed. The mask of a watch can only
+/// be changed by adding it again by its path, which fails if the file has been removed,
+/// or finds a different file if it has been replaced. Those watches are left as they
+/// are, and an "error" is emitted for each of them. The update is tried again the next
+/// time the listeners change.
+static void di_file_rearm(struct di_file_watch *fw) {
+	uint32_t mask = di_file_wanted_mask(fw);
+	if (mask == fw->mask) {
+		return;
+	}
+
+	char **errors = NULL;
+	int nerrors = 0;
+	struct di_file_watch_entry *we, *twe;
+	HASH_ITER (hh, fw->bywd, we, twe) {
+		int wd = inotify_add_watch(fw->fd, we->fname, mask);
+		if (wd == we->wd) {
 			continue;
 		}
-#define emit(m, name)                                                                    \
-	do {                                                                             \
-		if (ev->mask & (m)) {                                                    \
-			di_emit(fw, name, we->fname, path);                              \
-		}                                                                        \
-	} while (0)
-		emit(IN_CREATE, "create");
-		emit(IN_ACCESS, "access");
-		emit(IN_ATTRIB, "attrib");
-		emit(IN_CLOSE_WRITE, "close-write");
-		emit(IN_CLOSE_NOWRITE, "close-nowrite");
-		emit(IN_DELETE, "delete");
-		emit(IN_DELETE_SELF, "delete-self");
-		emit(IN_MODIFY, "modify");
-		emit(IN_MOVE_SELF, "move-self");
-		emit(IN_OPEN, "open");
-		if (ev->mask & IN_MOVED_FROM) {
-			di_emit(fw, "moved-from", we->fname, path, ev->cookie);
+
+		char *message;
+		if (wd < 0) {
+			asprintf(&message, "Failed to update the watch of %s: %s", we->fname,
+			         strerror(errno));
+		} else {
+			// The path now refers to a different file. Don't follow it there, and
+			// don't touch the watch if it's one of ours.
+			struct di_file_watch_entry *other = NULL;
+			HASH_FIND_INT(fw->bywd, &wd, other);
+			if (!other) {
+				inotify_rm_watch(fw->fd, wd);
+			}
+			asprintf(&message, "Failed to update the watch of %s: file was replaced",
+			         we->fname);
 		}
-		if (ev->mask & IN_MOVED_TO) {
-			di_emit(fw, "moved-to", we->fname, path, ev->cookie);
+		errors = realloc(errors, sizeof(char *) * (nerrors + 1));
+		errors[nerrors++] = message;
+	}
+	if (nerrors == 0) {
+		fw->mask = mask;
+	}
+
+	// Emit after we are done with the watches, the listeners could change them
+	for (int i = 0; i < nerrors; i++) {
+		di_emit(fw, "error", di_string_borrow(errors[i]));
+		free(errors[i]);
+	}
+	free(errors);
+}
+
+static uint32_t event_mask_of(struct di_string signal) {
+	for (size_t i = 0; i < ARRAY_SIZE(inotify_event_names); i++) {
+		const char *name = inotify_event_names[i].name;
+		if (signal.length == strlen(name) &&
+		    strncmp(signal.data, name, signal.length) == 0) {
+			return inotify_event_names[i].mask;
 		}
-#undef emit
-		off += sizeof(struct inotify_event) + ev->len;
-		ev = (void *)(evbuf + off);
 	}
 	return 0;
 }
 
+static void di_file_new_signal(struct di_file_watch *fw, struct di_string signal) {
+	fw->listened |= event_mask_of(signal);
+	di_file_rearm(fw);
+}
+
+static void di_file_del_signal(struct di_file_watch *fw, struct di_string signal) {
+	fw->listened &= ~event_mask_of(signal);
+	di_file_rearm(fw);
+}
+
+static void di_file_new_batch_signal(struct di_file_watch *fw) {
+	fw->has_batch_listener = true;
+	di_file_rearm(fw);
+}
+
+static void di_file_del_batch_signal(struct di_file_watch *fw) {
+	fw->has_batch_listener = false;
+	di_file_rearm(fw);
+}
+
 static int di_file_add_watch(struct di_file_watch *fw, struct di_string path) {
 	if (!path.data) {
 		return -EINVAL;
 	}
 
 	char *path_str = di_string_to_chars_alloc(path);
+	int wd = inotify_add_watch(fw->fd, path_str, fw->mask);
+	if (wd < 0) {
+		free(path_str);
+		return -errno;
+	}
 
-	int ret = inotify_add_watch(fw->fd, path_str, IN_ALL_EVENTS);
-	if (ret >= 0) {
-		auto we = tmalloc(struct di_file_watch_entry, 1);
-		we->wd = ret;
-		we->fname = path_str;
-
-		HASH_ADD_INT(fw->bywd, wd, we);
-		HASH_ADD_KEYPTR(hh2, fw->byname, we->fname, path.length, we);
-		ret = 0;
+	struct di_file_watch_entry *we = NULL;
+	HASH_FIND_INT(fw->bywd, &wd, we);
+	if (we) {
+		// Already watched, maybe by a different path
+		free(path_str);
+		return -EEXIST;
 	}
-	return ret;
+
+	we = tmalloc(struct di_file_watch_entry, 1);
+	we->wd = wd;
+	we->fname = path_str;
+
+	HASH_ADD_INT(fw->bywd, wd, we);
+	HASH_ADD_KEYPTR(hh2, fw->byname, we->fname, path.length, we);
+	return 0;
 }
 
 static int di_file_add_many_watch(struct di_file_watch *fw, struct di_array paths) {
@@ -173,11 +420,16 @@ static struct di_object *di_file_new_watch(struct di_module *f, struct di_array
 	auto fw = di_new_object_with_type(struct di_file_watch);
 	di_set_type((void *)fw, "deai.plugin.file:Watch");
 	fw->fd = ifd;
+	fw->mask = di_file_wanted_mask(fw);
 	di_set_object_dtor((void *)fw, (void *)stop_file_watcher);
 
 	di_method(fw, "add", di_file_add_many_watch, struct di_array);
 	di_method(fw, "add_one", di_file_add_watch, struct di_string);
 	di_method(fw, "remove", di_file_rm_watch, struct di_string);
+	di_method(fw, "__new_signal", di_file_new_signal, struct di_string);
+	di_method(fw, "__del_signal", di_file_del_signal, struct di_string);
+	di_method(fw, "__new_signal_events", di_file_new_batch_signal);
+	di_method(fw, "__del_signal_events", di_file_del_batch_signal);
 	di_mgetm(f, event, di_new_error("Can't find event module"));
 
 	struct di_object *fdevent = NULL;
@@ -199,6 +451,9 @@ static struct di_object *di_file_new_watch(struct di_module *f, struct di_array
 DEAI_PLUGIN_ENTRY_POINT(di) {
 	auto fm = di_new_module(di);
 	di_method(fm, "watch", di_file_new_watch, struct di_array);
+	di_method(fm, "watch_recursive", di_file_new_recursive_watch, struct di_string);
+	di_method(fm, "tail", di_file_new_tail, struct di_string);
+	di_method(fm, "read_async", di_file_read_async, struct di_string);
 	di_register_module(di, di_string_borrow("file"), &fm);
 	return 0;
 }
@@ -0,0 +1,40 @@
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/. */
+
+/* Copyright (c) 2017, Yuxuan Shui <yshuiv7@gmail.com> */
+
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include <deai/deai.h>
+
+/// Events read in one go by a watch, to be emitted in one "events" signal
+struct di_file_event_batch {
+	struct di_array events;
+	size_t capacity;
+};
+
+struct modified_path;
+
+/// Returns true if an event with `mask`, for `path` in the directory identified by `id`,
+/// is a repeated "modify" event that should be dropped. Otherwise updates the set of
+/// modified paths.
+bool di_file_coalesce_modify(struct modified_path **modified, int id, uint32_t mask,
+                             const char *path);
+void di_file_free_modified(struct modified_path **modified);
+
+/// Emit the signals for an event with inotify event mask `mask`. `batch` can be NULL if
+/// no one is listening to the "events" signal.
+void di_file_emit_event(struct di_object *watch, uint32_t mask, uint32_t cookie,
+                        const char *watch_path, const char *path,
+                        struct di_file_event_batch *batch);
+/// Emit the "events" signal with the events in `batch`, and empty it
+void di_file_emit_batch(struct di_object *watch, struct di_file_event_batch *batch);
+
+struct di_object *di_file_new_recursive_watch(struct di_module *f, struct di_string path);
+struct di_object *di_file_new_tail(struct di_module *f, struct di_string path);
+struct di_object *di_file_read_async(struct di_module *f, struct di_string path);
@@ -0,0 +1,156 @@
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/. */
+
+/* Copyright (c) 2017, Yuxuan Shui <yshuiv7@gmail.com> */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <deai/builtins/event.h>
+#include <deai/deai.h>
+#include <deai/helper.h>
+
+#include "byte_buf.h"
+#include "file.h"
+#include "utils.h"
+
+#define READ_CHUNK_SIZE (64 * 1024)
+
+/// Object type: ReadRequest
+///
+/// The file is read in a separate thread, so reading a slow file doesn't block the event
+/// loop. The request has to be kept alive until it completes, dropping it before that
+/// waits for the read to finish.
+///
+/// # Signals
+///
+/// * done(contents: string) the whole content of the file
+/// * error(message: string) the file couldn't be read
+struct di_file_read_request {
+	struct di_object;
+	char *path;
+	pthread_t thread;
+	bool thread_running;
+	/// Read end of the pipe, it's closed by the thread when it finishes
+	int notify_fd;
+	/// Write end of the pipe, owned by the thread
+	int notify_wfd;
+
+	// Written by the thread, only accessed from the main thread after it has finished
+	struct byte_buf contents;
+	int error;
+};
+
+static void *read_thread(void *arg) {
+	struct di_file_read_request *r = arg;
+	int fd = open(r->path, O_RDONLY | O_CLOEXEC);
+	if (fd < 0) {
+		r->error = errno;
+	} else {
+		// procfs and sysfs files report a size of 0, so just read until EOF
+		ssize_t ret;
+		while ((ret = read(fd, byte_buf_reserve(&r->contents, READ_CHUNK_SIZE),
+		                   READ_CHUNK_SIZE)) != 0) {
+			if (ret < 0) {
+				if (errno == EINTR) {
+					continue;
+				}
+				r->error = errno;
+				break;
+			}
+			byte_buf_commit(&r->contents, ret);
+		}
+		close(fd);
+	}
+
+	// Wakes up the main thread
+	close(r->notify_wfd);
+	return NULL;
+}
+
+static void read_request_join(struct di_file_read_request *r) {
+	if (r->thread_running) {
+		pthread_join(r->thread, NULL);
+		r->thread_running = false;
+	}
+}
+
+define_object_cleanup(di_file_read_request);
+static int di_file_read_ioev(struct di_weak_object *weak) {
+	// Listeners could drop the last reference to the request
+	with_object_cleanup(di_file_read_request) r = (void *)di_upgrade_weak_ref(weak);
+	DI_CHECK(r != NULL, "got ioev events but the listener has died");
+
+	read_request_join(r);
+
+	// Nothing more will happen on the pipe
+	di_remove_member_raw((void *)r, di_string_borrow("__fd_event_read_listen_handle"));
+	di_remove_member_raw((void *)r, di_string_borrow("__fd_event"));
+	close(r->notify_fd);
+	r->notify_fd = -1;
+
+	if (r->error != 0) {
+		char *message;
+		asprintf(&message, "Failed to read %s: %s", r->path, strerror(r->error));
+		di_emit(r, "error", di_string_borrow(message));
+		free(message);
+	} else {
+		struct di_string contents = {byte_buf_data(&r->contents),
+		                             byte_buf_len(&r->contents)};
+		di_emit(r, "done", contents);
+	}
+	byte_buf_free(&r->contents);
+	return 0;
+}
+
+static void stop_read_request(struct di_file_read_request *r) {
+	read_request_join(r);
+	if (r->notify_fd >= 0) {
+		close(r->notify_fd);
+	}
+	byte_buf_free(&r->contents);
+	free(r->path);
+}
+
+struct di_object *di_file_read_async(struct di_module *f, struct di_string path) {
+	if (path.length == 0) {
+		return di_new_error("Path can't be empty");
+	}
+	di_mgetm(f, event, di_new_error("Can't find event module"));
+
+	int fds[2];
+	if (pipe2(fds, O_CLOEXEC | O_NONBLOCK) != 0) {
+		return di_new_error("Failed to create pipe");
+	}
+
+	auto r = di_new_object_with_type(struct di_file_read_request);
+	di_set_type((void *)r, "deai.plugin.file:ReadRequest");
+	r->path = di_string_to_chars_alloc(path);
+	r->notify_fd = fds[0];
+	r->notify_wfd = fds[1];
+	di_set_object_dtor((void *)r, (void *)stop_read_request);
+
+	struct di_object *fdevent = NULL;
+	DI_CHECK_OK(di_callr(eventm, "fdevent", fdevent, r->notify_fd, IOEV_READ));
+
+	di_weak_object_with_cleanup tmpo = di_weakly_ref_object((struct di_object *)r);
+	di_closure_with_cleanup cl = di_closure(di_file_read_ioev, (tmpo));
+	auto listen_handle = di_listen_to(fdevent, di_string_borrow("read"), (void *)cl);
+
+	di_member(r, "__fd_event", fdevent);
+	di_member(r, "__fd_event_read_listen_handle", listen_handle);
+
+	int ret = pthread_create(&r->thread, NULL, read_thread, r);
+	if (ret != 0) {
+		close(r->notify_wfd);
+		di_unref_object((void *)r);
+		return di_new_error("Failed to start reader thread: %s", strerror(ret));
+	}
+	r->thread_running = true;
+	return (void *)r;
+}
@@ -0,0 +1,648 @@
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/. */
+
+/* Copyright (c) 2017, Yuxuan Shui <yshuiv7@gmail.com> */
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/inotify.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#ifdef __linux__
+#include <sys/fanotify.h>
+#endif
+
+#include <deai/builtins/event.h>
+#include <deai/deai.h>
+#include <deai/helper.h>
+
+#include "file.h"
+#include "list.h"
+#include "uthash.h"
+#include "utils.h"
+
+/// Events reported by recursive watches. Access and open events are left out, they are
+/// too noisy for a whole tree.
+#define RECURSIVE_WATCH_EVENTS                                                           \
+	(IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO | IN_MODIFY | IN_ATTRIB |   \
+	 IN_CLOSE_WRITE | IN_DELETE_SELF | IN_MOVE_SELF)
+
+#define EVENT_BUFFER_SIZE (64 * 1024)
+
+/// A watched directory. Only the name of the directory in its parent is stored, its path
+/// is found by following the parent links.
+struct watch_dir {
+	int wd;
+	/// NULL for the root directory, and for directories that have been moved away
+	struct watch_dir *parent;
+	/// Set while the directory is moved away
+	struct pending_move *pending_move;
+	char *name;
+	struct list_head children;
+	struct list_head siblings;
+	UT_hash_handle hh;
+};
+
+/// A directory that has been moved away, it will be put back if it's moved to somewhere
+/// we are watching
+struct pending_move {
+	uint32_t cookie;
+	struct watch_dir *dir;
+	UT_hash_handle hh;
+};
+
+/// Cached mapping from a directory's file handle to its path
+struct dir_handle {
+	UT_hash_handle hh;
+	/// Path relative to the root, NULL if the directory is not under the root
+	char *path;
+	size_t key_len;
+	char key[];
+};
+
+/// Object type: RecursiveWatch
+///
+/// Watch a directory and all directories under it. New directories are watched as they
+/// appear, and watches are removed when directories are deleted or moved away.
+///
+/// Where possible, the whole filesystem is watched with a single fanotify mark, and
+/// events outside of the directory are filtered out. Otherwise every directory gets an
+/// inotify watch.
+///
+/// Emits the same signals as Watch, except "access", "open" and "close-nowrite". `watch`
+/// is the watched directory, and `path` is the path relative to it.
+struct di_file_recursive_watch {
+	struct di_object;
+	int fd;
+	char *root_path;
+	bool has_batch_listener;
+	bool use_fanotify;
+
+	// For inotify
+	struct watch_dir *root;
+	struct watch_dir *bywd;
+	struct pending_move *pending_moves;
+
+	// For fanotify
+	/// A fd for the root, to open directories by file handle with
+	int root_fd;
+	/// Canonical path of the root
+	char *root_realpath;
+	/// File handle of the root, the root can't be opened by handle once it's deleted
+	struct file_handle *root_handle;
+	struct dir_handle *dir_handles;
+	size_t ndir_handles;
+};
+
+/// Write the path of `d` relative to the root into `buf`.
+///
+/// @return the length of the path, or -1 if it doesn't fit, or if `d` has been moved
+/// away from the tree.
+static int watch_dir_path(const struct di_file_recursive_watch *rw,
+                          const struct watch_dir *d, char *buf, size_t size) {
+	if (d == rw->root) {
+		if (size == 0) {
+			return -1;
+		}
+		buf[0] = '\0';
+		return 0;
+	}
+	if (d->parent == NULL) {
+		return -1;
+	}
+	int len = watch_dir_path(rw, d->parent, buf, size);
+	if (len < 0) {
+		return -1;
+	}
+	int ret = snprintf(buf + len, size - len, "%s%s", len ? "/" : "", d->name);
+	if (ret < 0 || (size_t)ret >= size - len) {
+		return -1;
+	}
+	return len + ret;
+}
+
+/// Join `dir` and `name` into `buf`, either can be empty
+static bool join_path(char *buf, size_t size, const char *dir, const char *name) {
+	const char *sep = dir[0] && name[0] ? "/" : "";
+	int ret = snprintf(buf, size, "%s%s%s", dir, sep, name);
+	return ret >= 0 && (size_t)ret < size;
+}
+
+static void
+remove_dir(struct di_file_recursive_watch *rw, struct watch_dir *d, bool rm_watch) {
+	struct watch_dir *child, *tmp;
+	list_for_each_entry_safe (child, tmp, &d->children, siblings) {
+		remove_dir(rw, child, true);
+	}
+	if (rm_watch) {
+		inotify_rm_watch(rw->fd, d->wd);
+	}
+	HASH_DEL(rw->bywd, d);
+	list_del(&d->siblings);
+	if (rw->root == d) {
+		rw->root = NULL;
+	}
+	free(d->name);
+	free(d);
+}
+
+static struct watch_dir *find_child(struct watch_dir *d, const char *name) {
+	struct watch_dir *child;
+	list_for_each_entry (child, &d->children, siblings) {
+		if (strcmp(child->name, name) == 0) {
+			return child;
+		}
+	}
+	return NULL;
+}
+
+static void add_dir(struct di_file_recursive_watch *rw, struct watch_dir *parent,
+                    const char *name, struct di_file_event_batch *batch,
+                    bool report_content);
+
+/// Watch the subdirectories of `d`. If `report_content` is true, "create" events are
+/// emitted for everything found, because they could have been created before the watch
+/// was added.
+static void add_children(struct di_file_recursive_watch *rw, struct watch_dir *d,
+                         const char *rel_path, struct di_file_event_batch *batch,
+                         bool report_content) {
+	char full_path[PATH_MAX];
+	if (!join_path(full_path, sizeof(full_path), rw->root_path, rel_path)) {
+		return;
+	}
+	DIR *dir = opendir(full_path);
+	if (dir == NULL) {
+		return;
+	}
+
+	struct dirent *ent;
+	while ((ent = readdir(dir)) != NULL) {
+		if (strcmp(ent->d_name, ".") == 0 || strcmp(ent->d_name, "..") == 0) {
+			continue;
+		}
+		bool is_dir = ent->d_type == DT_DIR;
+		if (ent->d_type == DT_UNKNOWN) {
+			struct stat st;
+			int flags = AT_SYMLINK_NOFOLLOW;
+			is_dir = fstatat(dirfd(dir), ent->d_name, &st, flags) == 0 &&
+			         S_ISDIR(st.st_mode);
+		}
+		if (report_content) {
+			char path[PATH_MAX];
+			if (join_path(path, sizeof(path), rel_path, ent->d_name)) {
+				di_file_emit_event((struct di_object *)rw,
+				                   IN_CREATE | (is_dir ? IN_ISDIR : 0), 0,
+				                   rw->root_path, path, batch);
+			}
+		}
+		if (is_dir) {
+			add_dir(rw, d, ent->d_name, batch, report_content);
+		}
+	}
+	closedir(dir);
+}
+
+/// Watch directory `name` in `parent`, and everything under it
+static void add_dir(struct di_file_recursive_watch *rw, struct watch_dir *parent,
+                    const char *name, struct di_file_event_batch *batch,
+                    bool report_content) {
+	char parent_path[PATH_MAX], rel_path[PATH_MAX], full_path[PATH_MAX];
+	if (watch_dir_path(rw, parent, parent_path, sizeof(parent_path)) < 0 ||
+	    !join_path(rel_path, sizeof(rel_path), parent_path, name) ||
+	    !join_path(full_path, sizeof(full_path), rw->root_path, rel_path)) {
+		return;
+	}
+
+	int wd = inotify_add_watch(rw->fd, full_path,
+	                           RECURSIVE_WATCH_EVENTS | IN_ONLYDIR | IN_DONT_FOLLOW);
+	if (wd < 0) {
+		return;
+	}
+	struct watch_dir *d = NULL;
+	HASH_FIND_INT(rw->bywd, &wd, d);
+	if (d != NULL) {
+		// Already watched, e.g. the directory is bind mounted inside itself
+		return;
+	}
+
+	d = tmalloc(struct watch_dir, 1);
+	d->wd = wd;
+	d->parent = parent;
+	d->name = strdup(name);
+	INIT_LIST_HEAD(&d->children);
+	list_add(&d->siblings, &parent->children);
+	HASH_ADD_INT(rw->bywd, wd, d);
+	add_children(rw, d, rel_path, batch, report_content);
+}
+
+/// Update the watched directories after an event `mask` in directory `d`
+static void inotify_update_tree(struct di_file_recursive_watch *rw, struct watch_dir *d,
+                                uint32_t mask, uint32_t cookie, const char *name,
+                                struct di_file_event_batch *batch) {
+	if ((mask & IN_IGNORED) != 0) {
+		// The directory is gone. If it was moved away first, e.g. `mv dir /tmp && rm
+		// -r /tmp/dir`, it's also waiting in pending_moves
+		if (d->pending_move) {
+			HASH_DEL(rw->pending_moves, d->pending_move);
+			free(d->pending_move);
+		}
+		remove_dir(rw, d, false);
+		return;
+	}
+	if ((mask & IN_ISDIR) == 0) {
+		return;
+	}
+	if (mask & IN_CREATE) {
+		add_dir(rw, d, name, batch, true);
+	} else if (mask & IN_MOVED_FROM) {
+		auto child = find_child(d, name);
+		if (child) {
+			list_del(&child->siblings);
+			INIT_LIST_HEAD(&child->siblings);
+			child->parent = NULL;
+			auto pm = tmalloc(struct pending_move, 1);
+			pm->cookie = cookie;
+			pm->dir = child;
+			child->pending_move = pm;
+			HASH_ADD_INT(rw->pending_moves, cookie, pm);
+		}
+	} else if (mask & IN_MOVED_TO) {
+		struct pending_move *pm = NULL;
+		HASH_FIND_INT(rw->pending_moves, &cookie, pm);
+		if (pm) {
+			// Moved within the tree, just update the name and the parent
+			HASH_DEL(rw->pending_moves, pm);
+			free(pm->dir->name);
+			pm->dir->name = strdup(name);
+			pm->dir->parent = d;
+			pm->dir->pending_move = NULL;
+			list_add(&pm->dir->siblings, &d->children);
+			free(pm);
+		} else {
+			add_dir(rw, d, name, batch, false);
+		}
+	}
+}
+
+static void inotify_handle_events(struct di_file_recursive_watch *rw,
+                                  struct di_file_event_batch *batch) {
+	char evbuf[EVENT_BUFFER_SIZE]
+	    __attribute__((aligned(__alignof__(struct inotify_event))));
+	struct modified_path *modified = NULL;
+	while (true) {
+		ssize_t ret = read(rw->fd, evbuf, sizeof(evbuf));
+		if (ret < 0 && errno == EINTR) {
+			continue;
+		}
+		if (ret <= 0) {
+			break;
+		}
+
+		ptrdiff_t off = 0;
+		while (off < ret) {
+			const struct inotify_event *ev = (void *)(evbuf + off);
+			off += sizeof(struct inotify_event) + ev->len;
+
+			struct watch_dir *d = NULL;
+			HASH_FIND_INT(rw->bywd, &ev->wd, d);
+			if (d == NULL) {
+				continue;
+			}
+
+			// Events from directories that have been moved away are dropped, they
+			// are no longer in the tree
+			const char *name = ev->len > 0 ? ev->name : "";
+			char dir_path[PATH_MAX], path[PATH_MAX];
+			if (watch_dir_path(rw, d, dir_path, sizeof(dir_path)) >= 0 &&
+			    join_path(path, sizeof(path), dir_path, name) &&
+			    !di_file_coalesce_modify(&modified, ev->wd, ev->mask, name)) {
+				di_file_emit_event((void *)rw, ev->mask, ev->cookie,
+				                   rw->root_path, path, batch);
+			}
+			inotify_update_tree(rw, d, ev->mask, ev->cookie, name, batch);
+		}
+	}
+	di_file_free_modified(&modified);
+
+	// Directories moved away from the tree
+	struct pending_move *pm, *tmp;
+	HASH_ITER (hh, rw->pending_moves, pm, tmp) {
+		HASH_DEL(rw->pending_moves, pm);
+		remove_dir(rw, pm->dir, true);
+		free(pm);
+	}
+}
+
+#ifdef FAN_REPORT_DFID_NAME
+static void clear_dir_handles(struct di_file_recursive_watch *rw) {
+	struct dir_handle *h, *tmp;
+	HASH_ITER (hh, rw->dir_handles, h, tmp) {
+		HASH_DEL(rw->dir_handles, h);
+		free(h->path);
+		free(h);
+	}
+	rw->ndir_handles = 0;
+}
+
+/// Find the path, relative to the root, of the directory with file handle `fh`.
+///
+/// @return the path, or NULL if the directory is not under the root.
+static const char *
+resolve_dir_handle(struct di_file_recursive_watch *rw, struct file_handle *fh) {
+	size_t key_len = sizeof(*fh) + fh->handle_bytes;
+	if (rw->root_handle && key_len == sizeof(*fh) + rw->root_handle->handle_bytes &&
+	    memcmp(fh, rw->root_handle, key_len) == 0) {
+		return "";
+	}
+
+	struct dir_handle *h = NULL;
+	HASH_FIND(hh, rw->dir_handles, fh, key_len, h);
+	if (h) {
+		return h->path;
+	}
+
+	if (rw->ndir_handles >= 16384) {
+		clear_dir_handles(rw);
+	}
+	h = malloc(sizeof(*h) + key_len);
+	h->key_len = key_len;
+	h->path = NULL;
+	memcpy(h->key, fh, key_len);
+	HASH_ADD_KEYPTR(hh, rw->dir_handles, h->key, h->key_len, h);
+	rw->ndir_handles++;
+
+	int fd = open_by_handle_at(rw->root_fd, fh, O_PATH | O_CLOEXEC);
+	if (fd < 0) {
+		return NULL;
+	}
+	char proc_path[64], path[PATH_MAX];
+	snprintf(proc_path, sizeof(proc_path), "/proc/self/fd/%d", fd);
+	ssize_t len = readlink(proc_path, path, sizeof(path) - 1);
+	close(fd);
+	if (len < 0) {
+		return NULL;
+	}
+	path[len] = '\0';
+
+	size_t root_len = strlen(rw->root_realpath);
+	if (strncmp(path, rw->root_realpath, root_len) != 0) {
+		return NULL;
+	}
+	if (path[root_len] == '/') {
+		h->path = strdup(path + root_len + 1);
+	} else if (path[root_len] == '\0') {
+		h->path = strdup("");
+	}
+	return h->path;
+}
+
+/// Find the directory, relative to the root, and the name in it, an fanotify event is
+/// about.
+///
+/// @return false if the event is not under the root
+static bool fanotify_event_target(struct di_file_recursive_watch *rw,
+                                  struct fanotify_event_metadata *meta, const char **dir,
+                                  const char **name) {
+	size_t off = meta->metadata_len;
+	while (off + sizeof(struct fanotify_event_info_fid) <= meta->event_len) {
+		struct fanotify_event_info_fid *fid = (void *)((char *)meta + off);
+		if (fid->hdr.len == 0) {
+			break;
+		}
+		off += fid->hdr.len;
+		struct file_handle *fh = (void *)fid->handle;
+		if (fid->hdr.info_type == FAN_EVENT_INFO_TYPE_DFID_NAME) {
+			*name = (const char *)fh->f_handle + fh->handle_bytes;
+		} else if (fid->hdr.info_type == FAN_EVENT_INFO_TYPE_DFID) {
+			// Events on a directory itself, DELETE_SELF and MOVE_SELF. A deleted
+			// directory can only be resolved if it's the root, or if its path is
+			// still cached.
+			*name = "";
+		} else {
+			continue;
+		}
+		*dir = resolve_dir_handle(rw, fh);
+		return *dir != NULL;
+	}
+	return false;
+}
+
+static void fanotify_handle_events(struct di_file_recursive_watch *rw,
+                                   struct di_file_event_batch *batch) {
+	char buf[EVENT_BUFFER_SIZE]
+	    __attribute__((aligned(__alignof__(struct fanotify_event_metadata))));
+	struct modified_path *modified = NULL;
+	while (true) {
+		ssize_t len = read(rw->fd, buf, sizeof(buf));
+		if (len < 0 && errno == EINTR) {
+			continue;
+		}
+		if (len <= 0) {
+			break;
+		}
+
+		struct fanotify_event_metadata *meta = (void *)buf;
+		for (; FAN_EVENT_OK(meta, len); meta = FAN_EVENT_NEXT(meta, len)) {
+			if (meta->fd >= 0) {
+				close(meta->fd);
+			}
+			if (meta->vers != FANOTIFY_METADATA_VERSION) {
+				break;
+			}
+
+			const char *dir, *name;
+			if (!fanotify_event_target(rw, meta, &dir, &name)) {
+				// Not under the root
+				continue;
+			}
+
+			if (strcmp(name, ".") == 0) {
+				name = "";
+			}
+			char path[PATH_MAX];
+			if (join_path(path, sizeof(path), dir, name) &&
+			    !di_file_coalesce_modify(&modified, 0, meta->mask, path)) {
+				di_file_emit_event((struct di_object *)rw, meta->mask, 0,
+				                   rw->root_path, path, batch);
+			}
+			if ((meta->mask & FAN_ONDIR) &&
+			    (meta->mask & (FAN_MOVED_FROM | FAN_MOVED_TO | FAN_DELETE))) {
+				// Directories have moved, cached paths might be stale
+				clear_dir_handles(rw);
+			}
+		}
+	}
+	di_file_free_modified(&modified);
+}
+
+/// Get the file handle of `path`, or NULL if it doesn't have one
+static struct file_handle *get_file_handle(const char *path) {
+	struct file_handle *fh = malloc(sizeof(*fh) + MAX_HANDLE_SZ);
+	fh->handle_bytes = MAX_HANDLE_SZ;
+	int mount_id;
+	if (name_to_handle_at(AT_FDCWD, path, fh, &mount_id, 0) != 0) {
+		free(fh);
+		return NULL;
+	}
+	return fh;
+}
+
+/// Try to watch the filesystem `root` is on with fanotify.
+///
+/// @return the fanotify fd, or -1 if it's not possible, usually because we don't have
+/// the privileges.
+static int fanotify_setup(const char *root) {
+	unsigned int init_flags =
+	    FAN_CLASS_NOTIF | FAN_REPORT_DFID_NAME | FAN_CLOEXEC | FAN_NONBLOCK;
+	int fd = fanotify_init(init_flags, O_RDONLY);
+	if (fd < 0) {
+		return -1;
+	}
+	uint64_t mask = RECURSIVE_WATCH_EVENTS | FAN_ONDIR;
+	unsigned int flags = FAN_MARK_ADD | FAN_MARK_FILESYSTEM;
+	if (fanotify_mark(fd, flags, mask, AT_FDCWD, root) != 0) {
+		close(fd);
+		return -1;
+	}
+	return fd;
+}
+#endif
+
+define_object_cleanup(di_file_recursive_watch);
+static int di_file_recursive_ioev(struct di_weak_object *weak) {
+	with_object_cleanup(di_file_recursive_watch) rw =
+	    (void *)di_upgrade_weak_ref(weak);
+	DI_CHECK(rw != NULL, "got ioev events but the listener has died");
+
+	struct di_file_event_batch batch = {0};
+	auto batch_ptr = rw->has_batch_listener ? &batch : NULL;
+#ifdef FAN_REPORT_DFID_NAME
+	if (rw->use_fanotify) {
+		fanotify_handle_events(rw, batch_ptr);
+	} else
+#endif
+	{
+		inotify_handle_events(rw, batch_ptr);
+	}
+	di_file_emit_batch((struct di_object *)rw, &batch);
+	return 0;
+}
+
+static void di_file_recursive_new_batch_signal(struct di_file_recursive_watch *rw) {
+	rw->has_batch_listener = true;
+}
+
+static void di_file_recursive_del_batch_signal(struct di_file_recursive_watch *rw) {
+	rw->has_batch_listener = false;
+}
+
+/// Which mechanism is used for watching, "fanotify" or "inotify"
+static const char *di_file_recursive_get_backend(struct di_file_recursive_watch *rw) {
+	return rw->use_fanotify ? "fanotify" : "inotify";
+}
+
+static void stop_recursive_watch(struct di_file_recursive_watch *rw) {
+	struct watch_dir *d, *tmp;
+	HASH_ITER (hh, rw->bywd, d, tmp) {
+		HASH_DEL(rw->bywd, d);
+		free(d->name);
+		free(d);
+	}
+	rw->root = NULL;
+#ifdef FAN_REPORT_DFID_NAME
+	clear_dir_handles(rw);
+#endif
+	if (rw->root_fd >= 0) {
+		close(rw->root_fd);
+	}
+	if (rw->fd >= 0) {
+		close(rw->fd);
+	}
+	free(rw->root_path);
+	free(rw->root_realpath);
+	free(rw->root_handle);
+}
+
+struct di_object *
+di_file_new_recursive_watch(struct di_module *f, struct di_string path) {
+	if (path.length == 0) {
+		return di_new_error("Path can't be empty");
+	}
+	di_mgetm(f, event, di_new_error("Can't find event module"));
+	char *root_path = di_string_to_chars_alloc(path);
+	struct stat st;
+	if (stat(root_path, &st) != 0 || !S_ISDIR(st.st_mode)) {
+		free(root_path);
+		return di_new_error("%.*s is not a directory", (int)path.length,
+		                    path.data);
+	}
+
+	auto rw = di_new_object_with_type(struct di_file_recursive_watch);
+	di_set_type((void *)rw, "deai.plugin.file:RecursiveWatch");
+	rw->root_path = root_path;
+	rw->root_fd = -1;
+	rw->fd = -1;
+	di_set_object_dtor((void *)rw, (void *)stop_recursive_watch);
+
+#ifdef FAN_REPORT_DFID_NAME
+	rw->fd = fanotify_setup(root_path);
+	if (rw->fd >= 0) {
+		rw->use_fanotify = true;
+		rw->root_realpath = realpath(root_path, NULL);
+		rw->root_fd = open(root_path, O_PATH | O_DIRECTORY | O_CLOEXEC);
+		rw->root_handle = get_file_handle(root_path);
+		if (rw->root_realpath == NULL || rw->root_fd < 0 ||
+		    rw->root_handle == NULL) {
+			rw->use_fanotify = false;
+			close(rw->fd);
+			rw->fd = -1;
+		}
+	}
+#endif
+	if (rw->fd < 0) {
+		rw->fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+		if (rw->fd < 0) {
+			di_unref_object((void *)rw);
+			return di_new_error("Failed to create inotify file descriptor");
+		}
+	}
+
+	if (!rw->use_fanotify) {
+		int wd = inotify_add_watch(rw->fd, root_path,
+		                           RECURSIVE_WATCH_EVENTS | IN_ONLYDIR);
+		if (wd < 0) {
+			di_unref_object((void *)rw);
+			return di_new_error("Failed to watch %.*s", (int)path.length,
+			                    path.data);
+		}
+		auto root = tmalloc(struct watch_dir, 1);
+		root->wd = wd;
+		root->name = strdup("");
+		INIT_LIST_HEAD(&root->children);
+		INIT_LIST_HEAD(&root->siblings);
+		HASH_ADD_INT(rw->bywd, wd, root);
+		rw->root = root;
+		add_children(rw, root, "", NULL, false);
+	}
+
+	di_method(rw, "__new_signal_events", di_file_recursive_new_batch_signal);
+	di_method(rw, "__del_signal_events", di_file_recursive_del_batch_signal);
+	di_getter(rw, backend, di_file_recursive_get_backend);
+
+	struct di_object *fdevent = NULL;
+	DI_CHECK_OK(di_callr(eventm, "fdevent", fdevent, rw->fd, IOEV_READ));
+
+	di_weak_object_with_cleanup tmpo = di_weakly_ref_object((struct di_object *)rw);
+	di_closure_with_cleanup cl = di_closure(di_file_recursive_ioev, (tmpo));
+	auto listen_handle = di_listen_to(fdevent, di_string_borrow("read"), (void *)cl);
+
+	di_member(rw, "__fd_event", fdevent);
+	di_member(rw, "__fd_event_read_listen_handle", listen_handle);
+	return (void *)rw;
+}
@@ -0,0 +1,257 @@
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/. */
+
+/* Copyright (c) 2017, Yuxuan Shui <yshuiv7@gmail.com> */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/inotify.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <deai/builtins/event.h>
+#include <deai/deai.h>
+#include <deai/helper.h>
+
+#include "byte_buf.h"
+#include "file.h"
+#include "utils.h"
+
+#define TAIL_READ_SIZE (16 * 1024)
+#define TAIL_EVENT_BUFFER_SIZE (4 * 1024)
+
+/// Object type: Tail
+///
+/// Follow a file as it grows, like `tail -F`. Only lines written after the Tail is created
+/// are reported. The file doesn't have to exist yet, it will be picked up when it's
+/// created.
+///
+/// When the file is replaced, by renaming or removing it and creating a new file in its
+/// place, whatever is left in the old file is read, then the new file is read from the
+/// beginning.
+///
+/// # Signals
+///
+/// * line(line: string) a line appended to the file, without the line break. A string
+///   passed to the handler is only valid during the call.
+/// * rotated() the file has been replaced
+/// * truncated() the file has been truncated, it's read again from the beginning
+struct di_file_tail {
+	struct di_object;
+	/// inotify file descriptor
+	int ifd;
+	/// The file being followed, -1 if it doesn't exist
+	int fd;
+	/// Watch of the file, for modifications
+	int file_wd;
+	/// Watch of the parent directory, for replacement of the file
+	int dir_wd;
+	char *path;
+	/// Name of the file in its parent directory, points into `path`
+	const char *name;
+	/// Content after the last line break
+	struct byte_buf buf;
+};
+
+static void tail_read(struct di_file_tail *t) {
+	if (t->fd < 0) {
+		return;
+	}
+
+	struct stat st;
+	off_t offset = lseek(t->fd, 0, SEEK_CUR);
+	if (fstat(t->fd, &st) == 0 && S_ISREG(st.st_mode) && offset > st.st_size) {
+		// `copytruncate` style rotation
+		lseek(t->fd, 0, SEEK_SET);
+		byte_buf_clear(&t->buf);
+		di_emit(t, "truncated");
+	}
+
+	ssize_t ret;
+	while ((ret = read(t->fd, byte_buf_reserve(&t->buf, TAIL_READ_SIZE),
+	                   TAIL_READ_SIZE)) != 0) {
+		if (ret < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			break;
+		}
+		// Only the new bytes need to be searched for line breaks
+		size_t pos = byte_buf_len(&t->buf), line_start = 0;
+		byte_buf_commit(&t->buf, ret);
+
+		// Lines are passed to the listeners straight from the buffer
+		const char *data = byte_buf_data(&t->buf);
+		const char *eol;
+		while ((eol = memchr(data + pos, '\n', byte_buf_len(&t->buf) - pos))) {
+			pos = eol - data;
+			struct di_string line = {data + line_start, pos - line_start};
+			di_emit(t, "line", line);
+			line_start = ++pos;
+		}
+		byte_buf_consume(&t->buf, line_start);
+	}
+}
+
+static void tail_close_file(struct di_file_tail *t) {
+	if (t->file_wd >= 0) {
+		inotify_rm_watch(t->ifd, t->file_wd);
+		t->file_wd = -1;
+	}
+	if (t->fd >= 0) {
+		close(t->fd);
+		t->fd = -1;
+	}
+	byte_buf_clear(&t->buf);
+}
+
+/// Open the file at `path`, and start watching it. Returns 0 if the file doesn't exist.
+static int tail_open_file(struct di_file_tail *t) {
+	int fd = open(t->path, O_RDONLY | O_NONBLOCK | O_CLOEXEC);
+	if (fd < 0) {
+		return errno == ENOENT ? 0 : -errno;
+	}
+
+	struct stat st;
+	if (fstat(fd, &st) != 0 || S_ISDIR(st.st_mode)) {
+		close(fd);
+		return -EISDIR;
+	}
+
+	t->fd = fd;
+	t->file_wd = inotify_add_watch(t->ifd, t->path, IN_MODIFY);
+	return 0;
+}
+
+/// Read what's left in the old file, then switch to the new one
+static void tail_reopen(struct di_file_tail *t) {
+	tail_read(t);
+	if (t->fd >= 0 && !byte_buf_is_empty(&t->buf)) {
+		// The old file didn't end with a line break
+		struct di_string line = {byte_buf_data(&t->buf), byte_buf_len(&t->buf)};
+		di_emit(t, "line", line);
+	}
+
+	bool had_file = t->fd >= 0;
+	tail_close_file(t);
+	if (tail_open_file(t) != 0 || t->fd < 0) {
+		return;
+	}
+	if (had_file) {
+		di_emit(t, "rotated");
+	}
+	tail_read(t);
+}
+
+define_object_cleanup(di_file_tail);
+static int di_file_tail_ioev(struct di_weak_object *weak) {
+	// Listeners could drop the last reference to the Tail object
+	with_object_cleanup(di_file_tail) t = (void *)di_upgrade_weak_ref(weak);
+	DI_CHECK(t != NULL, "got ioev events but the listener has died");
+
+	char evbuf[TAIL_EVENT_BUFFER_SIZE]
+	    __attribute__((aligned(__alignof__(struct inotify_event))));
+	bool modified = false, replaced = false;
+	while (true) {
+		ssize_t ret = read(t->ifd, evbuf, sizeof(evbuf));
+		if (ret < 0 && errno == EINTR) {
+			continue;
+		}
+		if (ret <= 0) {
+			break;
+		}
+
+		ptrdiff_t off = 0;
+		while (off < ret) {
+			const struct inotify_event *ev = (void *)(evbuf + off);
+			off += sizeof(struct inotify_event) + ev->len;
+
+			if (ev->wd == t->file_wd) {
+				if (ev->mask & IN_IGNORED) {
+					// The file is removed, the fd can still be read from
+					t->file_wd = -1;
+				}
+				modified = modified || (ev->mask & IN_MODIFY);
+			} else if (ev->wd == t->dir_wd && ev->len > 0 &&
+			           strcmp(ev->name, t->name) == 0) {
+				replaced = true;
+			}
+		}
+	}
+
+	if (replaced) {
+		tail_reopen(t);
+	} else if (modified) {
+		tail_read(t);
+	}
+	return 0;
+}
+
+static void stop_file_tail(struct di_file_tail *t) {
+	tail_close_file(t);
+	byte_buf_free(&t->buf);
+	close(t->ifd);
+	free(t->path);
+}
+
+struct di_object *di_file_new_tail(struct di_module *f, struct di_string path) {
+	if (path.length == 0) {
+		return di_new_error("Path can't be empty");
+	}
+	di_mgetm(f, event, di_new_error("Can't find event module"));
+
+	int ifd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+	if (ifd < 0) {
+		return di_new_error("Failed to create inotify file descriptor");
+	}
+
+	auto t = di_new_object_with_type(struct di_file_tail);
+	di_set_type((void *)t, "deai.plugin.file:Tail");
+	t->ifd = ifd;
+	t->fd = -1;
+	t->file_wd = -1;
+	t->path = di_string_to_chars_alloc(path);
+	di_set_object_dtor((void *)t, (void *)stop_file_tail);
+
+	char *slash = strrchr(t->path, '/');
+	int dir_wd;
+	if (slash == NULL) {
+		t->name = t->path;
+		dir_wd = inotify_add_watch(ifd, ".", IN_CREATE | IN_MOVED_TO | IN_ONLYDIR);
+	} else {
+		t->name = slash + 1;
+		char *dir = strndup(t->path, slash == t->path ? 1 : slash - t->path);
+		dir_wd = inotify_add_watch(ifd, dir, IN_CREATE | IN_MOVED_TO | IN_ONLYDIR);
+		free(dir);
+	}
+	t->dir_wd = dir_wd;
+	if (dir_wd < 0 || *t->name == '\0') {
+		di_unref_object((void *)t);
+		return di_new_error("Invalid path %.*s", (int)path.length, path.data);
+	}
+
+	int ret = tail_open_file(t);
+	if (ret != 0) {
+		di_unref_object((void *)t);
+		return di_new_error("Failed to open %.*s: %s", (int)path.length,
+		                    path.data, strerror(-ret));
+	}
+	if (t->fd >= 0) {
+		// Only follow what's written from now on
+		lseek(t->fd, 0, SEEK_END);
+	}
+
+	struct di_object *fdevent = NULL;
+	DI_CHECK_OK(di_callr(eventm, "fdevent", fdevent, t->ifd, IOEV_READ));
+
+	di_weak_object_with_cleanup tmpo = di_weakly_ref_object((struct di_object *)t);
+	di_closure_with_cleanup cl = di_closure(di_file_tail_ioev, (tmpo));
+	auto listen_handle = di_listen_to(fdevent, di_string_borrow("read"), (void *)cl);
+
+	di_member(t, "__fd_event", fdevent);
+	di_member(t, "__fd_event_read_listen_handle", listen_handle);
+	return (void *)t;
+}
@@ -45,7 +45,6 @@
 
 #include "compat.h"
 #include "list.h"
-#include "uthash.h"
 #include "utils.h"
 
 #define tmalloc(type, nmem) (type *)calloc(nmem, sizeof(type))
@@ -53,6 +52,7 @@
 
 #define DI_LUA_REGISTRY_SCRIPT_OBJECT_KEY "__deai.di_lua.script_object"
 #define DI_LUA_REGISTRY_STATE_OBJECT_KEY "__deai.di_lua.state_object"
+#define DI_LUA_REGISTRY_PROXIES_KEY "__deai.di_lua.proxies"
 
 #define di_lua_get_state(L, s)                                                           \
 	do {                                                                             \
@@ -80,10 +80,12 @@
 		s = tmp;                                                                 \
 	} while (0)
 
-struct di_lua_object_map_entry {
-	int ref;
+/// The userdata of the proxy of a di_object
+struct di_lua_proxy {
+	/// Must be the first member, so this can be used like other proxies
 	struct di_object *object;
-	UT_hash_handle hh;
+	/// Index of this proxy in di_lua_state::proxies
+	size_t index;
 };
 
 /// A singleton for lua_State
@@ -100,17 +102,20 @@ struct di_lua_state {
 	// We track all objects that lives in a lua state, in order to make mark-and-sweep
 	// work, as well as deduplicate the object proxies.
 	//
-	// Object tracking is done in 3 parts:
-	//    1) Weak references to the proxies in the lua registry. This is used so when
-	//       the same object are pushed multiple times, we can use a reference to the
-	//       same proxy. Also because we cannot do 2) multiple times on the same
-	//       object, so the proxy of an object must be a singleton.
-	//    2) The object_to_lua_ref map. This maps the object to its index in the table
-	//       of objects in 1).
-	//    3) The ___di_object_<number> member of the di_lua_state object, where the
-	//       number is the index of the object in the table. This stores a reference
-	//       to the object in di_lua_script, so mark-and-sweep will see the object
-	struct di_lua_object_map_entry *object_to_lua_ref;
+	// Object tracking is done in 2 parts:
+	//    1) A weak table in the lua registry, which maps objects (as light userdata)
+	//       to their proxies. This is used so when the same object are pushed multiple
+	//       times, we can use the same proxy.
+	//    2) The `proxies` array, of all the live proxies. Each proxy holds a reference
+	//       to its object, and the array is how mark-and-sweep sees them, through
+	//       di_lua_state_traverse. A proxy knows its own index in the array, so it can
+	//       be removed in O(1) when it's garbage collected.
+	//
+	// A proxy can be removed from 1) before its __gc is called, in which case pushing
+	// the same object again creates a new proxy. So the same object can be in `proxies`
+	// more than once, each time with its own reference.
+	struct di_lua_proxy **proxies;
+	size_t nproxies, proxies_capacity;
 };
 
 struct di_lua_ref {
@@ -344,38 +349,35 @@ static int di_lua_method_handler(lua_State *L) {
 	return di_lua_method_handler_impl(L, name, m);
 }
 
-static void di_lua_forget_object(struct di_lua_state *s, struct di_lua_object_map_entry *e) {
-	char *buf;
-	HASH_DEL(s->object_to_lua_ref, e);
-	/*fprintf(stderr, "forgetting %d\n", e->ref);*/
-	asprintf(&buf, "___di_object_%d", e->ref);
-	DI_CHECK_OK(di_remove_member_raw((struct di_object *)s, di_string_borrow(buf)));
-	luaL_unref(s->L, LUA_REGISTRYINDEX, e->ref);
-	free(buf);
-	free(e);
+static void di_lua_track_proxy(struct di_lua_state *s, struct di_lua_proxy *p) {
+	if (s->nproxies == s->proxies_capacity) {
+		s->proxies_capacity = s->proxies_capacity ? s->proxies_capacity * 2 : 16;
+		s->proxies = realloc(s->proxies, sizeof(*s->proxies) * s->proxies_capacity);
+	}
+	p->index = s->nproxies++;
+	s->proxies[p->index] = p;
+}
+
+static void di_lua_untrack_proxy(struct di_lua_state *s, struct di_lua_proxy *p) {
+	DI_CHECK(p->index < s->nproxies && s->proxies[p->index] == p);
+	// Move the last proxy into the hole
+	auto last = s->proxies[--s->nproxies];
+	s->proxies[p->index] = last;
+	last->index = p->index;
 }
 
 static int di_lua_gc(lua_State *L) {
-	struct di_object *o = di_lua_checkproxy(L, 1);
+	di_lua_checkproxy(L, 1);
+	struct di_lua_proxy *p = lua_touserdata(L, 1);
 	struct di_lua_state *s;
 
 	di_lua_get_state(L, s);
 	DI_CHECK(s != NULL);
 
-
-	// Forget about this object
-	struct di_lua_object_map_entry *e = NULL;
-	HASH_FIND_PTR(s->object_to_lua_ref, &o, e);
-
-	// This object might have already been forgotten, if:
-	//   1) the proxy has been GC'd, but __gc hasn't been called, and
-	//   2) di_lua_pushobject is called for the corresponding object in this state
-	//
-	// In that case, di_lua_pushobject will forget the GC'd entry and create a new
-	// weakref for the object.
-	if (e != NULL) {
-		di_lua_forget_object(s, e);
-	}
+	// The weak table entry for this proxy is already gone, or has been replaced by a
+	// newer proxy of the same object. Either way we don't need to touch it.
+	di_lua_untrack_proxy(s, p);
+	di_unref_object(p->object);
 	return 0;
 }
 
@@ -440,12 +442,12 @@ di_lua_create_metatable_for_object(lua_State *L, const luaL_Reg *reg, bool calla
 	lua_setmetatable(L, -2);
 }
 
-// Push a proxy for `o` to lua stack. `o` can be a pointer to anything
-static void
-di_lua_pushproxy(lua_State *L, const char *name, void *o, const luaL_Reg *reg, bool callable) {
-	// struct di_lua_script *s;
+// Push a proxy for `o` to lua stack. `o` can be a pointer to anything. The userdata is
+// `size` bytes, the first of which store `o`. Returns the userdata.
+static void *di_lua_pushproxy_with_size(lua_State *L, const char *name, void *o,
+                                        size_t size, const luaL_Reg *reg, bool callable) {
 	void **ptr;
-	ptr = lua_newuserdata(L, sizeof(void *));
+	ptr = lua_newuserdata(L, size);
 	*ptr = o;
 
 	if (callable) {
@@ -457,45 +459,12 @@ di_lua_pushproxy(lua_State *L, const char *name, void *o, const luaL_Reg *reg, b
 		}
 	}
 	di_lua_create_metatable_for_object(L, reg, callable);
+	return ptr;
 }
 
-/// Store a weak reference to the object on the top of the stack in the table at `index`,
-/// pops the value.
-///
-/// This creates an extra weak table indirection, and stores the object in the table. We
-/// cannot just use 1 weak table to store all the objects, because the luaL_ref machinary
-/// doesn't work with weak tables.
-static int luaL_weakref(lua_State *L, int index) {
-	lua_newtable(L);        // new_table={}
-	lua_newtable(L);        // metatable={}
-	lua_pushliteral(L, "__mode");
-	lua_pushliteral(L, "v");
-	lua_rawset(L, -3);              // metatable._mode='v'
-	lua_setmetatable(L, -2);        // setmetatable(new_table,metatable)
-	lua_pushvalue(L, -2);           // push the previous top of stack
-	lua_rawseti(L, -2, 1);          // new_table[1]=value, pops the value
-
-	lua_remove(L, -2);        // removes the original top of stack
-
-	// Now new_table is on top of the stack, replacing the original top of stack
-	return luaL_ref(L, index);
-}
-
-/// Get the weak reference `r` from the table at `index`. Leaves the value at the top of
-/// the stack. Value `nil` will be at the top of the stack if the weak ref is dead.
-///
-/// Returns whether the weak reference is still alive
-static bool luaL_weakref_get(lua_State *L, int index, int r) {
-	// Get the weak table indirection
-	lua_rawgeti(L, index, r);
-
-	DI_CHECK(lua_type(L, -1) == LUA_TTABLE);
-	lua_rawgeti(L, -1, 1);
-
-	// Remove the weak table indirection from the stack
-	lua_remove(L, -2);
-
-	return !lua_isnil(L, -1);
+static void
+di_lua_pushproxy(lua_State *L, const char *name, void *o, const luaL_Reg *reg, bool callable) {
+	di_lua_pushproxy_with_size(L, name, o, sizeof(void *), reg, callable);
 }
 
 /// Push an object to lua stack. A wrapper of di_lua_pushproxy, which also handles
@@ -505,38 +474,29 @@ static bool luaL_weakref_get(lua_State *L, int index, int r) {
 static void di_lua_pushobject(lua_State *L, const char *name, struct di_object *obj) {
 	struct di_lua_state *s;
 	di_lua_get_state(L, s);
-	struct di_lua_object_map_entry *e = NULL;
-	HASH_FIND_PTR(s->object_to_lua_ref, &obj, e);
-
-	if (e != NULL) {
-		/*fprintf(stderr, "found %d\n", e->ref);*/
-		if (luaL_weakref_get(L, LUA_REGISTRYINDEX, e->ref)) {
-			// We have already pushed this object before, return the same proxy
-			di_unref_object(obj);
-			return;
-		}
 
-		// The weak reference died before __gc is called for this object.
-		// Clear the stale record
-		di_lua_forget_object(s, e);
+	lua_pushliteral(L, DI_LUA_REGISTRY_PROXIES_KEY);
+	lua_rawget(L, LUA_REGISTRYINDEX);
+	lua_pushlightuserdata(L, obj);
+	lua_rawget(L, -2);
+	if (!lua_isnil(L, -1)) {
+		// We have already pushed this object before, return the same proxy
+		lua_remove(L, -2);
+		di_unref_object(obj);
+		return;
 	}
+	lua_pop(L, 1);
 
-	// Push the proxy, and weakly reference it from the lua registry
-	di_lua_pushproxy(L, name, obj, di_lua_object_methods, true);
-	// Copy the proxy, as we are going to consume it when we put it into the registry
-	lua_pushvalue(L, -1);
-
-	e = tmalloc(struct di_lua_object_map_entry, 1);
-	e->object = obj;
-	e->ref = luaL_weakref(L, LUA_REGISTRYINDEX);
-
-	// Store the object as a member of di_lua_state, so mark and sweep will see it
-	char *buf;
-	asprintf(&buf, "___di_object_%d", e->ref);
-	DI_CHECK_OK(di_member(s, buf, obj));
-	free(buf);
-	HASH_ADD_PTR(s->object_to_lua_ref, object, e);
-	/*fprintf(stderr, "added %d\n", e->ref);*/
+	// Stack: [ proxies ]
+	struct di_lua_proxy *p = di_lua_pushproxy_with_size(
+	    L, name, obj, sizeof(struct di_lua_proxy), di_lua_object_methods, true);
+	di_lua_track_proxy(s, p);
+
+	// proxies[obj] = proxy
+	lua_pushlightuserdata(L, obj);
+	lua_pushvalue(L, -2);
+	lua_rawset(L, -4);
+	lua_remove(L, -2);
 }
 
 const char *allowed_os[] = {"time", "difftime", "clock", "tmpname", "date", NULL};
@@ -549,7 +509,17 @@ const luaL_Reg di_lua_di_methods[] = {
 };
 
 static void lua_state_dtor(struct di_lua_state *obj) {
+	// This calls __gc for all the proxies, which releases the objects
 	lua_close(obj->L);
+	DI_CHECK(obj->nproxies == 0);
+	free(obj->proxies);
+}
+
+static void di_lua_state_traverse(struct di_object *obj, di_visit_fn_t visit) {
+	auto s = (struct di_lua_state *)obj;
+	for (size_t i = 0; i < s->nproxies; i++) {
+		visit(s->proxies[i]->object);
+	}
 }
 
 static struct di_lua_state *lua_new_state(struct di_module *m) {
@@ -557,8 +527,19 @@ static struct di_lua_state *lua_new_state(struct di_module *m) {
 	di_set_type((struct di_object *)L, "deai.plugin.lua:LuaState");
 	L->L = luaL_newstate();
 	di_set_object_dtor((void *)L, (void *)lua_state_dtor);
+	di_set_object_traverse((void *)L, di_lua_state_traverse);
 	luaL_openlibs(L->L);
 
+	// The table of proxies, with weak values
+	lua_pushliteral(L->L, DI_LUA_REGISTRY_PROXIES_KEY);
+	lua_newtable(L->L);
+	lua_newtable(L->L);
+	lua_pushliteral(L->L, "__mode");
+	lua_pushliteral(L->L, "v");
+	lua_rawset(L->L, -3);
+	lua_setmetatable(L->L, -2);
+	lua_rawset(L->L, LUA_REGISTRYINDEX);
+
 	struct di_object *di = (void *)di_module_get_deai(m);
 	di_lua_pushproxy(L->L, "di", di, di_lua_di_methods, false);
 	lua_setglobal(L->L, "di");
@@ -88,7 +88,7 @@ static char *describe_keybinding(struct keybinding *kb) {
 	string_buf_push(buf, keyname);
 
 	char *ret = string_buf_dump(buf);
-	free(buf);
+	string_buf_free(buf);
 
 	return ret;
 }
@@ -123,12 +123,11 @@ static int refresh_binding(struct keybinding *kb) {
 		                                kb->keycodes[i], XCB_GRAB_MODE_ASYNC,
 		                                XCB_GRAB_MODE_SYNC));
 		if (err) {
-			di_mgetmi(dc->x, log);
-			if (logm) {
+			if (di_log_enabled(dc->log, DI_LOG_ERROR)) {
 				char *description = describe_keybinding(kb);
-				di_log_va(logm, DI_LOG_ERROR,
-				          "Cannot grab %#x, for keybinding %s\n",
-				          kb->keycodes[i], description);
+				di_logger_log(dc->log, DI_LOG_ERROR,
+				              "Cannot grab %#x, for keybinding %s\n",
+				              kb->keycodes[i], description);
 				free(description);
 			}
 			free(err);
@@ -291,8 +291,7 @@ static void set_output_backlight(struct di_xorg_output *o, int bkl) {
 	                                        o->rr->dc->c, o->oid, bklatom, XCB_ATOM_INTEGER,
 	                                        32, XCB_PROP_MODE_REPLACE, 1, (void *)&v));
 	if (e) {
-		di_mgetm(o->rr->dc->x, log, (void)0);
-		di_log_va(logm, DI_LOG_ERROR, "Failed to set backlight");
+		di_log(o->rr->dc->log, DI_LOG_ERROR, "Failed to set backlight");
 	}
 }
 
@@ -420,9 +419,8 @@ static inline void rr_select_input(struct di_xorg_randr *rr, uint16_t mask) {
 	auto e = xcb_request_check(rr->dc->c,
 	                           xcb_randr_select_input(rr->dc->c, scrn->root, mask));
 
-	di_mgetm(rr->dc->x, log, (void)0);
 	if (e) {
-		di_log_va(logm, DI_LOG_ERROR, "randr select input failed\n");
+		di_log(rr->dc->log, DI_LOG_ERROR, "randr select input failed\n");
 	}
 }
 
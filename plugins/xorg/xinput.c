@@ -43,11 +43,8 @@ struct di_xorg_xinput_device {
 #define get_mask(a, m) ((a)[(m) >> 3] & (1 << ((m)&7)))
 
 static void di_xorg_xi_start_listen_for_event(struct di_xorg_xinput *xi, int ev) {
-	di_mgetmi(xi->dc->x, log);
 	if (ev > XI_LASTEVENT) {
-		if (logm) {
-			di_log_va(logm, DI_LOG_ERROR, "invalid xi event number %d", ev);
-		}
+		di_log(xi->dc->log, DI_LOG_ERROR, "invalid xi event number %d", ev);
 		return;
 	}
 
@@ -60,17 +57,14 @@ static void di_xorg_xi_start_listen_for_event(struct di_xorg_xinput *xi, int ev)
 	set_mask(xi->mask, ev);
 	auto cookie = xcb_input_xi_select_events_checked(xi->dc->c, scrn->root, 1, &xi->ec);
 	auto e = xcb_request_check(xi->dc->c, cookie);
-	if (e && logm) {
-		di_log_va(logm, DI_LOG_ERROR, "select events failed\n");
+	if (e) {
+		di_log(xi->dc->log, DI_LOG_ERROR, "select events failed\n");
 	}
 }
 
 static void di_xorg_xi_stop_listen_for_event(struct di_xorg_xinput *xi, int ev) {
-	di_mgetmi(xi->dc->x, log);
 	if (ev > XI_LASTEVENT) {
-		if (logm) {
-			di_log_va(logm, DI_LOG_ERROR, "invalid xi event number %d", ev);
-		}
+		di_log(xi->dc->log, DI_LOG_ERROR, "invalid xi event number %d", ev);
 		return;
 	}
 
@@ -84,8 +78,8 @@ static void di_xorg_xi_stop_listen_for_event(struct di_xorg_xinput *xi, int ev)
 	clear_mask(xi->mask, ev);
 	auto cookie = xcb_input_xi_select_events_checked(xi->dc->c, scrn->root, 1, &xi->ec);
 	auto e = xcb_request_check(xi->dc->c, cookie);
-	if (e && logm) {
-		di_log_va(logm, DI_LOG_ERROR, "select events failed\n");
+	if (e) {
+		di_log(xi->dc->log, DI_LOG_ERROR, "select events failed\n");
 	}
 }
 
@@ -110,10 +104,9 @@ static void di_xorg_free_xinput(struct di_xorg_ext *x) {
 
 	auto cookie = xcb_input_xi_select_events_checked(xi->dc->c, scrn->root, 1, &xi->ec);
 
-	di_mgetmi(xi->dc->x, log);
 	auto e = xcb_request_check(xi->dc->c, cookie);
-	if (e && logm) {
-		di_log_va(logm, DI_LOG_ERROR, "select events failed\n");
+	if (e) {
+		di_log(xi->dc->log, DI_LOG_ERROR, "select events failed\n");
 	}
 }
 
@@ -246,7 +239,6 @@ static void di_xorg_xinput_set_prop(struct di_xorg_xinput_device *dev,
 
 	struct di_xorg_connection *dc = dev->xi->dc;
 
-	di_mgetmi(dev->xi->dc->x, log);
 	xcb_generic_error_t *e;
 	auto prop_atom = di_xorg_intern_atom(dc, key, &e);
 	if (e) {
@@ -262,16 +254,15 @@ static void di_xorg_xinput_set_prop(struct di_xorg_xinput_device *dev,
 
 	if (prop->type == XCB_ATOM_NONE) {
 		// non-existent property should be silently ignored
-		if (logm) {
-			di_log_va(logm, DI_LOG_DEBUG, "setting non-existent property: %.*s\n",
-			          (int)key.length, key.data);
-		}
+		di_log(dc->log, DI_LOG_DEBUG, "setting non-existent property: %.*s\n",
+		       (int)key.length, key.data);
 		return;
 	}
 
 	if ((prop->type == float_atom || prop->type == XCB_ATOM_ATOM) && prop->format != 32) {
-		di_log_va(logm, DI_LOG_ERROR,
-		          "Xorg return invalid format for float/atom type: %d\n", prop->format);
+		di_log(dc->log, DI_LOG_ERROR,
+		       "Xorg return invalid format for float/atom type: %d\n",
+		       prop->format);
 		return;
 	}
 
@@ -373,16 +364,16 @@ static void di_xorg_xinput_set_prop(struct di_xorg_xinput_device *dev,
 	               prop_atom, prop->type, arr.length, item));
 
 	if (err) {
-		di_log_va(logm, DI_LOG_ERROR, "Failed to set property '%.*s'\n",
-		          (int)key.length, key.data);
+		di_log(dc->log, DI_LOG_ERROR, "Failed to set property '%.*s'\n",
+		       (int)key.length, key.data);
 	}
 	(void)err;
 	return;
 err:
-	di_log_va(logm, DI_LOG_ERROR,
-	          "Try to set xinput property '%.*s' with wrong "
-	          "type of data %d\n",
-	          (int)key.length, key.data, arr.elem_type);
+	di_log(dc->log, DI_LOG_ERROR,
+	       "Try to set xinput property '%.*s' with wrong "
+	       "type of data %d\n",
+	       (int)key.length, key.data, arr.elem_type);
 }
 
 static struct di_variant
@@ -393,7 +384,6 @@ di_xorg_xinput_get_prop(struct di_xorg_xinput_device *dev, struct di_string name
 
 	struct di_xorg_connection *dc = dev->xi->dc;
 
-	di_mgetmi(dc->x, log);
 	xcb_generic_error_t *e;
 	struct di_array ret = DI_ARRAY_INIT;
 	auto prop_atom = di_xorg_intern_atom(dc, name_, &e);
@@ -432,22 +422,18 @@ di_xorg_xinput_get_prop(struct di_xorg_xinput_device *dev, struct di_string name
 	} else if (prop->type == float_atom) {
 		ret.elem_type = DI_TYPE_FLOAT;
 	} else {
-		if (logm) {
-			di_log_va(logm, DI_LOG_WARN, "Unknown property type %d\n", prop->type);
-		}
+		di_log(dc->log, DI_LOG_WARN, "Unknown property type %d\n", prop->type);
 		return di_variant_of(di_new_error("Property has unknown type: %d", prop->type));
 	}
 
 	if (prop->format != 8 && prop->format != 16 && prop->format != 32) {
-		if (logm) {
-			di_log_va(logm, DI_LOG_WARN, "Xorg returns invalid format %d\n",
-			          prop->format);
-		}
+		di_log(dc->log, DI_LOG_WARN, "Xorg returns invalid format %d\n",
+		       prop->format);
 		return di_variant_of(di_new_error("Property has invalid format", prop->format));
 	}
 	if ((prop->type == float_atom || prop->type == XCB_ATOM_ATOM) && prop->format != 32) {
-		di_log_va(logm, DI_LOG_WARN,
-		          "Xorg return invalid format for float/atom %d\n", prop->format);
+		di_log(dc->log, DI_LOG_WARN,
+		       "Xorg return invalid format for float/atom %d\n", prop->format);
 		return di_variant_of(di_new_error("X server is misbehaving"));
 	}
 
@@ -588,15 +574,14 @@ static int handle_xinput_event(struct di_xorg_xinput *xi, xcb_generic_event_t *e
 		return 1;
 	}
 
-	// di_getm(xi->dc->x->di, log);
 	if (gev->event_type == XCB_INPUT_HIERARCHY) {
 		xcb_input_hierarchy_event_t *hev = (void *)ev;
 		auto hevi = xcb_input_hierarchy_infos_iterator(hev);
 		for (; hevi.rem; xcb_input_hierarchy_info_next(&hevi)) {
 			auto info = hevi.data;
 			auto obj = di_xorg_make_object_for_devid(xi, info->deviceid);
-			// di_log_va(log, DI_LOG_DEBUG, "hierarchy change %u %u\n",
-			// info->deviceid, info->flags);
+			di_log(xi->dc->log, DI_LOG_DEBUG, "hierarchy change %u %u\n",
+			       info->deviceid, info->flags);
 			if (info->flags & XCB_INPUT_HIERARCHY_MASK_SLAVE_ADDED) {
 				di_emit(xi, "new-device", obj);
 			}
@@ -52,6 +52,10 @@ static void xorg_disconnect(struct di_xorg_connection *xc) {
 	if (xc->xkb_ctx) {
 		xkb_context_unref(xc->xkb_ctx);
 	}
+	if (xc->log) {
+		di_unref_object(xc->log);
+		xc->log = NULL;
+	}
 
 	// free_sub might need the connection, don't disconnect now
 	struct di_xorg_ext *ext, *text;
@@ -127,7 +131,6 @@ const struct di_string *di_xorg_get_atom_name(struct di_xorg_connection *xc, xcb
 
 xcb_atom_t di_xorg_intern_atom(struct di_xorg_connection *xc, struct di_string name,
                                xcb_generic_error_t **e) {
-	di_mgetm(xc->x, log, 0);
 	struct di_atom_entry *ae = NULL;
 	*e = NULL;
 
@@ -139,7 +142,7 @@ xcb_atom_t di_xorg_intern_atom(struct di_xorg_connection *xc, struct di_string n
 	auto r = xcb_intern_atom_reply(
 	    xc->c, xcb_intern_atom(xc->c, 0, name.length, name.data), e);
 	if (!r) {
-		di_log_va(logm, DI_LOG_ERROR, "Cannot intern atom");
+		di_log(xc->log, DI_LOG_ERROR, "Cannot intern atom");
 		return 0;
 	}
 
@@ -348,9 +351,9 @@ static void set_keymap(struct di_xorg_connection *xc, struct di_object *o) {
 	di_string_with_cleanup layout = DI_STRING_INIT, model = DI_STRING_INIT,
 	                       variant = DI_STRING_INIT, options = DI_STRING_INIT;
 
-	di_mgetmi(xc->x, log);
 	if (!o || di_get(o, "layout", layout)) {
-		di_log_va(logm, DI_LOG_ERROR, "Invalid keymap object, key \"layout\" is not set");
+		di_log(xc->log, DI_LOG_ERROR,
+		       "Invalid keymap object, key \"layout\" is not set");
 		return;
 	}
 
@@ -376,9 +379,9 @@ static void set_keymap(struct di_xorg_connection *xc, struct di_object *o) {
 	xcb_keysym_t *keysyms = NULL;
 
 	if (xkb_keymap_num_layouts(map) != 1) {
-		di_log_va(logm, DI_LOG_ERROR,
-		          "Using multiple layout at the same time is not currently "
-		          "supported.");
+		di_log(xc->log, DI_LOG_ERROR,
+		       "Using multiple layout at the same time is not currently "
+		       "supported.");
 		goto out;
 	}
 
@@ -409,9 +412,9 @@ static void set_keymap(struct di_xorg_connection *xc, struct di_object *o) {
 			const xkb_keysym_t *sym;
 			int nsyms = xkb_keymap_key_get_syms_by_level(map, i, 0, j, &sym);
 			if (nsyms > 1) {
-				di_log_va(logm, DI_LOG_WARN,
-				          "Multiple keysyms per level is not "
-				          "supported");
+				di_log(xc->log, DI_LOG_WARN,
+				       "Multiple keysyms per level is not "
+				       "supported");
 				continue;
 			}
 			if (!nsyms || sym == NULL) {
@@ -428,7 +431,7 @@ static void set_keymap(struct di_xorg_connection *xc, struct di_object *o) {
 	                                      xc->c, (max_keycode - min_keycode + 1),
 	                                      min_keycode, keysym_per_keycode, keysyms));
 	if (r) {
-		di_log_va(logm, DI_LOG_ERROR, "Failed to set keymap.");
+		di_log(xc->log, DI_LOG_ERROR, "Failed to set keymap.");
 		free(r);
 	}
 
@@ -441,8 +444,8 @@ static void set_keymap(struct di_xorg_connection *xc, struct di_object *o) {
 		                             modifiers.keycodes),
 		    NULL);
 		if (!r2 || r2->status == XCB_MAPPING_STATUS_FAILURE) {
-			di_log_va(logm, DI_LOG_ERROR,
-			          "Failed to set modifiers, your keymap will be broken.");
+			di_log(xc->log, DI_LOG_ERROR,
+			       "Failed to set modifiers, your keymap will be broken.");
 			free(r2);
 			break;
 		}
@@ -504,6 +507,9 @@ static struct di_object *di_xorg_connect_to(struct di_xorg *x, struct di_string
 	dc->x = x;
 	dc->xkb_ctx = xkb_context_new(XKB_CONTEXT_NO_FLAGS);
 
+	di_mgetm(x, log, (void *)dc);
+	dc->log = di_new_logger(logm, "xorg");
+
 	return (void *)dc;
 }
 
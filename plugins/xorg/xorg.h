@@ -27,6 +27,8 @@ struct di_xorg_connection {
 	struct di_xorg_ext *xext;
 
 	struct xkb_context *xkb_ctx;
+	/// Logger named "xorg", could be NULL
+	struct di_object *log;
 
 	struct di_atom_entry *a_byatom, *a_byname;
 };
@@ -6,6 +6,7 @@
 
 #include <ev.h>
 #include <fcntl.h>
+#include <sys/resource.h>
 #include <sys/wait.h>
 #include <unistd.h>
 
@@ -18,9 +19,11 @@
 #include <deai/builtins/spawn.h>
 #include <deai/helper.h>
 
+#include "byte_buf.h"
+#include "cgroup.h"
 #include "di_internal.h"
+#include "launcher.h"
 #include "spawn.h"
-#include "string_buf.h"
 #include "uthash.h"
 #include "utils.h"
 
@@ -32,24 +35,73 @@
 /// Signals:
 /// * stderr_line(line: string) a line has been written to stderr by the child
 /// * stdout_line(line: string) a line has been written to stdout by the child
-/// * exit(exit_code, signal) the child process has exited
+/// * exit(exit_code, signal, usage: ResourceUsage) the child process has exited
 struct child {
 	struct di_object;
 	pid_t pid;
 
-	ev_child w;
 	ev_io outw, errw;
 
-	struct string_buf *out, *err;
+	struct byte_buf *out, *err;
+
+	/// Directory fd of the leaf cgroup this child is placed in, -1 if none
+	int cgroup;
+	/// The spawn module, while it is waiting for this child to exit
+	struct di_spawn *spawn;
+	UT_hash_handle hh;
+};
+
+/// Object type: ResourceUsage
+///
+/// Resources used by an exited child process, as reported by wait4(2)
+struct child_rusage {
+	struct di_object;
+	/// Time spent in user and kernel mode, in seconds
+	double utime, stime;
+	/// Maximum resident set size, in kilobytes
+	int64_t maxrss;
+};
+
+/// Object type: CgroupStats
+///
+/// Resource usage of a child process's cgroup. Memory usage is in bytes, and CPU times
+/// are in microseconds. Values not provided by the kernel are missing.
+struct child_cgroup_stats {
+	struct di_object;
+	int64_t memory_current, memory_peak;
+	int64_t cpu_usage_usec, cpu_user_usec, cpu_system_usec;
 };
 
 struct di_spawn {
 	struct di_module;
 
+	struct ev_loop *loop;
+	ev_signal sigchld;
+	bool use_cgroup;
+	/// Children that haven't exited yet, keyed by pid
 	struct child *children;
 };
 
+/// Whether any child process has been spawned without a cgroup
+static bool has_uncontained_children = false;
+
+static void child_untrack(struct child *c) {
+	if (c->spawn == NULL) {
+		return;
+	}
+	HASH_DEL(c->spawn->children, c);
+	// Running children keep the event loop alive
+	ev_unref(c->spawn->loop);
+	c->spawn = NULL;
+}
+
 static inline void child_cleanup(struct child *c) {
+	child_untrack(c);
+	if (c->cgroup >= 0) {
+		di_cgroup_release_leaf(c->cgroup);
+		c->cgroup = -1;
+	}
+
 	di_object_with_cleanup di_obj = di_object_get_deai_strong((struct di_object *)c);
 	if (di_obj == NULL) {
 		return;
@@ -57,90 +109,114 @@ static inline void child_cleanup(struct child *c) {
 
 	auto di = (struct deai *)di_obj;
 	EV_P = di->loop;
-	ev_child_stop(EV_A_ & c->w);
 	if (c->out) {
 		ev_io_stop(EV_A_ & c->outw);
 		close(c->outw.fd);
+		byte_buf_free(c->out);
 		free(c->out);
 		c->out = NULL;
 	}
 	if (c->err) {
 		ev_io_stop(EV_A_ & c->errw);
 		close(c->errw.fd);
+		byte_buf_free(c->err);
 		free(c->err);
 		c->err = NULL;
 	}
 }
 
-static void output_handler(struct child *c, int fd, struct string_buf *b, const char *ev) {
-	static char buf[4096];
-	int ret;
-	while ((ret = read(fd, buf, sizeof(buf))) > 0) {
-		const char *pos = buf;
-		while (1) {
-			size_t len = buf + ret - pos;
-			char *eol = memchr(pos, '\n', len);
-			if (eol) {
-				*eol = '\0';
-				if (!string_buf_is_empty(b)) {
-					string_buf_push(b, pos);
-
-					const char *out = string_buf_dump(b);
-					di_emit(c, ev, out);
-					free((char *)out);
-				} else {
-					di_emit(c, ev, pos);
-				}
-				pos = eol + 1;
-			} else {
-				string_buf_lpush(b, pos, len);
-				break;
-			}
+static void output_handler(struct child *c, int fd, struct byte_buf *b, const char *ev) {
+	// Listeners could drop the last reference to the child process, which would free
+	// the buffer we are using
+	di_object_with_cleanup unused obj = di_ref_object((struct di_object *)c);
+	ssize_t ret;
+	while ((ret = read(fd, byte_buf_reserve(b, 4096), 4096)) > 0) {
+		// Only the new bytes need to be searched for line breaks
+		size_t pos = byte_buf_len(b), line_start = 0;
+		byte_buf_commit(b, ret);
+
+		const char *data = byte_buf_data(b);
+		const char *eol;
+		while ((eol = memchr(data + pos, '\n', byte_buf_len(b) - pos))) {
+			pos = eol - data;
+			struct di_string line = {data + line_start, pos - line_start};
+			di_emit(c, ev, line);
+			line_start = ++pos;
 		}
+		byte_buf_consume(b, line_start);
+	}
+}
+
+/// Emit whatever is left in `b` as the last line
+static void output_flush(struct child *c, struct byte_buf *b, const char *ev) {
+	if (!byte_buf_is_empty(b)) {
+		struct di_string line = {byte_buf_data(b), byte_buf_len(b)};
+		di_emit(c, ev, line);
+		byte_buf_clear(b);
 	}
 }
 
-static void sigchld_handler(EV_P_ ev_child *w, int revents) {
-	struct child *c = container_of(w, struct child, w);
+static void child_exited(struct child *c, int status, const struct rusage *ru) {
 	// Keep child process object alive when emitting
 	di_object_with_cleanup unused obj = di_ref_object((struct di_object *)c);
+	child_untrack(c);
 
 	int sig = 0;
-	if (WIFSIGNALED(w->rstatus)) {
-		sig = WTERMSIG(w->rstatus);
+	if (WIFSIGNALED(status)) {
+		sig = WTERMSIG(status);
 	}
 
-	int ec = WEXITSTATUS(w->rstatus);
+	int ec = WEXITSTATUS(status);
 	if (c->out) {
 		output_handler(c, c->outw.fd, c->out, "stdout_line");
-		if (!string_buf_is_empty(c->out)) {
-			const char *o = string_buf_dump(c->out);
-			di_emit(c, "stdout_line", o);
-			free((char *)o);
-		}
+		output_flush(c, c->out, "stdout_line");
 	}
 	if (c->err) {
 		output_handler(c, c->errw.fd, c->err, "stderr_line");
-		if (!string_buf_is_empty(c->err)) {
-			const char *o = string_buf_dump(c->err);
-			di_emit(c, "stderr_line", o);
-			free((char *)o);
-		}
+		output_flush(c, c->err, "stderr_line");
 	}
-	di_emit(c, "exit", ec, sig);
+
+	auto usage = di_new_object_with_type2(struct child_rusage, "deai:ResourceUsage");
+	usage->utime = (double)ru->ru_utime.tv_sec + (double)ru->ru_utime.tv_usec / 1e6;
+	usage->stime = (double)ru->ru_stime.tv_sec + (double)ru->ru_stime.tv_usec / 1e6;
+	usage->maxrss = ru->ru_maxrss;
+	di_field(usage, utime);
+	di_field(usage, stime);
+	di_field(usage, maxrss);
+	di_emit(c, "exit", ec, sig, (struct di_object *)usage);
+	di_unref_object((struct di_object *)usage);
 
 	child_cleanup(c);
 	// This object won't generate an further events, so drop the reference to di
 	di_remove_member_raw((struct di_object *)c, DEAI_MEMBER_NAME);
 }
 
+static void sigchld_handler(EV_P_ ev_signal *w, int revents) {
+	struct di_spawn *s = container_of(w, struct di_spawn, sigchld);
+	// Listeners of "exit" could drop the last reference to the module
+	di_object_with_cleanup unused obj = di_ref_object((struct di_object *)s);
+
+	// We are a subreaper, so we could be reaping processes we didn't spawn as well
+	int status;
+	struct rusage ru;
+	pid_t pid;
+	while ((pid = wait4(-1, &status, WNOHANG, &ru)) > 0) {
+		struct child *c;
+		HASH_FIND_INT(s->children, &pid, c);
+		if (c) {
+			child_exited(c, status, &ru);
+		}
+	}
+	di_cgroup_collect();
+}
+
 static void child_destroy(struct di_object *obj) {
 	auto c = (struct child *)obj;
 	if (c->err) {
-		string_buf_clear(c->err);
+		byte_buf_free(c->err);
 	}
 	if (c->out) {
-		string_buf_clear(c->out);
+		byte_buf_free(c->out);
 	}
 	child_cleanup(c);
 }
@@ -167,6 +243,31 @@ static void kill_child(struct child *c, int sig) {
 	kill(c->pid, sig);
 }
 
+/// Resource usage of the child process, read from its cgroup while it is running. Only
+/// available if the child process is placed in a cgroup, see `use_cgroup` of the spawn
+/// module.
+///
+/// Return object type: CgroupStats
+static struct di_object *get_child_cgroup_stats(struct child *c) {
+	if (c->cgroup < 0) {
+		return di_new_error("Child process is not in a cgroup");
+	}
+
+	struct di_cgroup_stats stats;
+	di_cgroup_read_stats(c->cgroup, &stats);
+	auto ret =
+	    di_new_object_with_type2(struct child_cgroup_stats, "deai:CgroupStats");
+#define STATS_FIELD(name)                                                                \
+	if (stats.name >= 0) {                                                           \
+		ret->name = stats.name;                                                  \
+		di_field(ret, name);                                                     \
+	}
+	LIST_APPLY(STATS_FIELD, SEP_NONE, memory_current, memory_peak, cpu_usage_usec,
+	           cpu_user_usec, cpu_system_usec);
+#undef STATS_FIELD
+	return (struct di_object *)ret;
+}
+
 define_trivial_cleanup(char *, free_charpp);
 
 static struct di_object *di_setup_fds(bool ignore_output, int *opfds, int *epfds, int *ifd) {
@@ -239,13 +340,23 @@ struct di_object *di_spawn_run(struct di_spawn *p, struct di_array argv, bool ig
 		return ret;
 	}
 
+	// Not being able to create a cgroup is not fatal, the child just won't have one
+	int cgroup = p->use_cgroup ? di_cgroup_new_leaf() : -1;
+
 	char **nargv = tmalloc(char *, argv.length + 1);
 	struct di_string *strings = argv.arr;
 	for (int i = 0; i < argv.length; i++) {
 		nargv[i] = di_string_to_chars_alloc(strings[i]);
 	}
 
-	auto pid = fork();
+	// Try the launcher first, fork ourselves if it's not available, or fails. Either
+	// way the child is started inside its cgroup, so nothing it forks can escape.
+	bool contained = false;
+	pid_t pid =
+	    di_launcher_spawn(nargv, (int[]){ifd, opfds[1], epfds[1]}, cgroup, &contained);
+	if (pid < 0) {
+		pid = cgroup >= 0 ? di_cgroup_fork_into(cgroup, &contained) : fork();
+	}
 	if (pid == 0) {
 		if (!ignore_output) {
 			close(opfds[0]);
@@ -275,20 +386,33 @@ struct di_object *di_spawn_run(struct di_spawn *p, struct di_array argv, bool ig
 	if (pid < 0) {
 		close(opfds[0]);
 		close(epfds[0]);
+		if (cgroup >= 0) {
+			di_cgroup_release_leaf(cgroup);
+		}
 		return di_new_error("Failed to fork");
 	}
+	if (cgroup >= 0 && !contained) {
+		// We can't rely on a cgroup the child is not in
+		di_cgroup_release_leaf(cgroup);
+		cgroup = -1;
+	}
 
 	auto cp = di_new_object_with_type(struct child);
 	di_set_type((struct di_object *)cp, "deai:ChildProcess");
 	di_set_object_dtor((struct di_object *)cp, child_destroy);
 	di_method(cp, "__get_pid", get_child_pid);
 	di_method(cp, "kill", kill_child, int);
+	di_method(cp, "__get_cgroup_stats", get_child_cgroup_stats);
 	cp->pid = pid;
+	cp->cgroup = cgroup;
+	if (cgroup < 0) {
+		has_uncontained_children = true;
+	}
 
 	auto di = (struct deai *)obj;
 	if (!ignore_output) {
-		cp->out = string_buf_new();
-		cp->err = string_buf_new();
+		cp->out = tmalloc(struct byte_buf, 1);
+		cp->err = tmalloc(struct byte_buf, 1);
 
 		ev_io_init(&cp->outw, stdout_cb, opfds[0], EV_READ);
 		ev_io_start(di->loop, &cp->outw);
@@ -297,14 +421,53 @@ struct di_object *di_spawn_run(struct di_spawn *p, struct di_array argv, bool ig
 		ev_io_start(di->loop, &cp->errw);
 	}
 
-	ev_child_init(&cp->w, sigchld_handler, pid, 0);
-	ev_child_start(di->loop, &cp->w);
+	cp->spawn = p;
+	HASH_ADD_INT(p->children, pid, cp);
+	ev_ref(p->loop);
 
 	// Keep a reference from the ChildProcess object to deai, to keep it alive
 	di_member(cp, DEAI_MEMBER_NAME_RAW, obj);
 	return (void *)cp;
 }
 
+/// Whether new child processes are placed in their own cgroup. This requires cgroup v2,
+/// and the cgroup deai is in has to be delegated to deai; otherwise enabling this fails.
+static int set_use_cgroup(struct di_spawn *p, bool use_cgroup) {
+	if (use_cgroup) {
+		int ret = di_cgroup_setup();
+		if (ret != 0) {
+			return ret;
+		}
+	}
+	p->use_cgroup = use_cgroup;
+	return 0;
+}
+
+static bool get_use_cgroup(struct di_spawn *p) {
+	return p->use_cgroup;
+}
+
+/// Whether child processes are started by the launcher process, which is enabled by
+/// setting `DEAI_SPAWN_LAUNCHER` before deai starts. This becomes false if the launcher
+/// stops working, children are forked by deai itself from then on.
+static bool get_launcher(struct di_spawn *p unused) {
+	return di_launcher_is_running();
+}
+
+static void di_spawn_dtor(struct di_object *obj) {
+	auto p = (struct di_spawn *)obj;
+	struct child *c, *tmp;
+	HASH_ITER (hh, p->children, c, tmp) {
+		child_untrack(c);
+	}
+	ev_ref(p->loop);
+	ev_signal_stop(p->loop, &p->sigchld);
+}
+
+bool di_spawn_all_in_cgroup(void) {
+	return !has_uncontained_children;
+}
+
 void di_init_spawn(struct deai *di) {
 	// Become subreaper
 #ifdef __FreeBSD__
@@ -317,7 +480,19 @@ void di_init_spawn(struct deai *di) {
 	}
 
 	auto m = di_new_module_with_size(di, sizeof(struct di_spawn));
+	auto p = (struct di_spawn *)m;
 	di_method(m, "run", di_spawn_run, struct di_array, bool);
+	di_getter(m, use_cgroup, get_use_cgroup);
+	di_setter(m, use_cgroup, set_use_cgroup, bool);
+	di_getter(m, launcher, get_launcher);
+	di_set_object_dtor((struct di_object *)m, di_spawn_dtor);
+
+	// We reap children ourselves instead of using ev_child, so we can get their
+	// resource usage. This watcher alone shouldn't keep the event loop running.
+	p->loop = di->loop;
+	ev_signal_init(&p->sigchld, sigchld_handler, SIGCHLD);
+	ev_signal_start(p->loop, &p->sigchld);
+	ev_unref(p->loop);
 
 	di_register_module(di, di_string_borrow("spawn"), &m);
 }
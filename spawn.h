@@ -9,3 +9,6 @@
 #include <deai/deai.h>
 
 void di_init_spawn(struct deai *di);
+
+/// Whether every child process spawned so far has been placed in a cgroup
+bool di_spawn_all_in_cgroup(void);
@@ -7,89 +7,39 @@
 #include <string.h>
 #include <stdlib.h>
 
-#include "list.h"
+#include "byte_buf.h"
 #include "common.h"
 #include "string_buf.h"
 
 struct string_buf {
-	struct string_buf_node *head;
-	struct string_buf_node **tail;
+	struct byte_buf buf;
 };
 
-struct string_buf_node {
-	char *str;
-	size_t len;
-	struct string_buf_node *next;
-};
-
-static inline char *strldup(const char *src, size_t *len) {
-	*len = strlen(src);
-	return strdup(src);
-}
-
 void string_buf_push(struct string_buf *buf, const char *str) {
-	auto n = tmalloc(struct string_buf_node, 1);
-	n->str = strldup(str, &n->len);
-
-	*buf->tail = n;
-	buf->tail = &n->next;
+	byte_buf_append(&buf->buf, str, strlen(str));
 }
 
 void string_buf_lpush(struct string_buf *buf, const char *str, size_t len) {
-	auto n = tmalloc(struct string_buf_node, 1);
-	n->str = strndup(str, len);
-	n->len = len;
-
-	*buf->tail = n;
-	buf->tail = &n->next;
+	byte_buf_append(&buf->buf, str, strnlen(str, len));
 }
 
 bool string_buf_is_empty(struct string_buf *buf) {
-	return !buf->head;
+	return byte_buf_is_empty(&buf->buf);
 }
 
 void string_buf_clear(struct string_buf *buf) {
-	auto tmp = buf->head;
-	while(tmp) {
-		auto next = tmp->next;
-		free(tmp->str);
-		free(tmp);
-		tmp = next;
-	}
-	buf->head = NULL;
-	buf->tail = &buf->head;
+	byte_buf_clear(&buf->buf);
 }
 
 char *string_buf_dump(struct string_buf *buf) {
-	size_t len = 0;
-
-	struct string_buf_node *tmp = buf->head;
-	while(tmp) {
-		len += strlen(tmp->str);
-		tmp = tmp->next;
-	}
-
-	char *ret = malloc(len+1);
-	char *pos = ret;
-	tmp = buf->head;
-	while(tmp) {
-		memcpy(pos, tmp->str, tmp->len);
-		pos += tmp->len;
-		auto next = tmp->next;
-		free(tmp->str);
-		free(tmp);
-		tmp = next;
-	}
-
-	buf->head = NULL;
-	buf->tail = &buf->head;
-	*pos = 0;
-	return ret;
+	return byte_buf_dump(&buf->buf);
 }
 
-
 struct string_buf *string_buf_new(void) {
-	auto ret = tmalloc(struct string_buf, 1);
-	ret->tail = &ret->head;
-	return ret;
+	return tmalloc(struct string_buf, 1);
+}
+
+void string_buf_free(struct string_buf *buf) {
+	byte_buf_free(&buf->buf);
+	free(buf);
 }
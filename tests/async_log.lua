@@ -0,0 +1,20 @@
+local function read_all(path)
+    local f = io.open(path, "r")
+    local content = f:read("*a")
+    f:close()
+    return content
+end
+
+local t = di.log:async_file_target("./async_log.txt", true)
+di.log.log_target = t
+di:log("error", "first")
+di:log("error", "second\n")
+-- Nothing is written until the flush interval has passed
+assert(read_all("./async_log.txt") == "")
+t:flush()
+assert(read_all("./async_log.txt") == "first\nsecond\n")
+
+di:log("error", "third")
+di.event:timer(t.flush_interval * 2):once("elapsed", function()
+    assert(read_all("./async_log.txt") == "first\nsecond\nthird\n")
+end)
@@ -0,0 +1,144 @@
+// Compare how spawn splits its output into lines now, with byte_buf, against how it
+// used to do it with string_buf: copying every line into a new string. string_buf is
+// now backed by byte_buf, so the old linked list implementation is copied here.
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "byte_buf.h"
+#include "common.h"
+
+#define CHUNK 4096
+#define ROUNDS 20000
+
+static double now(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (double)ts.tv_sec + (double)ts.tv_nsec / 1e9;
+}
+
+static size_t bench_byte_buf(const char *input) {
+	struct byte_buf b = {0};
+	size_t lines = 0;
+	for (int i = 0; i < ROUNDS; i++) {
+		size_t pos = byte_buf_len(&b), line_start = 0;
+		memcpy(byte_buf_reserve(&b, CHUNK), input, CHUNK);
+		byte_buf_commit(&b, CHUNK);
+
+		const char *data = byte_buf_data(&b);
+		const char *eol;
+		while ((eol = memchr(data + pos, '\n', byte_buf_len(&b) - pos))) {
+			pos = eol - data;
+			lines += pos - line_start > 0;
+			line_start = ++pos;
+		}
+		byte_buf_consume(&b, line_start);
+	}
+	byte_buf_free(&b);
+	return lines;
+}
+
+struct old_string_buf_node {
+	char *str;
+	size_t len;
+	struct old_string_buf_node *next;
+};
+
+struct old_string_buf {
+	struct old_string_buf_node *head;
+	struct old_string_buf_node **tail;
+};
+
+static void old_string_buf_push(struct old_string_buf *buf, const char *str) {
+	auto n = tmalloc(struct old_string_buf_node, 1);
+	n->len = strlen(str);
+	n->str = strdup(str);
+
+	*buf->tail = n;
+	buf->tail = &n->next;
+}
+
+static void old_string_buf_lpush(struct old_string_buf *buf, const char *str, size_t len) {
+	auto n = tmalloc(struct old_string_buf_node, 1);
+	n->str = strndup(str, len);
+	n->len = len;
+
+	*buf->tail = n;
+	buf->tail = &n->next;
+}
+
+static char *old_string_buf_dump(struct old_string_buf *buf) {
+	size_t len = 0;
+
+	struct old_string_buf_node *tmp = buf->head;
+	while (tmp) {
+		len += strlen(tmp->str);
+		tmp = tmp->next;
+	}
+
+	char *ret = malloc(len + 1);
+	char *pos = ret;
+	tmp = buf->head;
+	while (tmp) {
+		memcpy(pos, tmp->str, tmp->len);
+		pos += tmp->len;
+		auto next = tmp->next;
+		free(tmp->str);
+		free(tmp);
+		tmp = next;
+	}
+
+	buf->head = NULL;
+	buf->tail = &buf->head;
+	*pos = 0;
+	return ret;
+}
+
+static size_t bench_string_buf(const char *input) {
+	struct old_string_buf ob = {.head = NULL, .tail = &ob.head}, *b = &ob;
+	char buf[CHUNK + 1];
+	size_t lines = 0;
+	for (int i = 0; i < ROUNDS; i++) {
+		memcpy(buf, input, CHUNK);
+		buf[CHUNK] = '\0';
+		const char *pos = buf;
+		while (1) {
+			char *eol = memchr(pos, '\n', buf + CHUNK - pos);
+			if (!eol) {
+				old_string_buf_lpush(b, pos, buf + CHUNK - pos);
+				break;
+			}
+			*eol = '\0';
+			old_string_buf_push(b, pos);
+			char *line = old_string_buf_dump(b);
+			lines += line[0] != '\0';
+			free(line);
+			pos = eol + 1;
+		}
+	}
+	free(old_string_buf_dump(b));
+	return lines;
+}
+
+int main() {
+	// Lines of varying length, some of them cross chunk boundaries
+	char *input = malloc(CHUNK);
+	for (int i = 0; i < CHUNK; i++) {
+		input[i] = i % 97 == 96 ? '\n' : 'a' + i % 26;
+	}
+
+	double start = now();
+	size_t lines1 = bench_byte_buf(input);
+	double t1 = now() - start;
+
+	start = now();
+	size_t lines2 = bench_string_buf(input);
+	double t2 = now() - start;
+
+	DI_CHECK(lines1 == lines2);
+	printf("byte_buf: %.3f ms, %zu lines\n", t1 * 1e3, lines1);
+	printf("old string_buf: %.3f ms, %zu lines\n", t2 * 1e3, lines2);
+	free(input);
+	return 0;
+}
@@ -0,0 +1,94 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "byte_buf.h"
+#include "common.h"
+
+static void test_append_and_consume(void) {
+	struct byte_buf b = {0};
+	DI_CHECK(byte_buf_is_empty(&b));
+
+	byte_buf_append(&b, "hello", 5);
+	DI_CHECK(byte_buf_len(&b) == 5);
+	DI_CHECK(b.heap == NULL, "small content should be stored inline");
+	DI_CHECK(memcmp(byte_buf_data(&b), "hello", 5) == 0);
+
+	byte_buf_consume(&b, 2);
+	DI_CHECK(byte_buf_len(&b) == 3);
+	DI_CHECK(memcmp(byte_buf_data(&b), "llo", 3) == 0);
+
+	// Consuming more than what's in the buffer empties it
+	byte_buf_consume(&b, 100);
+	DI_CHECK(byte_buf_is_empty(&b));
+	byte_buf_free(&b);
+}
+
+static void test_growth(void) {
+	struct byte_buf b = {0};
+	char expected[10000];
+	for (size_t i = 0; i < sizeof(expected); i++) {
+		expected[i] = (char)(i % 251);
+		byte_buf_append(&b, &expected[i], 1);
+	}
+	DI_CHECK(byte_buf_len(&b) == sizeof(expected));
+	DI_CHECK(b.heap != NULL);
+	DI_CHECK(memcmp(byte_buf_data(&b), expected, sizeof(expected)) == 0);
+
+	// Null bytes are preserved
+	byte_buf_clear(&b);
+	byte_buf_append(&b, "a\0b", 3);
+	DI_CHECK(byte_buf_len(&b) == 3);
+	DI_CHECK(memcmp(byte_buf_data(&b), "a\0b", 3) == 0);
+	byte_buf_free(&b);
+	DI_CHECK(b.heap == NULL);
+}
+
+static void test_reserve_and_commit(void) {
+	struct byte_buf b = {0};
+	byte_buf_append(&b, "abc", 3);
+	char *p = byte_buf_reserve(&b, 1000);
+	DI_CHECK(byte_buf_capacity(&b) >= 1003);
+	memset(p, 'x', 1000);
+	byte_buf_commit(&b, 1000);
+	DI_CHECK(byte_buf_len(&b) == 1003);
+	DI_CHECK(memcmp(byte_buf_data(&b), "abcx", 4) == 0);
+
+	// Consumed space is reused instead of growing the buffer
+	size_t cap = byte_buf_capacity(&b);
+	byte_buf_consume(&b, 1000);
+	byte_buf_reserve(&b, cap - 3);
+	DI_CHECK(byte_buf_capacity(&b) == cap);
+	DI_CHECK(memcmp(byte_buf_data(&b), "xxx", 3) == 0);
+	byte_buf_free(&b);
+}
+
+static void test_slice_and_dump(void) {
+	struct byte_buf b = {0};
+	byte_buf_printf(&b, "%s=%d", "answer", 42);
+	DI_CHECK(byte_buf_len(&b) == 9);
+
+	auto s = byte_buf_slice(&b, 7, 100);
+	DI_CHECK(s.len == 2);
+	DI_CHECK(memcmp(s.data, "42", 2) == 0);
+	s = byte_buf_slice(&b, 100, 1);
+	DI_CHECK(s.len == 0);
+
+	// printf that doesn't fit in the inline storage
+	byte_buf_printf(&b, "%0100d", 0);
+	DI_CHECK(byte_buf_len(&b) == 109);
+
+	char *str = byte_buf_dump(&b);
+	DI_CHECK(strlen(str) == 109);
+	DI_CHECK(strncmp(str, "answer=420000", 13) == 0);
+	DI_CHECK(byte_buf_is_empty(&b));
+	free(str);
+	byte_buf_free(&b);
+}
+
+int main() {
+	test_append_and_consume();
+	test_growth();
+	test_reserve_and_commit();
+	test_slice_and_dump();
+	return 0;
+}
@@ -2,6 +2,10 @@ di:load_plugin("./plugins/dbus/di_dbus.so")
 di.os.env.DBUS_SESSION_BUS_PID = nil
 di.os.env.DBUS_SESSION_BUS_ADDRESS = nil
 di.os.env.DISPLAY = nil
+-- The bus can activate deai.test.Stuck from tests/data, but the activated program never
+-- takes the name, so calls to it are never answered
+local tests_dir = debug.getinfo(1, "S").source:match("^@(.*)/[^/]*$")
+di.os.env.XDG_DATA_DIRS = tests_dir.."/data"
 local dbusl = di.spawn:run({"dbus-daemon", "--print-address=1", "--print-pid=2", "--session", "--fork"}, false)
 local outlh
 outlh = dbusl:on("stdout_line", function(l)
@@ -64,5 +68,124 @@ dbusl:once("exit", function()
     call_with_error(o, "org.dummy.Dummy", 1)
     call_with_error(o, "org.dummy.Dummy", "asdf")
     o = nil
+
+    -- Export an object, and call it through the bus
+    local bus = di.dbus.session_bus
+    local export = bus:export("/deai/test", "deai.Test", {
+        Echo = function(_, s)
+            return s
+        end
+    })
+    local t = bus:get(bus.unique_name, "/deai/test")
+    -- The export is closed once both the single call and the batch are done
+    local pending = 2
+    local function finish()
+        pending = pending - 1
+        if pending == 0 then
+            export:close()
+        end
+    end
+    t["deai.Test.Echo"](t, "hello"):once("reply", function(s)
+        print(s)
+        finish()
+    end)
+
+    -- Batch calls to the export, the results should come back in order, with the
+    -- failed call in the middle
+    local batch = bus:batch()
+    batch:add(t, "deai.Test.Echo", "first")
+    batch:add(t, "deai.Test.Missing")
+    batch:add(t, "Echo", "third")
+    batch:once("done", function(results)
+        assert(#results == 3)
+        assert(results[1][1] == "first")
+        print(results[2].errmsg)
+        assert(results[2].errmsg:match("UnknownMethod"))
+        assert(results[3][1] == "third")
+        finish()
+    end)
+    batch:send()
+    batch = nil
+    t = nil
+
+    -- Property caches of an exported object. The a{sv} of changed values can't be
+    -- built from lua, so changes are sent as invalidated properties, which the caches
+    -- then fetch with Get.
+    local props = di:create_di_object()
+    local value
+    props.GetAll = function(_, interface)
+        assert(interface == "deai.Props")
+    end
+    props.Get = function(_, interface, name)
+        assert(interface == "deai.Props" and name == "Value")
+        return value
+    end
+    local pexport = bus:export("/deai/props", "org.freedesktop.DBus.Properties", props)
+    pexport:forward("PropertiesChanged")
+    local function change(v)
+        value = v
+        props:emit("PropertiesChanged", "deai.Props", 0, {"Value"})
+    end
+
+    -- The two caches share one match rule, which has to stay until both are gone
+    local p = bus:get(bus.unique_name, "/deai/props")
+    local c1 = p:properties("deai.Props")
+    local c2 = p:properties("deai.Props")
+    p = nil
+    local nready = 0
+    local function ready()
+        nready = nready + 1
+        if nready == 2 then
+            change(1)
+        end
+    end
+    c1:once("ready", ready)
+    c2:once("ready", ready)
+
+    local nchanged = 0
+    local function changed()
+        nchanged = nchanged + 1
+        if nchanged == 2 then
+            -- Drop the first cache, the second one should still see changes
+            c1 = nil
+            collectgarbage("collect")
+            change(2)
+        end
+    end
+    c1:once("Value-changed", function(v)
+        assert(v == 1)
+        assert(c1.Value == 1)
+        changed()
+    end)
+    local c2lh
+    c2lh = c2:on("Value-changed", function(v)
+        assert(c2.Value == v)
+        if v == 1 then
+            changed()
+        else
+            assert(v == 2)
+            c2lh:stop()
+            c2 = nil
+            pexport:close()
+        end
+    end)
+
+    -- A call that is never answered should fail once its timeout is up, the time spent
+    -- introspecting the object included. The stuck service fails to activate by itself
+    -- after 5 seconds, so the error has to come well before that.
+    local stuck = bus:get("deai.test.Stuck", "/deai/stuck")
+    local never = stuck["deai.Test.Never"]
+    never.timeout = 0.5
+    local deadline = di.event:timer(1.5)
+    deadline:once("elapsed", function()
+        assert(false, "method call didn't time out")
+    end)
+    never(stuck):once("error", function(e)
+        print(e)
+        assert(e:match("Did not receive a reply") or e:match("timed out"))
+        deadline:stop()
+    end)
+    never = nil
+    stuck = nil
     collectgarbage("collect")
 end)
@@ -0,0 +1,399 @@
+// Benchmarks for the dbus plugin. It has to be loaded into deai on a private session bus,
+// with dbus_bench_service owning deai.bench.Service, which is how the "dbus" benchmark is
+// run.
+//
+// The serializer and the deserializer are measured in process, method calls and signals
+// go through the bus. Results are printed to stdout, one JSON object per line:
+//
+//     {"benchmark": "...", "iterations": N, "seconds": S, "per_second": R}
+#include <dbus/dbus.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <deai/deai.h>
+#include <deai/helper.h>
+
+#include "common.h"
+#include "plugins/dbus/sedes.h"
+
+#define BENCH_NAME "deai.bench.Service"
+#define BENCH_PATH "/deai/bench"
+
+#define SEDES_ROUNDS 20000
+#define CALL_ROUNDS 2000
+/// Fewer rounds for the payloads that are big
+#define BIG_SEDES_ROUNDS 200
+#define BIG_CALL_ROUNDS 200
+#define SIGNAL_COUNT 2000
+#define SIGNAL_LISTENERS 16
+#define STRINGS_LENGTH 100
+#define BYTES_LENGTH (64 * 1024)
+#define DICT_LENGTH 20
+
+struct payload {
+	const char *name;
+	/// Signature for the typed serializer
+	const char *signature;
+	struct di_tuple args;
+	int sedes_rounds, call_rounds;
+};
+
+static struct payload payloads[4];
+
+static double now(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (double)ts.tv_sec + (double)ts.tv_nsec / 1e9;
+}
+
+static void report(const char *kind, const char *name, uint64_t iterations, double seconds) {
+	printf("{\"benchmark\": \"%s_%s\", \"iterations\": %" PRIu64 ", \"seconds\": %.6f, "
+	       "\"per_second\": %.1f}\n",
+	       kind, name, iterations, seconds, (double)iterations / seconds);
+	fflush(stdout);
+}
+
+static struct di_variant variant_of(di_type_t type, const void *value) {
+	struct di_variant ret = {malloc(di_sizeof_type(type)), type};
+	memcpy(ret.value, value, di_sizeof_type(type));
+	return ret;
+}
+
+static void init_payloads(void) {
+	payloads[0] =
+	    (struct payload){"empty", "", DI_TUPLE_INIT, SEDES_ROUNDS, CALL_ROUNDS};
+
+	// Typical arguments of a method call
+	auto basic = tmalloc(struct di_variant, 4);
+	auto name = di_string_dup("deai");
+	basic[0] = variant_of(DI_TYPE_STRING, &name);
+	basic[1] = variant_of(DI_TYPE_INT, &(int64_t){42});
+	basic[2] = variant_of(DI_TYPE_FLOAT, &(double){1.5});
+	basic[3] = variant_of(DI_TYPE_BOOL, &(bool){true});
+	payloads[1] =
+	    (struct payload){"basic", "sidb", {4, basic}, SEDES_ROUNDS, CALL_ROUNDS};
+
+	struct di_array strings = {STRINGS_LENGTH, tmalloc(struct di_string, STRINGS_LENGTH),
+	                           DI_TYPE_STRING};
+	for (int i = 0; i < STRINGS_LENGTH; i++) {
+		char *s;
+		asprintf(&s, "string number %d", i);
+		((struct di_string *)strings.arr)[i] = di_string_dup(s);
+		free(s);
+	}
+	payloads[2] = (struct payload){"strings", "as", {1, tmalloc(struct di_variant, 1)},
+	                               SEDES_ROUNDS, CALL_ROUNDS};
+	payloads[2].args.elements[0] = variant_of(DI_TYPE_ARRAY, &strings);
+
+	// Like image data in notifications
+	struct di_array bytes = {BYTES_LENGTH, tmalloc(uint64_t, BYTES_LENGTH), DI_TYPE_UINT};
+	for (int i = 0; i < BYTES_LENGTH; i++) {
+		((uint64_t *)bytes.arr)[i] = i % 256;
+	}
+	payloads[3] = (struct payload){"bytes", "ay", {1, tmalloc(struct di_variant, 1)},
+	                               BIG_SEDES_ROUNDS, BIG_CALL_ROUNDS};
+	payloads[3].args.elements[0] = variant_of(DI_TYPE_ARRAY, &bytes);
+}
+
+static void free_payloads(void) {
+	for (size_t x = 0; x < ARRAY_SIZE(payloads); x++) {
+		di_free_tuple(payloads[x].args);
+	}
+}
+
+/// An a{sv} dict, like the ones property maps are sent in. They can't be serialized from
+/// deai values, so the message is built directly.
+static DBusMessage *new_dict_message(void) {
+	auto msg = dbus_message_new_method_call(BENCH_NAME, BENCH_PATH, BENCH_NAME, "Echo");
+	DBusMessageIter i, dict, entry, value;
+	dbus_message_iter_init_append(msg, &i);
+	dbus_message_iter_open_container(&i, DBUS_TYPE_ARRAY, "{sv}", &dict);
+	for (int x = 0; x < DICT_LENGTH; x++) {
+		char *key;
+		asprintf(&key, "Property%d", x);
+		dbus_message_iter_open_container(&dict, DBUS_TYPE_DICT_ENTRY, NULL, &entry);
+		dbus_message_iter_append_basic(&entry, DBUS_TYPE_STRING, &key);
+		if (x % 2 == 0) {
+			dbus_message_iter_open_container(&entry, DBUS_TYPE_VARIANT, "s", &value);
+			dbus_message_iter_append_basic(&value, DBUS_TYPE_STRING, &key);
+		} else {
+			dbus_uint32_t u = x;
+			dbus_message_iter_open_container(&entry, DBUS_TYPE_VARIANT, "u", &value);
+			dbus_message_iter_append_basic(&value, DBUS_TYPE_UINT32, &u);
+		}
+		dbus_message_iter_close_container(&entry, &value);
+		dbus_message_iter_close_container(&dict, &entry);
+		free(key);
+	}
+	dbus_message_iter_close_container(&i, &dict);
+	return msg;
+}
+
+static void bench_serialize(const struct payload *p) {
+	double start = now();
+	for (int x = 0; x < p->sedes_rounds; x++) {
+		auto msg = dbus_message_new_method_call(BENCH_NAME, BENCH_PATH, BENCH_NAME, "Echo");
+		DBusMessageIter i;
+		dbus_message_iter_init_append(msg, &i);
+		DI_CHECK_OK(_dbus_serialize_struct(&i, p->args));
+		dbus_message_unref(msg);
+	}
+	report("serialize", p->name, p->sedes_rounds, now() - start);
+
+	start = now();
+	for (int x = 0; x < p->sedes_rounds; x++) {
+		auto msg = dbus_message_new_method_call(BENCH_NAME, BENCH_PATH, BENCH_NAME, "Echo");
+		DBusMessageIter i;
+		dbus_message_iter_init_append(msg, &i);
+		DI_CHECK_OK(_dbus_serialize_struct_typed(&i, p->args, p->signature));
+		dbus_message_unref(msg);
+	}
+	report("serialize_typed", p->name, p->sedes_rounds, now() - start);
+}
+
+static void bench_deserialize(const char *name, DBusMessage *msg, int rounds) {
+	double start = now();
+	for (int x = 0; x < rounds; x++) {
+		DBusMessageIter i;
+		struct di_tuple t;
+		dbus_message_iter_init(msg, &i);
+		_dbus_deserialize_struct(&i, &t);
+		di_free_tuple(t);
+	}
+	report("deserialize", name, rounds, now() - start);
+}
+
+static void bench_sedes(void) {
+	for (size_t x = 0; x < ARRAY_SIZE(payloads); x++) {
+		auto p = &payloads[x];
+		bench_serialize(p);
+
+		// Deserialize what the typed serializer produces, which is what a reply from
+		// a service would look like
+		auto msg = dbus_message_new_method_call(BENCH_NAME, BENCH_PATH, BENCH_NAME, "Echo");
+		DBusMessageIter i;
+		dbus_message_iter_init_append(msg, &i);
+		DI_CHECK_OK(_dbus_serialize_struct_typed(&i, p->args, p->signature));
+		bench_deserialize(p->name, msg, p->sedes_rounds);
+		dbus_message_unref(msg);
+	}
+
+	auto msg = new_dict_message();
+	bench_deserialize("dict", msg, SEDES_ROUNDS);
+	dbus_message_unref(msg);
+}
+
+/// State of the benchmarks that go through the bus. Every payload is echoed back
+/// `call_rounds` times, one call after another, then Ping signals are sent to
+/// SIGNAL_LISTENERS listeners.
+struct dbus_bench {
+	struct di_object;
+	struct di_weak_object *di;
+	uint64_t root_handle;
+	struct di_object *object;
+
+	/// Index of the payload being echoed, ARRAY_SIZE(payloads) while Pings are sent
+	size_t current;
+	int remaining;
+	double start;
+	struct di_object *reply, *reply_handle, *error_handle;
+
+	uint64_t pings;
+	struct di_object *ping_handles[SIGNAL_LISTENERS];
+};
+
+struct bench_handler {
+	struct di_object;
+	struct dbus_bench *b;
+};
+
+static void bench_finish(struct dbus_bench *b, int exit_code) {
+	di_object_with_cleanup di = di_upgrade_weak_ref(b->di);
+
+	// Drops the last reference to `b`
+	auto roots = di_get_roots();
+	DI_CHECK_OK(di_call(roots, "__remove_anonymous", b->root_handle));
+	if (di) {
+		di_call(di, "exit", exit_code);
+	}
+}
+
+static void bench_drop_reply(struct dbus_bench *b) {
+	di_unref_object(b->reply_handle);
+	di_unref_object(b->error_handle);
+	di_unref_object(b->reply);
+	b->reply = b->reply_handle = b->error_handle = NULL;
+}
+
+static void bench_free(struct di_object *o) {
+	auto b = (struct dbus_bench *)o;
+	if (b->reply) {
+		bench_drop_reply(b);
+	}
+	for (int i = 0; i < SIGNAL_LISTENERS; i++) {
+		if (b->ping_handles[i]) {
+			di_unref_object(b->ping_handles[i]);
+		}
+	}
+	di_unref_object(b->object);
+	di_drop_weak_ref(&b->di);
+	free_payloads();
+}
+
+static struct di_object *new_handler(struct dbus_bench *b, di_call_fn_t fn) {
+	auto h = di_new_object_with_type(struct bench_handler);
+	h->b = b;
+	di_set_object_call((struct di_object *)h, fn);
+	return (struct di_object *)h;
+}
+
+static int bench_on_reply(struct di_object *o, di_type_t *rt, union di_value *ret,
+                          struct di_tuple t);
+static int bench_on_error(struct di_object *o, di_type_t *rt, union di_value *ret,
+                          struct di_tuple t);
+
+static void bench_send(struct dbus_bench *b) {
+	const char *method;
+	struct di_tuple args;
+	int64_t count = SIGNAL_COUNT;
+	struct di_variant count_arg = di_variant(count);
+	if (b->current < ARRAY_SIZE(payloads)) {
+		method = BENCH_NAME ".Echo";
+		args = payloads[b->current].args;
+	} else {
+		method = BENCH_NAME ".Emit";
+		args = (struct di_tuple){1, &count_arg};
+	}
+
+	di_type_t rtype;
+	union di_value ret;
+	bool called;
+	DI_CHECK_OK(
+	    di_callx(b->object, di_string_borrow(method), &rtype, &ret, args, &called));
+	DI_CHECK(rtype == DI_TYPE_OBJECT);
+
+	struct di_string errmsg;
+	if (di_get(ret.object, "errmsg", errmsg) == 0) {
+		fprintf(stderr, "Failed to call %s: %.*s\n", method, (int)errmsg.length,
+		        errmsg.data);
+		di_free_string(errmsg);
+		di_unref_object(ret.object);
+		bench_finish(b, 1);
+		return;
+	}
+
+	b->reply = ret.object;
+	di_object_with_cleanup on_reply = new_handler(b, bench_on_reply);
+	di_object_with_cleanup on_error = new_handler(b, bench_on_error);
+	b->reply_handle = di_listen_to(b->reply, di_string_borrow("reply"), on_reply);
+	b->error_handle = di_listen_to(b->reply, di_string_borrow("error"), on_error);
+}
+
+static int bench_on_ping(struct di_object *o, di_type_t *rt, union di_value *ret unused,
+                         struct di_tuple t unused) {
+	((struct bench_handler *)o)->b->pings++;
+	*rt = DI_TYPE_NIL;
+	return 0;
+}
+
+static void bench_start_pings(struct dbus_bench *b) {
+	for (int i = 0; i < SIGNAL_LISTENERS; i++) {
+		di_object_with_cleanup on_ping = new_handler(b, bench_on_ping);
+		b->ping_handles[i] =
+		    di_listen_to(b->object, di_string_borrow(BENCH_NAME ".Ping"), on_ping);
+	}
+}
+
+static int bench_on_reply(struct di_object *o, di_type_t *rt, union di_value *ret unused,
+                          struct di_tuple t) {
+	auto b = ((struct bench_handler *)o)->b;
+	*rt = DI_TYPE_NIL;
+	bench_drop_reply(b);
+
+	if (b->current == ARRAY_SIZE(payloads)) {
+		double seconds = now() - b->start;
+		uint64_t expected = (uint64_t)SIGNAL_COUNT * SIGNAL_LISTENERS;
+		if (b->pings != expected) {
+			fprintf(stderr, "Received %" PRIu64 " pings, expected %" PRIu64 "\n",
+			        b->pings, expected);
+			bench_finish(b, 1);
+			return 0;
+		}
+		report("signal", "fanout", expected, seconds);
+		bench_finish(b, 0);
+		return 0;
+	}
+
+	DI_CHECK(t.length == payloads[b->current].args.length);
+	if (--b->remaining > 0) {
+		bench_send(b);
+		return 0;
+	}
+
+	report("call", payloads[b->current].name, payloads[b->current].call_rounds,
+	       now() - b->start);
+	b->current++;
+	if (b->current == ARRAY_SIZE(payloads)) {
+		bench_start_pings(b);
+	} else {
+		b->remaining = payloads[b->current].call_rounds;
+	}
+	b->start = now();
+	bench_send(b);
+	return 0;
+}
+
+static int bench_on_error(struct di_object *o, di_type_t *rt, union di_value *ret unused,
+                          struct di_tuple t) {
+	auto b = ((struct bench_handler *)o)->b;
+	*rt = DI_TYPE_NIL;
+	if (t.length > 0 && t.elements[0].type == DI_TYPE_STRING) {
+		auto message = t.elements[0].value->string;
+		fprintf(stderr, "Method call failed: %.*s\n", (int)message.length, message.data);
+	} else {
+		fprintf(stderr, "Method call failed\n");
+	}
+	bench_drop_reply(b);
+	bench_finish(b, 1);
+	return 0;
+}
+
+DEAI_PLUGIN_ENTRY_POINT(di) {
+	init_payloads();
+	bench_sedes();
+
+	DI_CHECK_OK(di_call(di, "load_plugin", di_string_borrow("./plugins/dbus/di_dbus.so")));
+	di_object_with_cleanup dbusm = NULL;
+	DI_CHECK_OK(di_get(di, "dbus", dbusm));
+	di_object_with_cleanup bus = NULL;
+	DI_CHECK_OK(di_get(dbusm, "session_bus", bus));
+
+	struct di_string errmsg;
+	if (di_get(bus, "errmsg", errmsg) == 0) {
+		fprintf(stderr, "Failed to connect to the session bus: %.*s\n",
+		        (int)errmsg.length, errmsg.data);
+		di_free_string(errmsg);
+		free_payloads();
+		di_call(di, "exit", 1);
+		return 0;
+	}
+
+	auto b = di_new_object_with_type(struct dbus_bench);
+	b->di = di_weakly_ref_object((struct di_object *)di);
+	DI_CHECK_OK(di_callr(bus, "get", b->object, di_string_borrow(BENCH_NAME),
+	                     di_string_borrow(BENCH_PATH)));
+	di_set_object_dtor((struct di_object *)b, bench_free);
+
+	// Keep the benchmark alive until it's finished
+	auto roots = di_get_roots();
+	DI_CHECK_OK(di_callr(roots, "__add_anonymous", b->root_handle, (struct di_object *)b));
+	di_unref_object((struct di_object *)b);
+
+	b->remaining = payloads[0].call_rounds;
+	b->start = now();
+	bench_send(b);
+	return 0;
+}
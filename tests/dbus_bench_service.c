@@ -0,0 +1,149 @@
+// A D-Bus service for dbus_bench. It takes the name deai.bench.Service on the session
+// bus, then runs the command it's given, and serves until that command exits. The exit
+// status of the command is returned.
+//
+// Methods of deai.bench.Service, on /deai/bench:
+//
+// * Echo(...) replies with its arguments
+// * Emit(count: x) emits `count` Ping(n: u) signals, then replies
+#include <dbus/dbus.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#define BENCH_NAME "deai.bench.Service"
+#define BENCH_PATH "/deai/bench"
+
+static void copy_value(DBusMessageIter *in, DBusMessageIter *out) {
+	int type = dbus_message_iter_get_arg_type(in);
+	if (dbus_type_is_basic(type)) {
+		DBusBasicValue v;
+		dbus_message_iter_get_basic(in, &v);
+		dbus_message_iter_append_basic(out, type, &v);
+		return;
+	}
+
+	DBusMessageIter sub_in, sub_out;
+	dbus_message_iter_recurse(in, &sub_in);
+	char *signature = NULL;
+	if (type == DBUS_TYPE_VARIANT) {
+		signature = dbus_message_iter_get_signature(&sub_in);
+	} else if (type == DBUS_TYPE_ARRAY) {
+		// Signature of the elements
+		char *array_signature = dbus_message_iter_get_signature(in);
+		signature = strdup(array_signature + 1);
+		dbus_free(array_signature);
+	}
+	dbus_message_iter_open_container(out, type, signature, &sub_out);
+	if (type == DBUS_TYPE_VARIANT) {
+		dbus_free(signature);
+	} else {
+		free(signature);
+	}
+
+	if (type == DBUS_TYPE_ARRAY &&
+	    dbus_type_is_fixed(dbus_message_iter_get_element_type(in))) {
+		const void *data;
+		int length;
+		dbus_message_iter_get_fixed_array(&sub_in, &data, &length);
+		dbus_message_iter_append_fixed_array(
+		    &sub_out, dbus_message_iter_get_element_type(in), &data, length);
+	} else {
+		while (dbus_message_iter_get_arg_type(&sub_in) != DBUS_TYPE_INVALID) {
+			copy_value(&sub_in, &sub_out);
+			dbus_message_iter_next(&sub_in);
+		}
+	}
+	dbus_message_iter_close_container(out, &sub_out);
+}
+
+static DBusMessage *echo(DBusMessage *msg) {
+	DBusMessage *reply = dbus_message_new_method_return(msg);
+	DBusMessageIter in, out;
+	dbus_message_iter_init_append(reply, &out);
+	if (dbus_message_iter_init(msg, &in)) {
+		do {
+			copy_value(&in, &out);
+		} while (dbus_message_iter_next(&in));
+	}
+	return reply;
+}
+
+static DBusMessage *emit(DBusConnection *conn, DBusMessage *msg) {
+	dbus_int64_t count;
+	if (!dbus_message_get_args(msg, NULL, DBUS_TYPE_INT64, &count, DBUS_TYPE_INVALID)) {
+		return dbus_message_new_error(msg, DBUS_ERROR_INVALID_ARGS,
+		                              "Expected one int64 argument");
+	}
+	for (dbus_uint32_t n = 0; n < count; n++) {
+		DBusMessage *signal = dbus_message_new_signal(BENCH_PATH, BENCH_NAME, "Ping");
+		dbus_message_append_args(signal, DBUS_TYPE_UINT32, &n, DBUS_TYPE_INVALID);
+		dbus_connection_send(conn, signal, NULL);
+		dbus_message_unref(signal);
+	}
+	// The reply is sent after all the signals, so the client has received them all by
+	// the time it sees the reply.
+	return dbus_message_new_method_return(msg);
+}
+
+static DBusHandlerResult handle_message(DBusConnection *conn, DBusMessage *msg, void *ud) {
+	DBusMessage *reply;
+	if (dbus_message_is_method_call(msg, BENCH_NAME, "Echo")) {
+		reply = echo(msg);
+	} else if (dbus_message_is_method_call(msg, BENCH_NAME, "Emit")) {
+		reply = emit(conn, msg);
+	} else {
+		return DBUS_HANDLER_RESULT_NOT_YET_HANDLED;
+	}
+	dbus_connection_send(conn, reply, NULL);
+	dbus_message_unref(reply);
+	return DBUS_HANDLER_RESULT_HANDLED;
+}
+
+int main(int argc, char **argv) {
+	if (argc < 2) {
+		fprintf(stderr, "Usage: %s <command> <args>...\n", argv[0]);
+		return 1;
+	}
+
+	DBusError e;
+	dbus_error_init(&e);
+	DBusConnection *conn = dbus_bus_get(DBUS_BUS_SESSION, &e);
+	if (!conn) {
+		fprintf(stderr, "Failed to connect to the session bus: %s\n", e.message);
+		return 1;
+	}
+	if (dbus_bus_request_name(conn, BENCH_NAME, DBUS_NAME_FLAG_DO_NOT_QUEUE, &e) !=
+	    DBUS_REQUEST_NAME_REPLY_PRIMARY_OWNER) {
+		fprintf(stderr, "Failed to own %s: %s\n", BENCH_NAME,
+		        e.message ? e.message : "name is taken");
+		return 1;
+	}
+	const DBusObjectPathVTable vtable = {.message_function = handle_message};
+	dbus_connection_register_object_path(conn, BENCH_PATH, &vtable, NULL);
+
+	// The name is owned now, the command doesn't need to wait for it
+	pid_t pid = fork();
+	if (pid < 0) {
+		perror("fork");
+		return 1;
+	}
+	if (pid == 0) {
+		execvp(argv[1], argv + 1);
+		perror("execvp");
+		_exit(127);
+	}
+
+	int status;
+	while (waitpid(pid, &status, WNOHANG) == 0) {
+		if (!dbus_connection_read_write_dispatch(conn, 100)) {
+			// Disconnected from the bus, just wait for the command
+			waitpid(pid, &status, 0);
+			break;
+		}
+	}
+	dbus_connection_unref(conn);
+	return WIFEXITED(status) ? WEXITSTATUS(status) : 1;
+}
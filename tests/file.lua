@@ -20,6 +20,14 @@ for _, i in pairs(events) do
     table.insert(listen_handles, w:on(i, sigh(i)))
 end
 
+got_batch = false
+table.insert(listen_handles, w:on("events", function(evs)
+    for _, e in ipairs(evs) do
+        print("batched event: "..e.event, e.watch, e.path, e.cookie)
+    end
+    got_batch = true
+end))
+
 fname = "./testdir/testfile"
 f = di.log:file_target(fname, false)
 f:write("Test")
@@ -41,6 +49,7 @@ function run_one(i)
         if i < #cmds then
             table.insert(listen_handles, c:on("exit", run_one(i+1)))
         else
+            assert(got_batch)
             w:remove("testdir")
             w = nil
             for _, lh in pairs(listen_handles) do
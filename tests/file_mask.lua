@@ -0,0 +1,44 @@
+di:load_plugin("./plugins/file/di_file.so")
+
+md = di.spawn:run({"mkdir", "testdir_mask"}, true)
+listen_handles = {}
+created = false
+modified = false
+
+table.insert(listen_handles, md:on("exit", function()
+w = di.file:watch({"testdir_mask"})
+-- Only "create" events are requested from the kernel at first
+table.insert(listen_handles, w:on("create", function(_, path)
+    created = true
+    -- Now "modify" events are requested too
+    table.insert(listen_handles, w:on("modify", function(_, path)
+        modified = true
+    end))
+end))
+
+cmds = {
+    {"touch", "testdir_mask/file"},
+    {"sh", "-c", "echo test > testdir_mask/file"},
+    {"rm", "-r", "testdir_mask"},
+}
+
+function run_one(i)
+    return function()
+        c = di.spawn:run(cmds[i], true)
+        if i < #cmds then
+            table.insert(listen_handles, c:on("exit", run_one(i+1)))
+        else
+            table.insert(listen_handles, c:on("exit", function()
+                assert(created)
+                assert(modified)
+                w = nil
+                for _, lh in pairs(listen_handles) do
+                    lh:stop()
+                end
+                collectgarbage()
+            end))
+        end
+    end
+end
+run_one(1)()
+end))
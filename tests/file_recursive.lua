@@ -0,0 +1,57 @@
+di:load_plugin("./plugins/file/di_file.so")
+
+md = di.spawn:run({"mkdir", "-p", "testdir_recursive/a/b"}, true)
+listen_handles = {}
+seen = {}
+
+table.insert(listen_handles, md:on("exit", function()
+w = di.file:watch_recursive("testdir_recursive")
+print("backend: "..w.backend)
+
+table.insert(listen_handles, w:on("create", function(root, path)
+    print("create", root, path)
+    seen[path] = true
+end))
+
+deleted = {}
+table.insert(listen_handles, w:on("delete", function(root, path)
+    print("delete", root, path)
+    deleted[path] = true
+end))
+
+cmds = {
+    {"mkdir", "testdir_recursive/a/b/c"},
+    {"touch", "testdir_recursive/a/b/c/file"},
+    {"mv", "testdir_recursive/a/b", "testdir_recursive/moved"},
+    {"touch", "testdir_recursive/moved/c/file2"},
+    {"mkdir", "-p", "testdir_recursive/gone/sub"},
+    -- Deleted after being moved away, in the same batch of events
+    {"sh", "-c", "mv testdir_recursive/gone testdir_recursive_gone && rm -r testdir_recursive_gone"},
+    {"rm", "-r", "testdir_recursive"},
+}
+
+function run_one(i)
+    return function()
+        c = di.spawn:run(cmds[i], true)
+        if i < #cmds then
+            table.insert(listen_handles, c:on("exit", run_one(i+1)))
+        else
+            table.insert(listen_handles, c:on("exit", function()
+                assert(seen["a/b/c"])
+                assert(seen["a/b/c/file"])
+                assert(seen["moved/c/file2"])
+                assert(seen["gone/sub"])
+                -- "gone/sub" was deleted outside of the tree, and must not be
+                -- reported as "sub"
+                assert(not deleted["sub"])
+                w = nil
+                for _, lh in pairs(listen_handles) do
+                    lh:stop()
+                end
+                collectgarbage()
+            end))
+        end
+    end
+end
+run_one(1)()
+end))
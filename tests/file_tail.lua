@@ -0,0 +1,48 @@
+di:load_plugin("./plugins/file/di_file.so")
+
+fname = "./tail_testfile"
+md = di.spawn:run({"sh", "-c", "echo skipped > "..fname}, true)
+listen_handles = {}
+lines = {}
+rotated = false
+
+function finish()
+    t = nil
+    -- The old file has everything written to it before it was rotated
+    r = di.file:read_async(fname..".1")
+    table.insert(listen_handles, r:on("done", function(contents)
+        assert(contents == "skipped\none\ntwo\n")
+        r = nil
+        c = di.spawn:run({"rm", fname, fname..".1"}, true)
+        table.insert(listen_handles, c:on("exit", function()
+            for _, lh in pairs(listen_handles) do
+                lh:stop()
+            end
+            collectgarbage()
+        end))
+    end))
+    table.insert(listen_handles, r:on("error", function(message)
+        print(message)
+        assert(false)
+    end))
+end
+
+table.insert(listen_handles, md:on("exit", function()
+t = di.file:tail(fname)
+table.insert(listen_handles, t:on("rotated", function()
+    rotated = true
+end))
+table.insert(listen_handles, t:on("line", function(line)
+    print("line: "..line)
+    table.insert(lines, line)
+    if line == "two" then
+        rot = di.spawn:run({"sh", "-c", "mv "..fname.." "..fname..".1; echo three > "..fname}, true)
+    elseif line == "three" then
+        assert(rotated)
+        assert(#lines == 3)
+        assert(lines[1] == "one")
+        finish()
+    end
+end))
+ap = di.spawn:run({"sh", "-c", "printf 'one\\nt' >> "..fname.."; printf 'wo\\n' >> "..fname}, true)
+end))
@@ -0,0 +1,10 @@
+-- Run with DEAI_SPAWN_LAUNCHER set, children are started by the launcher process
+assert(di.spawn.launcher)
+p = di.spawn:run({"sh", "-c", "exit 3"}, true)
+handle = p:on("exit", function(ec, sig)
+    handle:stop()
+    print(ec, sig)
+    assert(ec == 3)
+    assert(sig == 0)
+    assert(di.spawn.launcher)
+end)
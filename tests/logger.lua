@@ -0,0 +1,37 @@
+local function read_all(path)
+    local f = io.open(path, "r")
+    local content = f:read("*a")
+    f:close()
+    return content
+end
+
+di.log.log_target = di.log:file_target("./logger.txt", true)
+di.log.log_level = "warn"
+local l = di.log:logger("test")
+assert(l.name == "test")
+assert(l.log_level == "warn")
+l:log("info", "dropped\n")
+
+-- Loggers with the same name share the log level
+local l2 = di.log:logger("test")
+l2.log_level = "debug"
+assert(l.log_level == "debug")
+l:log("debug", "kept\n")
+-- Other loggers, and the log module are not affected
+assert(di.log:logger("other").log_level == "warn")
+di:log("info", "dropped\n")
+
+-- Follow the log module again
+l.log_level = "default"
+di.log.log_level = "error"
+assert(l2.log_level == "error")
+l:log("warn", "dropped\n")
+l:log("error", "error\n")
+assert(read_all("./logger.txt") == "kept\nerror\n")
+
+local t = di.log:trace_target(0)
+di.log.log_target = t
+l:log("error", "traced")
+t:dump_to_file("./logger.txt")
+assert(read_all("./logger.txt"):match("^%[%d+%.%d+%] error test: traced\n$"))
+di.log.log_target = di.log:stderr_target()
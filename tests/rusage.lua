@@ -0,0 +1,10 @@
+-- "exit" carries the resources used by the child process
+p = di.spawn:run({"sh", "-c", "i=0; while [ $i -lt 1000 ]; do i=$((i+1)); done"}, true)
+handle = p:on("exit", function(ec, sig, usage)
+    handle:stop()
+    print(usage.utime, usage.stime, usage.maxrss)
+    assert(ec == 0)
+    assert(usage.utime >= 0)
+    assert(usage.stime >= 0)
+    assert(usage.maxrss > 0)
+end)
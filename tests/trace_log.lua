@@ -0,0 +1,39 @@
+local function read_all(path)
+    local f = io.open(path, "r")
+    local content = f:read("*a")
+    f:close()
+    return content
+end
+
+-- Small enough that older messages will be dropped
+local t = di.log:trace_target(8192)
+di.log.log_target = t
+di.log.log_level = "info"
+di:log("error", "first")
+di:log("debug", "filtered")
+di:log("info", "second\n")
+t:dump_to_file("./trace_log.txt")
+
+local content = read_all("./trace_log.txt")
+assert(content:match("^%[%d+%.%d+%] error first\n%[%d+%.%d+%] info second\n$"), content)
+
+for i = 1, 1000 do
+    di:log("warn", "message "..i)
+end
+t:dump_to_file("./trace_log.txt")
+content = read_all("./trace_log.txt")
+assert(not content:match("first"))
+assert(content:match("warn message 1000\n$"))
+
+-- Errors returned by signal handlers are logged with "%.*s", the message is a
+-- di_string that is not null terminated
+di:register_module("trace_test", {})
+local lh = di.trace_test:on("ev", function()
+    return {errmsg = "handler failed"}
+end)
+di.trace_test:emit("ev")
+lh:stop()
+t:dump_to_file("./trace_log.txt")
+content = read_all("./trace_log.txt")
+assert(content:match("error Error arose when calling signal handler: handler failed\n$"), content)
+di.log.log_target = di.log:stderr_target()